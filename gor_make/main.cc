@@ -35,6 +35,7 @@ static void usage() {
 "Options:\n"
 "  -b, -m                      Ignored for compatibility.\n"
 "  -B, --always-make           Unconditionally make all targets.\n"
+"  --batch-recipes             Run all lines of a recipe in one shell.\n"
 "  -C DIRECTORY, --directory=DIRECTORY\n"
 "                              Change to DIRECTORY before doing anything.\n"
 "  -d                          Print lots of debugging information.\n"
@@ -120,7 +121,6 @@ int main(int argc, char** argv) {
   std::string scons_file;
   std::string scons_dir;
   bool dry_run = false;
-  int jobs = 1;
 
 
   // Parse arguments
@@ -143,6 +143,7 @@ int main(int argc, char** argv) {
       opts.silent = true;
     } else if (arg == "-k" || arg == "--keep-going") {
       opts.keep_going = true;
+      bp_opts.keep_going = true;
     } else if (arg == "-i" || arg == "--ignore-errors") {
       opts.ignore_errors = true;
     } else if (arg == "-B" || arg == "--always-make") {
@@ -164,21 +165,32 @@ int main(int argc, char** argv) {
     } else if (arg.substr(0, 12) == "--directory=") {
       opts.directory = arg.substr(12);
     } else if (arg == "-j" || arg == "--jobs") {
-      opts.jobs = 0;  // unlimited
-    } else if (arg.substr(0, 3) == "-j") {
-      opts.jobs = atoi(arg.substr(3).c_str());
+      // The job count is optional and may be a separate argument.
+      if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+        opts.jobs = atoi(argv[++i]);
+      } else {
+        opts.jobs = 0;  // unlimited
+      }
+      bp_opts.jobs = opts.jobs;
+    } else if (arg.substr(0, 2) == "-j") {
+      opts.jobs = atoi(arg.substr(2).c_str());
+      bp_opts.jobs = opts.jobs;
     } else if (arg.substr(0, 7) == "--jobs=") {
       opts.jobs = atoi(arg.substr(7).c_str());
+      bp_opts.jobs = opts.jobs;
     } else if (arg == "-e" || arg == "--environment-overrides") {
       // Environment overrides makefile (simplified: already imported env)
+    } else if (arg == "--batch-recipes") {
+      opts.batch_recipes = true;
     } else if (arg == "-r" || arg == "--no-builtin-rules") {
-      // No-op for now
+      opts.no_builtin_rules = true;
     } else if (arg == "-R" || arg == "--no-builtin-variables") {
       // No-op for now
     } else if (arg == "-b" || arg == "-m") {
       // Ignored for compatibility
     } else if (arg == "-S" || arg == "--no-keep-going" || arg == "--stop") {
       opts.keep_going = false;
+      bp_opts.keep_going = false;
     } else if (arg == "--no-print-directory") {
       opts.print_dir = false;
     } else if (arg == "--bp") {
@@ -281,7 +293,7 @@ int main(int argc, char** argv) {
   if (mk_mode) {
     gormake::MkScanner scanner;
     scanner.SetDryRun(dry_run);
-    scanner.SetJobs(jobs);
+    scanner.SetJobs(opts.jobs);
     if (!mk_file.empty()) {
       scanner.ScanFile(mk_file);
     } else if (!mk_dir.empty()) {
@@ -303,7 +315,7 @@ int main(int argc, char** argv) {
   if (gn_mode) {
     gormake::GnScanner scanner;
     scanner.SetDryRun(dry_run);
-    scanner.SetJobs(jobs);
+    scanner.SetJobs(opts.jobs);
     if (!gn_file.empty()) {
       scanner.ScanFile(gn_file);
     } else if (!gn_dir.empty()) {
@@ -325,7 +337,7 @@ int main(int argc, char** argv) {
   if (cmake_mode) {
     gormake::CmakeScanner scanner;
     scanner.SetDryRun(dry_run);
-    scanner.SetJobs(jobs);
+    scanner.SetJobs(opts.jobs);
     if (!cmake_file.empty()) {
       scanner.ScanFile(cmake_file);
     } else if (!cmake_dir.empty()) {
@@ -347,7 +359,7 @@ int main(int argc, char** argv) {
   if (scons_mode) {
     gormake::SconScanner scanner;
     scanner.SetDryRun(dry_run);
-    scanner.SetJobs(jobs);
+    scanner.SetJobs(opts.jobs);
     if (!scons_file.empty()) {
       scanner.ScanFile(scons_file);
     } else if (!scons_dir.empty()) {
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "action_graph.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+namespace gormake {
+
+ActionGraph::ActionGraph() {
+}
+
+ActionGraph::~ActionGraph() {
+}
+
+ActionId ActionGraph::AddAction(std::function<bool()> fn) {
+  Action a;
+  a.fn = std::move(fn);
+  actions_.push_back(std::move(a));
+  return static_cast<ActionId>(actions_.size() - 1);
+}
+
+void ActionGraph::AddDep(ActionId action, ActionId dep) {
+  if (action == kNoAction || dep == kNoAction || action == dep) return;
+  actions_[dep].dependents.push_back(action);
+  actions_[action].nr_deps++;
+}
+
+bool ActionGraph::Run(int jobs, bool keep_going) {
+  if (jobs <= 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<int> pending(actions_.size());
+  std::priority_queue<ActionId, std::vector<ActionId>,
+                      std::greater<ActionId>> ready;
+  for (size_t i = 0; i < actions_.size(); ++i) {
+    pending[i] = actions_[i].nr_deps;
+    if (pending[i] == 0) ready.push(static_cast<ActionId>(i));
+  }
+
+  std::mutex mu;
+  std::condition_variable cv;
+  int running = 0;
+  bool failed = false;
+  bool stop = false;
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mu);
+    for (;;) {
+      while (ready.empty() && running > 0 && !stop) cv.wait(lock);
+      // Nothing ready and nothing running: the rest is blocked by failures.
+      if (ready.empty() || stop) {
+        cv.notify_all();
+        return;
+      }
+      ActionId id = ready.top();
+      ready.pop();
+      running++;
+
+      lock.unlock();
+      bool ok = actions_[id].fn();
+      lock.lock();
+
+      running--;
+      if (ok) {
+        for (ActionId d : actions_[id].dependents) {
+          if (--pending[d] == 0) ready.push(d);
+        }
+      } else {
+        failed = true;
+        if (!keep_going) stop = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  size_t nr_threads = std::min(static_cast<size_t>(jobs), actions_.size());
+  if (nr_threads <= 1) {
+    worker();
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nr_threads; ++i) threads.emplace_back(worker);
+    for (auto& t : threads) t.join();
+  }
+  return !failed;
+}
+
+}  // namespace gormake
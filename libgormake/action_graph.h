@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GORMAKE_LIBGORMAKE_ACTION_GRAPH_H_
+#define GORMAKE_LIBGORMAKE_ACTION_GRAPH_H_
+
+#include <functional>
+#include <vector>
+
+#include "macros.h"
+
+namespace gormake {
+
+typedef int ActionId;
+static const ActionId kNoAction = -1;
+
+// A DAG of build actions run by a bounded pool of worker threads.
+//
+// An action becomes ready once all of its dependencies have succeeded.
+// Ready actions are started lowest id first, so with one job the actions
+// run in the order they were added (which callers make a valid
+// topological order by adding dependencies first).  When an action fails,
+// everything that depends on it is skipped.
+class ActionGraph {
+ public:
+  ActionGraph();
+  ~ActionGraph();
+
+  // Add an action.  |fn| returns false on failure.  It may be called from
+  // any worker thread.
+  ActionId AddAction(std::function<bool()> fn);
+
+  // |action| may only start after |dep| has succeeded.
+  void AddDep(ActionId action, ActionId dep);
+
+  size_t size() const { return actions_.size(); }
+
+  // Run every action, at most |jobs| at a time (|jobs| <= 0 means one per
+  // hardware thread).  Without |keep_going| no new action is started after
+  // the first failure.  Returns true if every action ran and succeeded.
+  bool Run(int jobs, bool keep_going);
+
+ private:
+  struct Action {
+    std::function<bool()> fn;
+    std::vector<ActionId> dependents;
+    int nr_deps = 0;
+  };
+
+  std::vector<Action> actions_;
+
+  DISALLOW_COPY_AND_ASSIGN(ActionGraph);
+};
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_ACTION_GRAPH_H_
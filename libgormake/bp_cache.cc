@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "bp_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "build_engine_base.h"
+
+namespace gormake {
+
+namespace {
+
+// Bumped whenever the encoding (or the parser's output) changes.
+const char kMagic[8] = {'G', 'M', 'B', 'P', 'C', 'A', '0', '1'};
+
+// 64-bit FNV-1a.
+uint64_t HashBytes(std::string_view s) {
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+std::string DirOf(const std::string& path) {
+  size_t slash = path.find_last_of('/');
+  return (slash != std::string::npos) ? path.substr(0, slash) : ".";
+}
+
+// ---- Encoding ----
+
+template <typename T>
+void Put(std::string* out, T v) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void PutString(std::string* out, std::string_view s) {
+  Put<uint32_t>(out, static_cast<uint32_t>(s.size()));
+  out->append(s);
+}
+
+void PutValue(std::string* out, const BpValue& v);
+
+std::string_view KeyOf(const BpProperty& p) { return p.key; }
+const BpValue& ValueOf(const BpProperty& p) { return p.value; }
+std::string_view KeyOf(const std::pair<const std::string, BpValue>& p) {
+  return p.first;
+}
+const BpValue& ValueOf(const std::pair<const std::string, BpValue>& p) {
+  return p.second;
+}
+
+// Maps and module properties are both written as sorted key/value pairs.
+template <typename Map>
+void PutMap(std::string* out, const Map& m) {
+  Put<uint32_t>(out, static_cast<uint32_t>(m.size()));
+  for (const auto& entry : m) {
+    PutString(out, KeyOf(entry));
+    PutValue(out, ValueOf(entry));
+  }
+}
+
+void PutValue(std::string* out, const BpValue& v) {
+  Put<uint8_t>(out, static_cast<uint8_t>(v.type()));
+  switch (v.type()) {
+    case BpValue::STRING: PutString(out, v.str()); break;
+    case BpValue::INT: Put<int64_t>(out, v.int_val()); break;
+    case BpValue::BOOL: Put<uint8_t>(out, v.bool_val() ? 1 : 0); break;
+    case BpValue::LIST:
+      Put<uint32_t>(out, static_cast<uint32_t>(v.list().size()));
+      for (const auto& e : v.list()) PutValue(out, e);
+      break;
+    case BpValue::MAP: PutMap(out, v.map()); break;
+    case BpValue::NONE: break;
+  }
+}
+
+std::string EncodeFile(const BpFile& f) {
+  std::string out;
+  Put<uint32_t>(&out, static_cast<uint32_t>(f.modules.size()));
+  for (const auto& m : f.modules) {
+    PutString(&out, m.type);
+    PutString(&out, m.name);
+    PutMap(&out, m.properties);
+  }
+  PutMap(&out, f.variables);
+  Put<uint32_t>(&out, static_cast<uint32_t>(f.globs.size()));
+  for (const auto& g : f.globs) {
+    PutString(&out, g.pattern);
+    Put<uint32_t>(&out, static_cast<uint32_t>(g.matches.size()));
+    for (const auto& m : g.matches) PutString(&out, m);
+  }
+  return out;
+}
+
+// ---- Decoding ----
+
+// Bounds-checked reader over a byte range.  Any overrun makes ok() false;
+// a damaged cache entry is then treated as a miss.
+class Reader {
+ public:
+  Reader(const char* p, size_t len) : p_(p), end_(p + len) {}
+
+  bool ok() const { return ok_; }
+  bool AtEnd() const { return p_ == end_; }
+  void Fail() { ok_ = false; }
+
+  template <typename T>
+  T Get() {
+    T v = T();
+    if (!Need(sizeof(T))) return v;
+    memcpy(&v, p_, sizeof(T));
+    p_ += sizeof(T);
+    return v;
+  }
+
+  std::string GetString() { return std::string(GetView()); }
+
+  // A view into the underlying bytes.
+  std::string_view GetView() {
+    uint32_t n = Get<uint32_t>();
+    if (!Need(n)) return std::string_view();
+    std::string_view s(p_, n);
+    p_ += n;
+    return s;
+  }
+
+  const char* GetBytes(size_t n) {
+    if (!Need(n)) return nullptr;
+    const char* p = p_;
+    p_ += n;
+    return p;
+  }
+
+ private:
+  bool Need(size_t n) {
+    if (ok_ && static_cast<size_t>(end_ - p_) >= n) return true;
+    ok_ = false;
+    return false;
+  }
+
+  const char* p_;
+  const char* end_;
+  bool ok_ = true;
+};
+
+BpValue GetValue(Reader* r, BpArena* arena, int depth);
+
+void GetEntries(Reader* r, BpArena* arena, int depth,
+                std::vector<BpProperty>* out) {
+  uint32_t n = r->Get<uint32_t>();
+  for (uint32_t i = 0; i < n && r->ok(); ++i) {
+    std::string_view key = arena->Intern(r->GetView());
+    out->push_back(BpProperty{key, GetValue(r, arena, depth)});
+  }
+}
+
+BpValue GetValue(Reader* r, BpArena* arena, int depth) {
+  if (depth > 64) {
+    r->Fail();
+    return BpValue();
+  }
+  switch (r->Get<uint8_t>()) {
+    case BpValue::STRING: return BpValue::String(arena, r->GetView());
+    case BpValue::INT: return BpValue::Int(r->Get<int64_t>());
+    case BpValue::BOOL: return BpValue::Bool(r->Get<uint8_t>() != 0);
+    case BpValue::LIST: {
+      std::vector<BpValue> items;
+      uint32_t n = r->Get<uint32_t>();
+      for (uint32_t i = 0; i < n && r->ok(); ++i) {
+        items.push_back(GetValue(r, arena, depth + 1));
+      }
+      return BpValue::List(arena, items);
+    }
+    case BpValue::MAP: {
+      std::vector<BpProperty> entries;
+      GetEntries(r, arena, depth + 1, &entries);
+      return BpValue::Map(BpMap::Build(arena, std::move(entries)));
+    }
+    case BpValue::NONE: return BpValue();
+    default: r->Fail(); return BpValue();
+  }
+}
+
+bool DecodeFile(const char* data, size_t len, BpFile* f) {
+  Reader r(data, len);
+  uint32_t nr_modules = r.Get<uint32_t>();
+  for (uint32_t i = 0; i < nr_modules && r.ok(); ++i) {
+    f->modules.emplace_back();
+    BpModule& m = f->modules.back();
+    m.type = r.GetString();
+    m.name = r.GetString();
+    std::vector<BpProperty> props;
+    GetEntries(&r, f->arena.get(), 0, &props);
+    m.properties = BpMap::Build(f->arena.get(), std::move(props));
+  }
+  std::vector<BpProperty> vars;
+  GetEntries(&r, f->arena.get(), 0, &vars);
+  for (const auto& v : vars) {
+    f->variables.emplace(std::string(v.key), v.value);
+  }
+  uint32_t nr_globs = r.Get<uint32_t>();
+  for (uint32_t i = 0; i < nr_globs && r.ok(); ++i) {
+    f->globs.emplace_back();
+    BpGlob& g = f->globs.back();
+    g.pattern = r.GetString();
+    uint32_t nr_matches = r.Get<uint32_t>();
+    for (uint32_t k = 0; k < nr_matches && r.ok(); ++k) {
+      g.matches.push_back(r.GetString());
+    }
+  }
+  return r.ok() && r.AtEnd();
+}
+
+}  // namespace
+
+BpParseCache::BpParseCache(const std::string& cache_path)
+    : cache_path_(cache_path) {
+}
+
+BpParseCache::~BpParseCache() {
+}
+
+void BpParseCache::Load() {
+  loaded_.clear();
+  if (!file_.Open(cache_path_, O_RDONLY)) return;
+  const char* mem = static_cast<const char*>(file_.GetFileMem());
+  Reader r(mem, static_cast<size_t>(file_.GetLength()));
+  const char* magic = r.GetBytes(sizeof(kMagic));
+  if (magic == nullptr || memcmp(magic, kMagic, sizeof(kMagic)) != 0) return;
+  while (r.ok() && !r.AtEnd()) {
+    std::string path = r.GetString();
+    Entry e;
+    e.size = r.Get<uint64_t>();
+    e.mtime_ns = r.Get<int64_t>();
+    e.hash = r.Get<uint64_t>();
+    e.len = r.Get<uint64_t>();
+    e.data = r.GetBytes(e.len);
+    if (!r.ok()) break;
+    loaded_[path] = e;
+  }
+}
+
+bool BpParseCache::Parse(const std::string& path, BpFile* result,
+                         std::string* error) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    *error = "cannot open file: " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  Entry e;
+  e.size = static_cast<uint64_t>(st.st_size);
+  e.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+               st.st_mtim.tv_nsec;
+
+  // loaded_ is not modified after Load(), so it is read without the lock.
+  auto it = loaded_.find(path);
+  const Entry* old = (it != loaded_.end()) ? &it->second : nullptr;
+  if (old != nullptr && old->size == e.size && old->mtime_ns == e.mtime_ns &&
+      Restore(path, old->data, old->len, result)) {
+    Record(path, *old);
+    return true;
+  }
+
+  // Map the file; the parser tokenizes straight out of the mapping.
+  UnixFile::RdFile file;
+  std::string_view source;
+  if (e.size > 0) {
+    if (!file.Open(path, O_RDONLY)) {
+      *error = "cannot open file: " + path + ": " + std::strerror(errno);
+      return false;
+    }
+    source = std::string_view(static_cast<const char*>(file.GetFileMem()),
+                              static_cast<size_t>(file.GetLength()));
+  }
+  e.hash = HashBytes(source);
+
+  // Touched but not changed.
+  if (old != nullptr && old->size == e.size && old->hash == e.hash) {
+    *result = BpFile();
+    if (Restore(path, old->data, old->len, result)) {
+      e.data = old->data;
+      e.len = old->len;
+      Record(path, std::move(e));
+      return true;
+    }
+  }
+
+  *result = BpFile();
+  BpParser parser;
+  parser.set_base_dir(DirOf(path));
+  if (!parser.ParseSource(source, path, result)) {
+    *error = parser.GetError();
+    return false;
+  }
+  e.payload = EncodeFile(*result);
+  std::lock_guard<std::mutex> lock(mu_);
+  misses_++;
+  dirty_ = true;
+  used_[path] = std::move(e);
+  return true;
+}
+
+bool BpParseCache::Restore(const std::string& path, const char* data,
+                           size_t len, BpFile* result) const {
+  if (!DecodeFile(data, len, result)) return false;
+  if (!result->globs.empty()) {
+    BpParser parser;
+    parser.set_base_dir(DirOf(path));
+    for (const auto& g : result->globs) {
+      if (parser.ExpandGlob(g.pattern) != g.matches) return false;
+    }
+  }
+  return true;
+}
+
+void BpParseCache::Record(const std::string& path, Entry entry) {
+  std::lock_guard<std::mutex> lock(mu_);
+  hits_++;
+  auto it = loaded_.find(path);
+  if (it == loaded_.end() || it->second.mtime_ns != entry.mtime_ns) {
+    dirty_ = true;
+  }
+  used_[path] = std::move(entry);
+}
+
+bool BpParseCache::Save() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!dirty_ && used_.size() == loaded_.size()) return true;
+
+  std::vector<const std::string*> paths;
+  for (const auto& [path, e] : used_) paths.push_back(&path);
+  std::sort(paths.begin(), paths.end(),
+            [](const std::string* a, const std::string* b) { return *a < *b; });
+
+  std::string out(kMagic, sizeof(kMagic));
+  for (const std::string* path : paths) {
+    const Entry& e = used_[*path];
+    const char* data = e.payload.empty() ? e.data : e.payload.data();
+    size_t len = e.payload.empty() ? e.len : e.payload.size();
+    PutString(&out, *path);
+    Put<uint64_t>(&out, e.size);
+    Put<int64_t>(&out, e.mtime_ns);
+    Put<uint64_t>(&out, e.hash);
+    Put<uint64_t>(&out, len);
+    out.append(data, len);
+  }
+
+  std::string dir = DirOf(cache_path_);
+  if (!buildutil::FileExists(dir)) buildutil::MkdirP(dir);
+  std::string tmp_path = cache_path_ + ".tmp";
+  {
+    std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!f.write(out.data(), out.size()) || !f.flush()) {
+      fprintf(stderr, "gor_make: warning: cannot write %s\n",
+              tmp_path.c_str());
+      return false;
+    }
+  }
+  if (rename(tmp_path.c_str(), cache_path_.c_str()) != 0) {
+    fprintf(stderr, "gor_make: warning: cannot write %s: %s\n",
+            cache_path_.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  dirty_ = false;
+  return true;
+}
+
+}  // namespace gormake
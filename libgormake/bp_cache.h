@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef GORMAKE_LIBGORMAKE_BP_CACHE_H_
+#define GORMAKE_LIBGORMAKE_BP_CACHE_H_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "bp_parser.h"
+#include "macros.h"
+#include "rd_file.h"
+
+namespace gormake {
+
+// A persistent cache of parsed Android.bp files.
+//
+// Each entry holds one serialized BpFile keyed by its path, size,
+// modification time (ns) and a hash of its contents.  The whole cache is a
+// single file that is mmap'd by Load(); entries are decoded only when they
+// are hit.  A file whose size and mtime match is taken as unchanged; if
+// only the mtime moved, its contents are hashed and compared.  Entries of
+// files that used globs are also dropped once a glob matches different
+// files.
+//
+// Parse() may be called from several threads at once.
+class BpParseCache {
+ public:
+  explicit BpParseCache(const std::string& cache_path);
+  ~BpParseCache();
+
+  // Map the cache file.  A missing or unreadable cache is simply empty.
+  void Load();
+
+  // Parse |path| into |result|, from the cache if the entry is still valid.
+  // On a parse error returns false and sets |error|.
+  bool Parse(const std::string& path, BpFile* result, std::string* error);
+
+  // Write the entries used since Load() back to the cache file, if anything
+  // changed.  Files that were not parsed this time are dropped.
+  bool Save();
+
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+ private:
+  struct Entry {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t hash = 0;
+    std::string payload;  // only set for entries to be saved
+    const char* data = nullptr;  // payload in the mapped file
+    size_t len = 0;
+  };
+
+  // Decode a cached payload and check that its globs still match.
+  bool Restore(const std::string& path, const char* data, size_t len,
+               BpFile* result) const;
+
+  void Record(const std::string& path, Entry entry);
+
+  std::string cache_path_;
+  UnixFile::RdFile file_;
+  std::unordered_map<std::string, Entry> loaded_;
+
+  std::mutex mu_;
+  std::unordered_map<std::string, Entry> used_;
+  bool dirty_ = false;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(BpParseCache);
+};
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_BP_CACHE_H_
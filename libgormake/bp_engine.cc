@@ -15,7 +15,11 @@
  */
 
 #include "bp_engine.h"
+#include "bp_cache.h"
 #include "build_engine_base.h"
+#include "build_log.h"
+#include "dir_walker.h"
+#include "thread_pool.h"
 
 #include <algorithm>
 #include <cerrno>
@@ -26,6 +30,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -34,11 +39,13 @@ namespace gormake {
 
 namespace fs = std::filesystem;
 
-// Helper: get file modification time
-static long GetMtime(const std::string& path) {
+// Modification time in nanoseconds, or -1 if |path| does not exist.
+// Whole seconds are too coarse once actions run back to back.
+static int64_t GetMtimeNs(const std::string& path) {
   struct stat st;
-  if (stat(path.c_str(), &st) != 0) return 0;
-  return st.st_mtime;
+  if (stat(path.c_str(), &st) != 0) return -1;
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+         st.st_mtim.tv_nsec;
 }
 
 // Helper: join strings with separator
@@ -83,7 +90,9 @@ int BpEngine::Run(const BpBuildOptions& opts) {
     return 0;
   }
 
-  // Parse Android.bp files
+  // Parse Android.bp files, reusing unchanged ones from the last run.
+  parse_cache_.reset(new BpParseCache(opts.build_dir + "/.bp_cache"));
+  parse_cache_->Load();
   std::string bp_path = opts.bp_file_path;
   if (!buildutil::FileExists(bp_path)) {
     // Check if it's a directory
@@ -115,6 +124,13 @@ int BpEngine::Run(const BpBuildOptions& opts) {
     }
   }
 
+  // Like the build log, the cache is only written by real builds.
+  if (!opts.json_output && !opts.dry_run) parse_cache_->Save();
+  if (opts.verbose) {
+    fprintf(stderr, "gor_make: Android.bp files: %zu parsed, %zu cached\n",
+            parse_cache_->misses(), parse_cache_->hits());
+  }
+
   if (modules_.empty()) {
     fprintf(stderr, "gor_make: *** No modules found in Android.bp.\n");
     return 1;
@@ -129,6 +145,8 @@ int BpEngine::Run(const BpBuildOptions& opts) {
     return 0;
   }
 
+  ComputeClosures();
+
   // Determine goals
   std::vector<std::string> goals = opts.goals;
   if (goals.empty()) {
@@ -146,16 +164,25 @@ int BpEngine::Run(const BpBuildOptions& opts) {
     }
   }
 
-  // Build each goal
+  // Header dependencies of earlier builds.
+  if (!opts.dry_run) build_log_.Open(opts.build_dir + "/.bp_log");
+
+  // Plan every goal into one action graph (a compile per source, an
+  // archive or link per module), then run it with up to -j jobs.
   int result = 0;
+  ActionGraph graph;
+  std::unordered_set<std::string> visited;
+  std::unordered_set<std::string> building;
   for (const auto& goal : goals) {
-    std::unordered_set<std::string> visited;
-    std::unordered_set<std::string> building;
-    if (!BuildModule(goal, visited, building)) {
+    if (!PlanModule(goal, visited, building, &graph)) {
       result = 1;
-      if (!opts.keep_going) break;
+      if (!opts.keep_going) return result;
     }
   }
+  if (!graph.Run(opts.jobs, opts.keep_going)) {
+    result = 1;
+  }
+  build_log_.Close();
 
   if (result == 0 && !goals.empty()) {
     fprintf(stderr, "Build completed successfully.\n");
@@ -164,6 +191,74 @@ int BpEngine::Run(const BpBuildOptions& opts) {
   return result;
 }
 
+namespace {
+
+// One Android.bp found by the tree walk and parsed on a worker thread.
+struct BpParseResult {
+  std::string path;
+  bool ok = false;
+  bool threw = false;   // the parser threw; |error| is the reason
+  std::string error;
+  BpFile file;
+};
+
+// Walks a directory tree and parses every Android.bp in it on a thread
+// pool.  Each directory is listed by its own task, and each file found is
+// parsed as soon as it is found, so parsing overlaps with the walk.
+class BpTreeParser {
+ public:
+  // Files whose canonical path is in |skip| are not parsed again.  |skip|
+  // must not change while Run() is in progress.
+  BpTreeParser(BpParseCache* cache,
+               const std::unordered_set<std::string>* skip)
+      : cache_(cache), skip_(skip), walker_({"Android.bp"}), pool_(0) {}
+
+  // Walk |root| and parse everything.  Results are sorted by path so that
+  // merging them does not depend on thread timing.
+  std::vector<std::unique_ptr<BpParseResult>> Run(const std::string& root) {
+    std::function<void(const std::string&)> on_file =
+        [this](const std::string& path) {
+          std::error_code ec;
+          std::string abs_path = fs::canonical(path, ec).string();
+          if (!ec && skip_->count(abs_path) > 0) return;
+          pool_.Submit([this, path]() { Parse(path); });
+        };
+    walker_.Walk(root, &pool_, on_file);
+    pool_.Wait();
+    std::sort(results_.begin(), results_.end(),
+              [](const std::unique_ptr<BpParseResult>& a,
+                 const std::unique_ptr<BpParseResult>& b) {
+                return a->path < b->path;
+              });
+    return std::move(results_);
+  }
+
+ private:
+  void Parse(const std::string& path) {
+    std::unique_ptr<BpParseResult> r(new BpParseResult);
+    r->path = path;
+    try {
+      r->ok = cache_->Parse(path, &r->file, &r->error);
+    } catch (const std::exception& e) {
+      r->threw = true;
+      r->error = e.what();
+    } catch (...) {
+      r->threw = true;
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    results_.push_back(std::move(r));
+  }
+
+  BpParseCache* cache_;
+  const std::unordered_set<std::string>* skip_;
+  DirWalker walker_;
+  std::mutex mu_;
+  std::vector<std::unique_ptr<BpParseResult>> results_;
+  ThreadPool pool_;  // last: joined before the members above go away
+};
+
+}  // namespace
+
 bool BpEngine::ParseBpFiles(const std::string& root_path) {
   if (!ParseSingleBp(root_path)) {
     return false;
@@ -172,53 +267,38 @@ bool BpEngine::ParseBpFiles(const std::string& root_path) {
   // Parse Android.bp files in subdirectories
   fs::path root_dir = fs::path(root_path).parent_path();
   if (root_dir.empty()) root_dir = ".";
-  std::string root_abs = fs::canonical(root_dir).string();
-
-  for (auto& entry : fs::recursive_directory_iterator(root_dir)) {
-    if (entry.path().filename() == "Android.bp") {
-      std::string path = entry.path().string();
-      // Skip the root file (already parsed)
-      std::string entry_abs = fs::canonical(entry.path()).string();
-      if (entry_abs == root_abs) continue;
-      // Skip common output/build directories
-      std::string entry_str = entry.path().string();
-      if (entry_str.find("/out/") != std::string::npos) continue;
-      if (entry_str.find("/bazel-") != std::string::npos) continue;
-      if (entry_str.find("/.git/") != std::string::npos) continue;
-      try {
-        ParseSingleBp(path);
-      } catch (const std::exception& e) {
-        std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
-                     path.c_str(), e.what());
-      } catch (...) {
-        std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
-                     path.c_str());
-      }
-    }
-  }
-
+  ParseBpTree(root_dir.string());
   return true;
 }
 
 void BpEngine::ParseBpDirectory(const std::string& dir_path) {
   // Walk the directory tree and parse all Android.bp files
-  for (auto& entry : fs::recursive_directory_iterator(dir_path)) {
-    if (entry.path().filename() == "Android.bp") {
-      std::string entry_str = entry.path().string();
-      // Skip common output/build directories
-      if (entry_str.find("/out/") != std::string::npos) continue;
-      if (entry_str.find("/bazel-") != std::string::npos) continue;
-      if (entry_str.find("/.git/") != std::string::npos) continue;
-      try {
-        ParseSingleBp(entry_str);
-      } catch (const std::exception& e) {
-        std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
-                     entry_str.c_str(), e.what());
-      } catch (...) {
+  ParseBpTree(dir_path);
+}
+
+void BpEngine::ParseBpTree(const std::string& dir_path) {
+  // The root file may already have been parsed by ParseBpFiles(); the walk
+  // skips it, and the check below catches files reached via two paths.
+  BpTreeParser tree(parse_cache_.get(), &parsed_files_);
+  for (auto& r : tree.Run(dir_path)) {
+    std::string abs_path = fs::canonical(r->path).string();
+    if (!parsed_files_.insert(abs_path).second) continue;
+    if (r->threw) {
+      if (r->error.empty()) {
         std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
-                     entry_str.c_str());
+                     r->path.c_str());
+      } else {
+        std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
+                     r->path.c_str(), r->error.c_str());
       }
+      continue;
+    }
+    if (!r->ok) {
+      fprintf(stderr, "gor_make: Parse error in %s: %s\n",
+              r->path.c_str(), r->error.c_str());
+      continue;
     }
+    AddBpFile(r->path, std::move(r->file));
   }
 }
 
@@ -228,14 +308,19 @@ bool BpEngine::ParseSingleBp(const std::string& path) {
   if (parsed_files_.count(abs_path) > 0) return true;
   parsed_files_.insert(abs_path);
 
-  BpParser parser;
   BpFile result;
-  if (!parser.ParseFile(path, &result)) {
+  std::string error;
+  if (!parse_cache_->Parse(path, &result, &error)) {
     fprintf(stderr, "gor_make: Parse error in %s: %s\n",
-            path.c_str(), parser.GetError().c_str());
+            path.c_str(), error.c_str());
     return false;
   }
 
+  AddBpFile(path, std::move(result));
+  return true;
+}
+
+void BpEngine::AddBpFile(const std::string& path, BpFile result) {
   std::string src_dir = fs::path(path).parent_path().string();
   if (src_dir.empty()) src_dir = ".";
 
@@ -253,7 +338,6 @@ bool BpEngine::ParseSingleBp(const std::string& path) {
   }
 
   bp_files_.push_back(std::move(result));
-  return true;
 }
 
 std::unique_ptr<BpBuildModule> BpEngine::ConvertModule(
@@ -263,13 +347,13 @@ std::unique_ptr<BpBuildModule> BpEngine::ConvertModule(
   mod->src_dir = src_dir;
 
   // Get name
-  auto name_it = bp_module.properties.find("name");
-  if (name_it == bp_module.properties.end() || !name_it->second.IsString()) {
+  const BpValue* name = bp_module.properties.Find("name");
+  if (name == nullptr || !name->IsString()) {
     // Silently skip non-buildable module types that don't have names
     // (package, license, license_kind, etc.)
     return nullptr;
   }
-  mod->name = name_it->second.AsString();
+  mod->name = name->AsString();
 
   // Set module type flags based on type
   const std::string& t = bp_module.type;
@@ -309,80 +393,85 @@ std::unique_ptr<BpBuildModule> BpEngine::ConvertModule(
   // For any other unknown type, keep the module but don't set flags
 
   // Extract properties
-  auto it = bp_module.properties.find("srcs");
-  if (it != bp_module.properties.end()) {
-    mod->srcs = ResolveSrcs(it->second, src_dir);
+  const BpValue* val = bp_module.properties.Find("defaults");
+  if (val != nullptr) {
+    mod->defaults = GetStringList(*val, src_dir);
+  }
+
+  val = bp_module.properties.Find("srcs");
+  if (val != nullptr) {
+    mod->srcs = ResolveSrcs(*val, src_dir);
   }
 
-  it = bp_module.properties.find("shared_libs");
-  if (it != bp_module.properties.end()) {
-    mod->shared_libs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("shared_libs");
+  if (val != nullptr) {
+    mod->shared_libs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("static_libs");
-  if (it != bp_module.properties.end()) {
-    mod->static_libs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("static_libs");
+  if (val != nullptr) {
+    mod->static_libs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("whole_static_libs");
-  if (it != bp_module.properties.end()) {
-    mod->whole_static_libs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("whole_static_libs");
+  if (val != nullptr) {
+    mod->whole_static_libs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("header_libs");
-  if (it != bp_module.properties.end()) {
-    mod->header_libs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("header_libs");
+  if (val != nullptr) {
+    mod->header_libs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("cflags");
-  if (it != bp_module.properties.end()) {
-    mod->cflags = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("cflags");
+  if (val != nullptr) {
+    mod->cflags = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("cppflags");
-  if (it != bp_module.properties.end()) {
-    mod->cppflags = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("cppflags");
+  if (val != nullptr) {
+    mod->cppflags = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("ldflags");
-  if (it != bp_module.properties.end()) {
-    mod->ldflags = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("ldflags");
+  if (val != nullptr) {
+    mod->ldflags = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("include_dirs");
-  if (it != bp_module.properties.end()) {
-    mod->include_dirs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("include_dirs");
+  if (val != nullptr) {
+    mod->include_dirs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("local_include_dirs");
-  if (it != bp_module.properties.end()) {
-    mod->local_include_dirs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("local_include_dirs");
+  if (val != nullptr) {
+    mod->local_include_dirs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("export_include_dirs");
-  if (it != bp_module.properties.end()) {
-    mod->export_include_dirs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("export_include_dirs");
+  if (val != nullptr) {
+    mod->export_include_dirs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("system_shared_libs");
-  if (it != bp_module.properties.end()) {
-    mod->system_shared_libs = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("system_shared_libs");
+  if (val != nullptr) {
+    mod->system_shared_libs = GetStringList(*val, src_dir);
   }
 
-  it = bp_module.properties.find("stl");
-  if (it != bp_module.properties.end() && it->second.IsString()) {
-    mod->stl = it->second.AsString();
+  val = bp_module.properties.Find("stl");
+  if (val != nullptr && val->IsString()) {
+    mod->stl = val->AsString();
   }
 
   // Genrule properties
-  it = bp_module.properties.find("cmd");
-  if (it != bp_module.properties.end() && it->second.IsString()) {
-    mod->gen_cmd = it->second.AsString();
+  val = bp_module.properties.Find("cmd");
+  if (val != nullptr && val->IsString()) {
+    mod->gen_cmd = val->AsString();
   }
 
-  it = bp_module.properties.find("out");
-  if (it != bp_module.properties.end()) {
-    mod->gen_out = GetStringList(it->second, src_dir);
+  val = bp_module.properties.Find("out");
+  if (val != nullptr) {
+    mod->gen_out = GetStringList(*val, src_dir);
   }
 
   return mod;
@@ -394,7 +483,7 @@ std::vector<std::string> BpEngine::GetStringList(const BpValue& val,
   if (val.IsString()) {
     result.push_back(val.AsString());
   } else if (val.IsList()) {
-    for (const auto& item : val.list_val) {
+    for (const auto& item : val.list()) {
       if (item.IsString()) {
         result.push_back(item.AsString());
       }
@@ -420,7 +509,7 @@ std::vector<std::string> BpEngine::ResolveSrcs(const BpValue& val,
       result.push_back(src_dir + "/" + s);
     }
   } else if (val.IsList()) {
-    for (const auto& item : val.list_val) {
+    for (const auto& item : val.list()) {
       if (item.IsString()) {
         std::string s = item.AsString();
         if (s.find('*') != std::string::npos) {
@@ -439,75 +528,210 @@ std::vector<std::string> BpEngine::ResolveSrcs(const BpValue& val,
 }
 
 void BpEngine::ApplyDefaults() {
-  // Build a map of defaults name -> BpModule*
-  std::map<std::string, const BpModule*> defaults_map;
+  // Index cc_defaults modules by name; the first definition wins, as for
+  // other modules.
+  std::unordered_map<std::string, const BpModule*> index;
   for (const auto& bp_file : bp_files_) {
     for (const auto& mod : bp_file.modules) {
-      if (mod.type == "cc_defaults") {
-        defaults_map[mod.name] = &mod;
+      if (mod.type != "cc_defaults") continue;
+      const BpValue* name = mod.properties.Find("name");
+      if (name != nullptr && name->IsString()) {
+        index.emplace(name->AsString(), &mod);
       }
     }
   }
 
-  // Apply defaults to each build module
+  // Flatten every defaults chain once.  After this |flat| is only read.
+  std::unordered_map<std::string, std::unique_ptr<BpBuildModule>> flat;
+  std::unordered_set<std::string> active;
+  std::vector<BpBuildModule*> users;
   for (const auto& [name, mod] : modules_) {
-    // Find the original BpModule to get its defaults list
-    for (const auto& bp_file : bp_files_) {
-      for (const auto& bp_mod : bp_file.modules) {
-        if (bp_mod.name == name) {
-          auto defaults_it = bp_mod.properties.find("defaults");
-          if (defaults_it != bp_mod.properties.end() && defaults_it->second.IsList()) {
-            for (const auto& d : defaults_it->second.list_val) {
-              if (d.IsString()) {
-                auto dit = defaults_map.find(d.AsString());
-                if (dit != defaults_map.end()) {
-                  ApplyDefaultsToModule(*dit->second, mod.get());
-                }
-              }
-            }
-          }
-        }
+    if (mod->defaults.empty()) continue;
+    for (const auto& d : mod->defaults) {
+      FlattenDefaults(d, index, &flat, &active);
+    }
+    users.push_back(mod.get());
+  }
+
+  ParallelFor(users.size(), opts_->jobs, [&](size_t i) {
+    for (const auto& d : users[i]->defaults) {
+      auto it = flat.find(d);
+      if (it != flat.end() && it->second != nullptr) {
+        ApplyDefaultsToModule(*it->second, users[i]);
       }
     }
+  });
+}
+
+const BpBuildModule* BpEngine::FlattenDefaults(
+    const std::string& name,
+    const std::unordered_map<std::string, const BpModule*>& index,
+    std::unordered_map<std::string, std::unique_ptr<BpBuildModule>>* flat,
+    std::unordered_set<std::string>* active) {
+  auto it = flat->find(name);
+  if (it != flat->end()) return it->second.get();
+  if (active->count(name) > 0) {
+    fprintf(stderr, "gor_make: Warning: cyclic defaults in '%s'\n",
+            name.c_str());
+    return nullptr;
   }
+  auto iit = index.find(name);
+  if (iit == index.end()) {
+    (*flat)[name] = nullptr;
+    return nullptr;
+  }
+
+  const BpModule& bp_mod = *iit->second;
+  auto mod = std::make_unique<BpBuildModule>();
+  auto get_list = [&](const char* prop, std::vector<std::string>* target) {
+    const BpValue* val = bp_mod.properties.Find(prop);
+    if (val != nullptr) *target = GetStringList(*val, mod->src_dir);
+  };
+  get_list("defaults", &mod->defaults);
+  get_list("cflags", &mod->cflags);
+  get_list("cppflags", &mod->cppflags);
+  get_list("ldflags", &mod->ldflags);
+  get_list("include_dirs", &mod->include_dirs);
+  get_list("local_include_dirs", &mod->local_include_dirs);
+  get_list("export_include_dirs", &mod->export_include_dirs);
+  get_list("system_shared_libs", &mod->system_shared_libs);
+  get_list("srcs", &mod->srcs);
+  get_list("shared_libs", &mod->shared_libs);
+  get_list("static_libs", &mod->static_libs);
+  get_list("whole_static_libs", &mod->whole_static_libs);
+  get_list("header_libs", &mod->header_libs);
+
+  // A defaults module takes its own defaults like any other module.
+  active->insert(name);
+  for (const auto& d : mod->defaults) {
+    const BpBuildModule* nested = FlattenDefaults(d, index, flat, active);
+    if (nested != nullptr) ApplyDefaultsToModule(*nested, mod.get());
+  }
+  active->erase(name);
+
+  const BpBuildModule* result = mod.get();
+  (*flat)[name] = std::move(mod);
+  return result;
 }
 
-void BpEngine::ApplyDefaultsToModule(const BpModule& defaults,
+void BpEngine::ApplyDefaultsToModule(const BpBuildModule& defaults,
                                       BpBuildModule* module) {
   // Apply defaults properties, but only for properties that aren't already set
   // in the module (module-specific values take precedence).
-  auto apply_list = [&](const char* prop, std::vector<std::string>* target) {
+  auto apply_list = [&](const std::vector<std::string>& defaults_list,
+                        std::vector<std::string>* target) {
     if (!target->empty()) return;  // Already set by module
-    auto it = defaults.properties.find(prop);
-    if (it != defaults.properties.end()) {
-      *target = GetStringList(it->second, module->src_dir);
-    }
+    *target = defaults_list;
   };
 
-  apply_list("cflags", &module->cflags);
-  apply_list("cppflags", &module->cppflags);
-  apply_list("ldflags", &module->ldflags);
-  apply_list("include_dirs", &module->include_dirs);
-  apply_list("local_include_dirs", &module->local_include_dirs);
-  apply_list("export_include_dirs", &module->export_include_dirs);
-  apply_list("system_shared_libs", &module->system_shared_libs);
+  apply_list(defaults.cflags, &module->cflags);
+  apply_list(defaults.cppflags, &module->cppflags);
+  apply_list(defaults.ldflags, &module->ldflags);
+  apply_list(defaults.include_dirs, &module->include_dirs);
+  apply_list(defaults.local_include_dirs, &module->local_include_dirs);
+  apply_list(defaults.export_include_dirs, &module->export_include_dirs);
+  apply_list(defaults.system_shared_libs, &module->system_shared_libs);
   
   // For srcs, shared_libs, static_libs — always prepend defaults
   // (these are additive in Blueprint semantics)
-  auto prepend_list = [&](const char* prop, std::vector<std::string>* target) {
-    auto it = defaults.properties.find(prop);
-    if (it != defaults.properties.end()) {
-      auto defaults_list = GetStringList(it->second, module->src_dir);
-      std::vector<std::string> combined = defaults_list;
-      combined.insert(combined.end(), target->begin(), target->end());
-      *target = combined;
-    }
+  auto prepend_list = [&](const std::vector<std::string>& defaults_list,
+                          std::vector<std::string>* target) {
+    target->insert(target->begin(), defaults_list.begin(),
+                   defaults_list.end());
   };
-  prepend_list("srcs", &module->srcs);
-  prepend_list("shared_libs", &module->shared_libs);
-  prepend_list("static_libs", &module->static_libs);
-  prepend_list("whole_static_libs", &module->whole_static_libs);
-  prepend_list("header_libs", &module->header_libs);
+  prepend_list(defaults.srcs, &module->srcs);
+  prepend_list(defaults.shared_libs, &module->shared_libs);
+  prepend_list(defaults.static_libs, &module->static_libs);
+  prepend_list(defaults.whole_static_libs, &module->whole_static_libs);
+  prepend_list(defaults.header_libs, &module->header_libs);
+}
+
+// Concatenate |own| and |parts| without duplicates.  With |keep_last| the
+// last occurrence of an item is kept instead of the first, as a linker
+// needs for archives.  If |own| is empty and a single part is not, that
+// part is shared instead of copied.
+template <typename T>
+static std::shared_ptr<const std::vector<T>> MergeClosures(
+    const std::vector<T>& own,
+    const std::vector<std::shared_ptr<const std::vector<T>>>& parts,
+    bool keep_last) {
+  const std::shared_ptr<const std::vector<T>>* only = nullptr;
+  size_t nr_nonempty = 0;
+  for (const auto& part : parts) {
+    if (part == nullptr || part->empty()) continue;
+    only = &part;
+    nr_nonempty++;
+  }
+  if (own.empty() && nr_nonempty == 1) return *only;
+
+  std::vector<T> all = own;
+  for (const auto& part : parts) {
+    if (part != nullptr) all.insert(all.end(), part->begin(), part->end());
+  }
+  if (keep_last) std::reverse(all.begin(), all.end());
+  std::unordered_set<T> seen;
+  auto result = std::make_shared<std::vector<T>>();
+  for (const auto& item : all) {
+    if (seen.insert(item).second) result->push_back(item);
+  }
+  if (keep_last) std::reverse(result->begin(), result->end());
+  return result;
+}
+
+void BpEngine::ComputeClosures() {
+  std::unordered_set<const BpBuildModule*> done;
+  std::unordered_set<const BpBuildModule*> active;
+  for (auto& [name, mod] : modules_) {
+    ComputeClosure(mod.get(), &done, &active);
+  }
+}
+
+void BpEngine::ComputeClosure(
+    BpBuildModule* module, std::unordered_set<const BpBuildModule*>* done,
+    std::unordered_set<const BpBuildModule*>* active) {
+  if (done->count(module) > 0 || active->count(module) > 0) return;
+  active->insert(module);
+
+  std::vector<std::shared_ptr<const std::vector<std::string>>> exports;
+  std::vector<std::shared_ptr<const std::vector<std::string>>> shared;
+  // Each archive is followed by what it needs; MergeClosures() then moves
+  // an archive needed by several others after the last of them.
+  std::vector<const BpBuildModule*> link_order;
+  for (const auto* deps : {&module->static_libs, &module->whole_static_libs,
+                           &module->shared_libs, &module->header_libs}) {
+    bool is_static_dep = deps == &module->static_libs ||
+                         deps == &module->whole_static_libs;
+    for (const auto& dep : *deps) {
+      BpBuildModule* dep_mod = FindModule(dep);
+      if (dep_mod == nullptr) continue;
+      ComputeClosure(dep_mod, done, active);
+      exports.push_back(dep_mod->export_include_closure);
+      if (!is_static_dep) continue;
+      link_order.push_back(dep_mod);
+      // An archive does not carry its own dependencies; whoever links it
+      // must link them too.
+      if (dep_mod->is_static && dep_mod->static_closure != nullptr) {
+        link_order.insert(link_order.end(), dep_mod->static_closure->begin(),
+                          dep_mod->static_closure->end());
+        shared.push_back(dep_mod->shared_closure);
+      }
+    }
+  }
+
+  std::vector<std::string> own_exports;
+  for (const auto& d : module->export_include_dirs) {
+    own_exports.push_back(module->src_dir + "/" + d);
+  }
+  module->export_include_closure = MergeClosures(own_exports, exports, false);
+  module->shared_closure = MergeClosures(module->shared_libs, shared, false);
+
+  module->static_closure = MergeClosures(
+      link_order,
+      std::vector<std::shared_ptr<const std::vector<const BpBuildModule*>>>(),
+      true);
+
+  active->erase(module);
+  done->insert(module);
 }
 
 BpBuildModule* BpEngine::FindModule(const std::string& name) {
@@ -518,9 +742,10 @@ BpBuildModule* BpEngine::FindModule(const std::string& name) {
   return nullptr;
 }
 
-bool BpEngine::BuildModule(const std::string& name,
-                            std::unordered_set<std::string>& visited,
-                            std::unordered_set<std::string>& building) {
+bool BpEngine::PlanModule(const std::string& name,
+                          std::unordered_set<std::string>& visited,
+                          std::unordered_set<std::string>& building,
+                          ActionGraph* graph) {
   // Cycle detection
   if (building.count(name) > 0) {
     fprintf(stderr, "gor_make: Circular dependency detected for '%s'.\n",
@@ -547,51 +772,48 @@ bool BpEngine::BuildModule(const std::string& name,
 
   building.insert(name);
 
-  // Build static library dependencies first
-  for (const auto& dep : mod->static_libs) {
-    if (!BuildModule(dep, visited, building)) {
-      building.erase(name);
-      if (!opts_->keep_going) return false;
-    }
-  }
-
-  // Build whole static library dependencies
-  for (const auto& dep : mod->whole_static_libs) {
-    if (!BuildModule(dep, visited, building)) {
-      building.erase(name);
-      if (!opts_->keep_going) return false;
-    }
-  }
-
-  // Build shared library dependencies first
-  for (const auto& dep : mod->shared_libs) {
-    if (!BuildModule(dep, visited, building)) {
-      building.erase(name);
-      if (!opts_->keep_going) return false;
+  // Plan static, whole static and shared library dependencies first
+  bool ok = true;
+  for (const auto* deps : {&mod->static_libs, &mod->whole_static_libs,
+                           &mod->shared_libs}) {
+    for (const auto& dep : *deps) {
+      if (!PlanModule(dep, visited, building, graph)) {
+        ok = false;
+        if (!opts_->keep_going) {
+          building.erase(name);
+          return false;
+        }
+      }
     }
   }
 
   building.erase(name);
   visited.insert(name);
+  if (!ok) return false;
 
-  // Compile the module
   if (mod->type == "genrule") {
-    if (!BuildGenrule(mod)) {
-      return false;
-    }
+    AddGenruleAction(mod, graph);
   } else if (!mod->srcs.empty()) {
-    if (!CompileModule(mod)) {
-      return false;
-    }
-    if (!LinkModule(mod)) {
-      return false;
-    }
+    std::vector<ActionId> compiles;
+    AddCompileActions(mod, graph, &compiles);
+    AddLinkAction(mod, graph, compiles);
   }
-
   return true;
 }
 
-bool BpEngine::CompileModule(BpBuildModule* module) {
+// True if |out| is missing or older than any of |inputs|.
+static bool OutOfDate(const std::string& out,
+                      const std::vector<std::string>& inputs) {
+  int64_t out_mtime = GetMtimeNs(out);
+  if (out_mtime < 0) return true;
+  for (const auto& in : inputs) {
+    if (GetMtimeNs(in) > out_mtime) return true;
+  }
+  return false;
+}
+
+void BpEngine::AddCompileActions(BpBuildModule* module, ActionGraph* graph,
+                                 std::vector<ActionId>* compiles) {
   // Create output directory
   std::string obj_dir = opts_->build_dir + "/obj/" + module->name;
   if (!opts_->dry_run) buildutil::MkdirP(obj_dir);
@@ -602,26 +824,21 @@ bool BpEngine::CompileModule(BpBuildModule* module) {
     all_include_dirs.push_back(d);
   }
 
-  // Add include dirs from dependency modules (export_include_dirs)
-  for (const auto& dep : module->static_libs) {
-    BpBuildModule* dep_mod = FindModule(dep);
-    if (dep_mod) {
-      for (const auto& d : dep_mod->export_include_dirs) {
-        all_include_dirs.push_back(dep_mod->src_dir + "/" + d);
-      }
-    }
-  }
-  for (const auto& dep : module->shared_libs) {
-    BpBuildModule* dep_mod = FindModule(dep);
-    if (dep_mod) {
-      for (const auto& d : dep_mod->export_include_dirs) {
-        all_include_dirs.push_back(dep_mod->src_dir + "/" + d);
-      }
+  // Add the include dirs exported by dependencies, transitively
+  std::vector<std::shared_ptr<const std::vector<std::string>>> exports;
+  for (const auto* deps : {&module->static_libs, &module->whole_static_libs,
+                           &module->shared_libs, &module->header_libs}) {
+    for (const auto& dep : *deps) {
+      BpBuildModule* dep_mod = FindModule(dep);
+      if (dep_mod) exports.push_back(dep_mod->export_include_closure);
     }
   }
+  all_include_dirs = *MergeClosures(all_include_dirs, exports, false);
 
-  // Compile each source file
+  // One action per source file.  Compiles depend on nothing: headers of
+  // dependencies are sources, not build outputs.
   module->object_files.clear();
+  bool silent = module->is_test && opts_->silent;
 
   for (const auto& src : module->srcs) {
     std::string src_path = src;
@@ -629,62 +846,56 @@ bool BpEngine::CompileModule(BpBuildModule* module) {
       src_path = module->src_dir + "/" + src;
     }
 
-    if (!buildutil::FileExists(src_path)) {
-      fprintf(stderr, "gor_make: *** Source file not found: %s\n", src_path.c_str());
-      return false;
-    }
-
     std::string obj_path = GetObjectPath(*module, src);
 
-    // Check if recompilation is needed
-    bool need_compile = opts_->dry_run ? false : true;
-    if (!need_compile) {
-      // In dry-run mode, still show commands
-    } else {
-      need_compile = !buildutil::FileExists(obj_path);
-      if (!need_compile) {
-        need_compile = GetMtime(src_path) > GetMtime(obj_path);
-      }
-    }
-
-    if (need_compile || opts_->dry_run) {
-      // Choose compiler based on file type
-      std::string compiler = buildutil::IsCppSource(src_path) ? cxx_ : cc_;
+    // Choose compiler based on file type
+    std::string compiler = buildutil::IsCppSource(src_path) ? cxx_ : cc_;
 
-      // Build command
-      std::string cmd = compiler + " -MMD -MP -c";
+    // Build command
+    std::string cmd = compiler + " -MMD -MP -c";
 
-      // Add cflags
-      for (const auto& f : common_cflags_) {
-        cmd += " " + f;
-      }
-      for (const auto& f : module->cflags) {
+    // Add cflags
+    for (const auto& f : common_cflags_) {
+      cmd += " " + f;
+    }
+    for (const auto& f : module->cflags) {
+      cmd += " " + f;
+    }
+    if (buildutil::IsCppSource(src_path)) {
+      for (const auto& f : module->cppflags) {
         cmd += " " + f;
       }
-      if (buildutil::IsCppSource(src_path)) {
-        for (const auto& f : module->cppflags) {
-          cmd += " " + f;
-        }
-      }
+    }
 
-      // Add include directories
-      for (const auto& d : all_include_dirs) {
-        cmd += " -I" + d;
-      }
+    // Add include directories
+    for (const auto& d : all_include_dirs) {
+      cmd += " -I" + d;
+    }
 
-      // Add source and output
-      cmd += " -o " + obj_path + " " + src_path;
+    // Add source and output
+    cmd += " -o " + obj_path + " " + src_path;
 
-      if (!ExecuteCmd(cmd, module->is_test && opts_->silent)) {
-        fprintf(stderr, "gor_make: *** Compilation failed for %s\n", src_path.c_str());
+    uint64_t cmd_hash = HashCommand(cmd);
+    compiles->push_back(graph->AddAction([=]() {
+      if (!buildutil::FileExists(src_path)) {
+        fprintf(stderr, "gor_make: *** Source file not found: %s\n",
+                src_path.c_str());
         return false;
       }
-    }
+      // In dry-run mode, still show commands
+      if (opts_->dry_run) return ExecuteCmd(cmd, silent);
+      if (!NeedsRecompile(obj_path, src_path, cmd_hash)) return true;
+      if (!ExecuteCmd(cmd, silent)) {
+        fprintf(stderr, "gor_make: *** Compilation failed for %s\n",
+                src_path.c_str());
+        return false;
+      }
+      RecordCompile(obj_path, cmd_hash);
+      return true;
+    }));
 
     module->object_files.push_back(obj_path);
   }
-
-  return true;
 }
 
 // Helper: strip "lib" prefix from library name
@@ -695,40 +906,30 @@ static std::string StripLibPrefix(const std::string& name) {
   return name;
 }
 
-bool BpEngine::LinkModule(BpBuildModule* module) {
-  if (module->object_files.empty()) return true;
+void BpEngine::AddLinkAction(BpBuildModule* module, ActionGraph* graph,
+                             const std::vector<ActionId>& compiles) {
+  if (module->object_files.empty()) return;
 
   std::string out_path = GetOutputPath(*module);
   if (!opts_->dry_run) buildutil::MkdirP(buildutil::DirName(out_path));
 
+  // The files the output is made from; it is relinked when one is newer.
+  std::vector<std::string> inputs = module->object_files;
+  std::string cmd;
+  const char* what;
+
   if (module->is_static) {
-    // Create static library with ar
-    std::string cmd = ar_ + " rcs " + out_path;
+    // Create static library with ar.  An archive needs only its own
+    // objects, not its dependencies.
+    cmd = ar_ + " rcs " + out_path;
     for (const auto& obj : module->object_files) {
       cmd += " " + obj;
     }
-
-    // Check if relink needed
-    bool need_link = !buildutil::FileExists(out_path);
-    if (!need_link && !opts_->dry_run) {
-      for (const auto& obj : module->object_files) {
-        if (GetMtime(obj) > GetMtime(out_path)) {
-          need_link = true;
-          break;
-        }
-      }
-    }
-
-    if (need_link || opts_->dry_run) {
-      if (!ExecuteCmd(cmd, opts_->silent)) {
-        fprintf(stderr, "gor_make: *** Archiving failed for %s\n", out_path.c_str());
-        return false;
-      }
-    }
+    what = "Archiving";
   } else {
     // Link binary or shared library
     std::string linker = module->is_binary ? cxx_ : cxx_;
-    std::string cmd = linker;
+    cmd = linker;
 
     // Add ldflags
     for (const auto& f : module->ldflags) {
@@ -740,24 +941,26 @@ bool BpEngine::LinkModule(BpBuildModule* module) {
       cmd += " " + obj;
     }
 
-    // Add static libraries from dependencies
-    for (const auto& dep : module->static_libs) {
-      BpBuildModule* dep_mod = FindModule(dep);
-      if (dep_mod) {
-        cmd += " " + GetOutputPath(*dep_mod);
-      }
-    }
-
     // Add whole static libraries
+    std::unordered_set<const BpBuildModule*> whole;
     for (const auto& dep : module->whole_static_libs) {
       BpBuildModule* dep_mod = FindModule(dep);
       if (dep_mod) {
         cmd += " -Wl,--whole-archive " + GetOutputPath(*dep_mod) + " -Wl,--no-whole-archive";
+        inputs.push_back(GetOutputPath(*dep_mod));
+        whole.insert(dep_mod);
       }
     }
 
-    // Add shared library flags
-    for (const auto& dep : module->shared_libs) {
+    // Add static libraries from dependencies, transitively
+    for (const BpBuildModule* dep_mod : *module->static_closure) {
+      if (whole.count(dep_mod) > 0) continue;
+      cmd += " " + GetOutputPath(*dep_mod);
+      inputs.push_back(GetOutputPath(*dep_mod));
+    }
+
+    // Add shared library flags, including those the archives need
+    for (const auto& dep : *module->shared_closure) {
       BpBuildModule* dep_mod = FindModule(dep);
       if (dep_mod) {
         // Link against the shared library
@@ -776,44 +979,44 @@ bool BpEngine::LinkModule(BpBuildModule* module) {
     } else {
       cmd += " -o " + out_path;
     }
+    what = "Linking";
+  }
 
+  uint64_t cmd_hash = HashCommand(cmd);
+  ActionId link = graph->AddAction([=]() {
+    if (opts_->dry_run) return ExecuteCmd(cmd, opts_->silent);
     // Check if relink needed
-    bool need_link = !buildutil::FileExists(out_path);
-    if (!need_link && !opts_->dry_run) {
-      for (const auto& obj : module->object_files) {
-        if (GetMtime(obj) > GetMtime(out_path)) {
-          need_link = true;
-          break;
-        }
-      }
-      // Also check dependency outputs
-      if (!need_link) {
-        for (const auto& dep : module->static_libs) {
-          BpBuildModule* dep_mod = FindModule(dep);
-          if (dep_mod) {
-            if (GetMtime(GetOutputPath(*dep_mod)) > GetMtime(out_path)) {
-              need_link = true;
-              break;
-            }
-          }
-        }
-      }
+    if (!OutOfDate(out_path, inputs) && !CommandChanged(out_path, cmd_hash)) {
+      return true;
     }
-
-    if (need_link || opts_->dry_run) {
-      if (!ExecuteCmd(cmd, opts_->silent)) {
-        fprintf(stderr, "gor_make: *** Linking failed for %s\n", out_path.c_str());
-        return false;
-      }
+    if (!ExecuteCmd(cmd, opts_->silent)) {
+      fprintf(stderr, "gor_make: *** %s failed for %s\n", what,
+              out_path.c_str());
+      return false;
+    }
+    BuildLog::Entry entry;
+    entry.mtime_ns = GetMtimeNs(out_path);
+    entry.command_hash = cmd_hash;
+    build_log_.Record(out_path, std::move(entry));
+    return true;
+  });
+  for (ActionId c : compiles) graph->AddDep(link, c);
+  if (!module->is_static) {
+    for (const BpBuildModule* dep_mod : *module->static_closure) {
+      graph->AddDep(link, dep_mod->action);
+    }
+    for (const auto& dep : *module->shared_closure) {
+      BpBuildModule* dep_mod = FindModule(dep);
+      if (dep_mod) graph->AddDep(link, dep_mod->action);
     }
   }
 
   module->output_file = out_path;
-  return true;
+  module->action = link;
 }
 
-bool BpEngine::BuildGenrule(BpBuildModule* module) {
-  if (module->gen_cmd.empty()) return true;
+void BpEngine::AddGenruleAction(BpBuildModule* module, ActionGraph* graph) {
+  if (module->gen_cmd.empty()) return;
 
   std::string out_dir = opts_->build_dir + "/gen/" + module->name;
   if (!opts_->dry_run) buildutil::MkdirP(out_dir);
@@ -839,14 +1042,24 @@ bool BpEngine::BuildGenrule(BpBuildModule* module) {
     pos = cmd.find("$(out)");
   }
 
-  if (!ExecuteCmd(cmd, opts_->silent)) {
-    fprintf(stderr, "gor_make: *** Genrule failed for %s\n", module->name.c_str());
-    return false;
+  std::string name = module->name;
+  module->action = graph->AddAction([=]() {
+    if (!ExecuteCmd(cmd, opts_->silent)) {
+      fprintf(stderr, "gor_make: *** Genrule failed for %s\n", name.c_str());
+      return false;
+    }
+    return true;
+  });
+  for (const auto* deps : {&module->static_libs, &module->whole_static_libs,
+                           &module->shared_libs}) {
+    for (const auto& dep : *deps) {
+      BpBuildModule* dep_mod = FindModule(dep);
+      if (dep_mod) graph->AddDep(module->action, dep_mod->action);
+    }
   }
 
   module->object_files = out_paths;
   module->output_file = out_paths.empty() ? "" : out_paths[0];
-  return true;
 }
 
 void BpEngine::Clean() {
@@ -882,15 +1095,62 @@ std::string BpEngine::GetObjectPath(const BpBuildModule& module,
 
 bool BpEngine::NeedsRecompile(const std::string& obj_file,
                               const std::string& src_file,
-                              const std::vector<std::string>& headers) const {
-  if (buildutil::NeedsRecompile(obj_file, src_file)) return true;
-  long obj_mtime = GetMtime(obj_file);
-  for (const auto& h : headers) {
-    if (GetMtime(h) > obj_mtime) return true;
+                              uint64_t command_hash) {
+  int64_t obj_mtime = GetMtimeNs(obj_file);
+  if (obj_mtime < 0 || GetMtimeNs(src_file) > obj_mtime) return true;
+
+  // Without a record for this very object file there is no telling which
+  // flags or headers it was built from; rebuild to find out.
+  if (CommandChanged(obj_file, command_hash)) return true;
+  BuildLog::Entry entry;
+  build_log_.Lookup(obj_file, &entry);
+  for (const auto& dep : entry.deps) {
+    int64_t mtime = InputMtime(dep);
+    // A header that is gone may have been renamed; the compiler decides.
+    if (mtime < 0 || mtime > obj_mtime) return true;
   }
   return false;
 }
 
+bool BpEngine::CommandChanged(const std::string& output,
+                              uint64_t command_hash) const {
+  BuildLog::Entry entry;
+  return !build_log_.Lookup(output, &entry) ||
+         entry.mtime_ns != GetMtimeNs(output) ||
+         entry.command_hash != command_hash;
+}
+
+void BpEngine::RecordCompile(const std::string& obj_file,
+                             uint64_t command_hash) {
+  BuildLog::Entry entry;
+  entry.mtime_ns = GetMtimeNs(obj_file);
+  entry.command_hash = command_hash;
+
+  std::string dep_file = ReplaceExt(obj_file, ".d");
+  std::ifstream in(dep_file);
+  if (in.is_open()) {
+    std::string content((std::istreambuf_iterator<char>(in)),
+                        std::istreambuf_iterator<char>());
+    in.close();
+    ParseDepFile(content, &entry.deps);
+    // The log now holds what the depfile said.
+    unlink(dep_file.c_str());
+  }
+  build_log_.Record(obj_file, std::move(entry));
+}
+
+int64_t BpEngine::InputMtime(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(mtime_mu_);
+    auto it = input_mtimes_.find(path);
+    if (it != input_mtimes_.end()) return it->second;
+  }
+  int64_t mtime = GetMtimeNs(path);
+  std::lock_guard<std::mutex> lock(mtime_mu_);
+  input_mtimes_.emplace(path, mtime);
+  return mtime;
+}
+
 bool BpEngine::ExecuteCmd(const std::string& cmd, bool silent) {
   if (!opts_->dry_run || !opts_->silent) {
     if (!silent || opts_->dry_run) {
@@ -21,15 +21,20 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "action_graph.h"
 #include "bp_parser.h"
+#include "build_log.h"
 
 namespace gormake {
 
+class BpParseCache;
+
 // Build configuration options for Android.bp builds.
 struct BpBuildOptions {
   std::string bp_file_path = "Android.bp";
@@ -38,6 +43,7 @@ struct BpBuildOptions {
   bool silent = false;                   // -s: don't echo commands
   bool verbose = false;                  // -v: show all commands
   bool keep_going = false;                 // -k: keep going on errors
+  int jobs = 1;                           // -j: parallel jobs (0=unlimited)
   bool clean = false;
   bool json_output = false;               // --json: output relationship JSON
   std::string build_dir = "out";          // output directory
@@ -51,6 +57,9 @@ struct BpBuildModule {
   std::string name;       // module name
   std::string src_dir;     // directory containing the Android.bp file
 
+  // cc_defaults modules to apply, in order
+  std::vector<std::string> defaults;
+
   // Build properties (after defaults expansion)
   std::vector<std::string> srcs;
   std::vector<std::string> shared_libs;
@@ -73,8 +82,20 @@ struct BpBuildModule {
   // Computed during build
   std::vector<std::string> object_files;
   std::string output_file;
-  std::vector<std::string> resolved_shared_libs;
-  std::vector<std::string> resolved_static_libs;
+
+  // Transitive closures, computed once for all modules by
+  // ComputeClosures().  They are immutable and shared: a module that adds
+  // nothing to what a single dependency brings points at that
+  // dependency's list.  Null until computed.
+  //
+  // Include directories exported by this module and everything it uses.
+  std::shared_ptr<const std::vector<std::string>> export_include_closure;
+  // Archives to link after this module's objects, in link order.
+  std::shared_ptr<const std::vector<const BpBuildModule*>> static_closure;
+  // Shared libraries (module or system names) this module and its
+  // archives need at the final link.
+  std::shared_ptr<const std::vector<std::string>> shared_closure;
+  ActionId action = kNoAction;  // the link, archive or genrule action
 
   // For genrule
   std::string gen_cmd;
@@ -101,14 +122,42 @@ class BpEngine {
   // Parse all Android.bp files in a directory tree.
   void ParseBpDirectory(const std::string& dir_path);
 
+  // Find and parse every Android.bp below a directory in parallel, then
+  // add them in path order.
+  void ParseBpTree(const std::string& dir_path);
+
   // Parse a single Android.bp file.
   bool ParseSingleBp(const std::string& path);
 
-  // Resolve cc_defaults expansion for all modules.
+  // Convert and register the modules of a parsed file.
+  void AddBpFile(const std::string& path, BpFile result);
+
+  // Resolve cc_defaults expansion for all modules.  Each cc_defaults
+  // module is flattened once, then applied to the modules in parallel.
   void ApplyDefaults();
 
-  // Apply defaults from a cc_defaults module to a target module.
-  void ApplyDefaultsToModule(const BpModule& defaults, BpBuildModule* module);
+  // The properties of cc_defaults |name| with its own defaults chain
+  // applied, memoized in |flat|.  nullptr if there is no such module or
+  // its chain is cyclic.
+  const BpBuildModule* FlattenDefaults(
+      const std::string& name,
+      const std::unordered_map<std::string, const BpModule*>& index,
+      std::unordered_map<std::string, std::unique_ptr<BpBuildModule>>* flat,
+      std::unordered_set<std::string>* active);
+
+  // Apply flattened defaults to a target module.
+  void ApplyDefaultsToModule(const BpBuildModule& defaults,
+                             BpBuildModule* module);
+
+  // Compute the transitive closures of all modules in one topological
+  // pass.
+  void ComputeClosures();
+
+  // Compute the closures of |module| after those of its dependencies.
+  // Dependency cycles are left for PlanModule() to report.
+  void ComputeClosure(BpBuildModule* module,
+                      std::unordered_set<const BpBuildModule*>* done,
+                      std::unordered_set<const BpBuildModule*>* active);
 
   // Convert a parsed BpModule to a BpBuildModule.
   std::unique_ptr<BpBuildModule> ConvertModule(const BpModule& bp_module,
@@ -125,19 +174,23 @@ class BpEngine {
   // Find a module by name.
   BpBuildModule* FindModule(const std::string& name);
 
-  // Build a module and all its dependencies.
-  bool BuildModule(const std::string& name,
-                   std::unordered_set<std::string>& visited,
-                   std::unordered_set<std::string>& building);
+  // Add the actions of a module and all its dependencies to |graph|.
+  bool PlanModule(const std::string& name,
+                  std::unordered_set<std::string>& visited,
+                  std::unordered_set<std::string>& building,
+                  ActionGraph* graph);
 
-  // Compile source files into object files.
-  bool CompileModule(BpBuildModule* module);
+  // Add one compile action per source file; their ids go to |compiles|.
+  void AddCompileActions(BpBuildModule* module, ActionGraph* graph,
+                         std::vector<ActionId>* compiles);
 
-  // Link a module into its final output.
-  bool LinkModule(BpBuildModule* module);
+  // Add the action that archives or links a module.  It runs after
+  // |compiles| and, unless it is an archive, after the modules it links.
+  void AddLinkAction(BpBuildModule* module, ActionGraph* graph,
+                     const std::vector<ActionId>& compiles);
 
-  // Build a genrule.
-  bool BuildGenrule(BpBuildModule* module);
+  // Add the action of a genrule.
+  void AddGenruleAction(BpBuildModule* module, ActionGraph* graph);
 
   // Clean build outputs.
   void Clean();
@@ -149,10 +202,22 @@ class BpEngine {
   std::string GetObjectPath(const BpBuildModule& module,
                             const std::string& src_file) const;
 
-  // Check if a file needs recompilation.
+  // Check if an object file is missing, older than its source or any
+  // header it was built from, or was built by another command line.  Safe
+  // to call from several threads.
   bool NeedsRecompile(const std::string& obj_file,
-                      const std::string& src_file,
-                      const std::vector<std::string>& headers) const;
+                      const std::string& src_file, uint64_t command_hash);
+
+  // Check if |output| was last made by a command other than the one with
+  // |command_hash|, or is not in the build log at all.
+  bool CommandChanged(const std::string& output, uint64_t command_hash) const;
+
+  // Record a freshly built |obj_file| in the build log, together with its
+  // command line and the headers from its depfile.
+  void RecordCompile(const std::string& obj_file, uint64_t command_hash);
+
+  // Mtime (ns) of a header, stat'ed once per build; -1 if missing.
+  int64_t InputMtime(const std::string& path);
 
   // Execute a command, handling dry_run and silent flags.
   bool ExecuteCmd(const std::string& cmd, bool silent = false);
@@ -160,12 +225,20 @@ class BpEngine {
   // All parsed modules indexed by name.
   std::unordered_map<std::string, std::unique_ptr<BpBuildModule>> modules_;
 
+  // Parsed Android.bp files kept from earlier runs, in build_dir.
+  std::unique_ptr<BpParseCache> parse_cache_;
+
   // Track which files have been parsed to avoid duplicates.
   std::unordered_set<std::string> parsed_files_;
 
   // All parsed BpFiles.
   std::vector<BpFile> bp_files_;
 
+  // Headers each object was built from, kept across builds.
+  BuildLog build_log_;
+  std::mutex mtime_mu_;
+  std::unordered_map<std::string, int64_t> input_mtimes_;
+
   // Build options.
   const BpBuildOptions* opts_ = nullptr;
 
@@ -21,12 +21,13 @@
 
 #include <algorithm>
 #include <cerrno>
+#include <charconv>
 #include <climits>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
-#include <sstream>
+
+#include "rd_file.h"
 
 namespace gormake {
 
@@ -34,43 +35,144 @@ namespace gormake {
 // BpValue helpers
 // =====================================================================
 
+std::string_view BpValue::str() const {
+  if (type_ != STRING) return std::string_view();
+  return std::string_view(str_, size_);
+}
+
+BpSpan<BpValue> BpValue::list() const {
+  if (type_ != LIST) return BpSpan<BpValue>();
+  return BpSpan<BpValue>(list_, size_);
+}
+
+BpMap BpValue::map() const {
+  if (type_ != MAP) return BpMap();
+  return BpMap(map_, size_);
+}
+
 std::string BpValue::AsString() const {
-  if (type == STRING) {
-    return str_val;
-  }
-  return "";
+  return std::string(str());
 }
 
 std::vector<std::string> BpValue::AsStringList() const {
   std::vector<std::string> result;
-  if (type == LIST) {
-    for (const auto& v : list_val) {
-      if (v.type == STRING) {
-        result.push_back(v.str_val);
-      }
+  for (const auto& v : list()) {
+    if (v.IsString()) {
+      result.push_back(v.AsString());
     }
   }
   return result;
 }
 
 // static
-BpValue BpValue::String(const std::string& s) {
+BpValue BpValue::Int(int64_t i) {
   BpValue v;
-  v.type = STRING;
-  v.str_val = s;
+  v.type_ = INT;
+  v.int_ = i;
   return v;
 }
 
 // static
-BpValue BpValue::List(const std::vector<std::string>& vec) {
+BpValue BpValue::Bool(bool b) {
   BpValue v;
-  v.type = LIST;
-  for (const auto& s : vec) {
-    v.list_val.push_back(BpValue::String(s));
-  }
+  v.type_ = BOOL;
+  v.bool_ = b;
+  return v;
+}
+
+// static
+BpValue BpValue::String(BpArena* arena, std::string_view s) {
+  std::string_view interned = arena->Intern(s);
+  BpValue v;
+  v.type_ = STRING;
+  v.str_ = interned.data();
+  v.size_ = static_cast<uint32_t>(interned.size());
   return v;
 }
 
+// static
+BpValue BpValue::List(BpArena* arena, const std::vector<BpValue>& items) {
+  BpValue v;
+  v.type_ = LIST;
+  v.list_ = arena->Copy(items.data(), items.size());
+  v.size_ = static_cast<uint32_t>(items.size());
+  return v;
+}
+
+// static
+BpValue BpValue::Map(const BpMap& map) {
+  BpValue v;
+  v.type_ = MAP;
+  v.map_ = map.begin();
+  v.size_ = static_cast<uint32_t>(map.size());
+  return v;
+}
+
+// static
+BpMap BpMap::Build(BpArena* arena, std::vector<BpProperty> entries) {
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const BpProperty& a, const BpProperty& b) {
+                     return a.key < b.key;
+                   });
+  // Keep the last of each run of equal keys.
+  size_t out = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (i + 1 < entries.size() && entries[i + 1].key == entries[i].key) {
+      continue;
+    }
+    entries[out++] = entries[i];
+  }
+  return BpMap(arena->Copy(entries.data(), out), out);
+}
+
+const BpValue* BpMap::Find(std::string_view key) const {
+  const BpProperty* it = std::lower_bound(
+      begin(), end(), key,
+      [](const BpProperty& p, std::string_view k) { return p.key < k; });
+  if (it == end() || it->key != key) return nullptr;
+  return &it->value;
+}
+
+// =====================================================================
+// BpArena
+// =====================================================================
+
+static const size_t kArenaBlockSize = 64 * 1024;
+
+BpArena::BpArena() = default;
+BpArena::~BpArena() = default;
+
+void* BpArena::Allocate(size_t size, size_t align) {
+  size_t pad = (align - reinterpret_cast<uintptr_t>(ptr_) % align) % align;
+  if (ptr_ == nullptr || pad + size > avail_) {
+    // Large requests get a block of their own so the current one is kept.
+    size_t block = std::max(kArenaBlockSize, size + align);
+    blocks_.emplace_back(new char[block]);
+    bytes_allocated_ += block;
+    if (size + align > kArenaBlockSize / 4 && ptr_ != nullptr) {
+      char* p = blocks_.back().get();
+      p += (align - reinterpret_cast<uintptr_t>(p) % align) % align;
+      return p;
+    }
+    ptr_ = blocks_.back().get();
+    avail_ = block;
+    pad = (align - reinterpret_cast<uintptr_t>(ptr_) % align) % align;
+  }
+  char* p = ptr_ + pad;
+  ptr_ = p + size;
+  avail_ -= pad + size;
+  return p;
+}
+
+std::string_view BpArena::Intern(std::string_view s) {
+  auto it = strings_.find(s);
+  if (it != strings_.end()) return *it;
+  const char* p = s.empty() ? "" : Copy(s.data(), s.size());
+  std::string_view copy(p, s.size());
+  strings_.insert(copy);
+  return copy;
+}
+
 // =====================================================================
 // BpParser public interface
 // =====================================================================
@@ -79,32 +181,41 @@ BpParser::BpParser() = default;
 BpParser::~BpParser() = default;
 
 bool BpParser::ParseFile(const std::string& path, BpFile* result) {
-  std::ifstream in(path);
-  if (!in.is_open()) {
-    error_ = "cannot open file: " + path + ": " + std::strerror(errno);
-    return false;
-  }
-
-  std::stringstream ss;
-  ss << in.rdbuf();
-  std::string source = ss.str();
-
   // Determine the directory of the file for glob expansion.
   size_t slash = path.find_last_of('/');
   base_dir_ = (slash != std::string::npos) ? path.substr(0, slash) : ".";
 
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    error_ = "cannot open file: " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  // An empty file cannot be mapped; it simply has no modules.
+  if (st.st_size == 0) {
+    return ParseSource(std::string_view(), path, result);
+  }
+
+  // Tokens point straight into the mapping, so it stays open while parsing.
+  UnixFile::RdFile file;
+  if (!file.Open(path, O_RDONLY)) {
+    error_ = "cannot open file: " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  std::string_view source(static_cast<const char*>(file.GetFileMem()),
+                          static_cast<size_t>(file.GetLength()));
   return ParseSource(source, path, result);
 }
 
-bool BpParser::ParseSource(const std::string& source,
+bool BpParser::ParseSource(std::string_view source,
                             const std::string& path, BpFile* result) {
-  tokens_.clear();
-  pos_ = 0;
   error_.clear();
-
-  if (!Tokenize(source, &tokens_)) {
-    return false;
-  }
+  lex_error_.clear();
+  unescaped_.clear();
+  src_ = source;
+  src_pos_ = 0;
+  line_ = 1;
+  Lex(&cur_);
+  Lex(&next_);
 
   if (base_dir_.empty()) {
     size_t slash = path.find_last_of('/');
@@ -112,12 +223,18 @@ bool BpParser::ParseSource(const std::string& source,
   }
 
   variables_ = &result->variables;
-
-  if (!ParseTopLevel(result)) {
-    return false;
+  globs_ = &result->globs;
+  arena_ = result->arena.get();
+
+  bool ok = ParseTopLevel(result);
+  // A lexical error ends the token stream early; report it rather than
+  // whatever the parser made of the truncated input.
+  if (!lex_error_.empty()) {
+    error_ = lex_error_;
+    ok = false;
   }
-
-  return true;
+  src_ = std::string_view();
+  return ok;
 }
 
 const std::string& BpParser::GetError() const { return error_; }
@@ -126,18 +243,37 @@ const std::string& BpParser::GetError() const { return error_; }
 // Tokenizer
 // =====================================================================
 
-bool BpParser::Tokenize(const std::string& source,
-                          std::vector<Token>* tokens) {
-  size_t i = 0;
-  int line = 1;
-  const size_t n = source.size();
+static bool IsIdentStart(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+         c == '@';
+}
+
+static bool IsIdentChar(char c) {
+  return IsIdentStart(c) || (c >= '0' && c <= '9') || c == '.' || c == '-';
+}
+
+static bool IsTokenStart(char c) {
+  return IsIdentStart(c) || (c >= '0' && c <= '9') || c == '"' ||
+         (c != '\0' && std::strchr("{}[]:,+=()", c) != nullptr);
+}
 
-  while (i < n) {
-    char c = source[i];
+void BpParser::Lex(Token* tok) {
+  const std::string_view& s = src_;
+  const size_t n = s.size();
+  size_t& i = src_pos_;
+
+  for (;;) {
+    if (i >= n) {
+      tok->type = TOK_EOF;
+      tok->value = std::string_view();
+      tok->line = line_;
+      return;
+    }
+    char c = s[i];
 
     // ---- Whitespace ----
     if (c == '\n') {
-      ++line;
+      ++line_;
       ++i;
       continue;
     }
@@ -147,196 +283,158 @@ bool BpParser::Tokenize(const std::string& source,
     }
 
     // ---- Comments ----
-    if (c == '/' && i + 1 < n && source[i + 1] == '/') {
+    if (c == '/' && i + 1 < n && s[i + 1] == '/') {
       // Single-line comment: skip to end of line.
-      while (i < n && source[i] != '\n') {
+      while (i < n && s[i] != '\n') {
         ++i;
       }
       continue;
     }
-    if (c == '/' && i + 1 < n && source[i + 1] == '*') {
+    if (c == '/' && i + 1 < n && s[i + 1] == '*') {
       // Multi-line comment: skip to matching */.
-      int start_line = line;
+      int start_line = line_;
       i += 2;  // skip /*
       while (i < n) {
-        if (source[i] == '\n') {
-          ++line;
+        if (s[i] == '\n') {
+          ++line_;
         }
-        if (source[i] == '*' && i + 1 < n && source[i + 1] == '/') {
+        if (s[i] == '*' && i + 1 < n && s[i + 1] == '/') {
           i += 2;
           break;
         }
         ++i;
       }
       if (i >= n) {
-        error_ = "unterminated /* comment starting at line " +
-                 std::to_string(start_line);
-        return false;
+        return LexError(tok, "unterminated /* comment starting at line " +
+                                 std::to_string(start_line));
       }
       continue;
     }
 
-    // ---- Single-char tokens ----
-    Token tok;
-    tok.line = line;
-    switch (c) {
-      case '{':
-        tok.type = TOK_LBRACE;
-        break;
-      case '}':
-        tok.type = TOK_RBRACE;
-        break;
-      case '[':
-        tok.type = TOK_LBRACKET;
-        break;
-      case ']':
-        tok.type = TOK_RBRACKET;
-        break;
-      case ':':
-        tok.type = TOK_COLON;
-        break;
-      case ',':
-        tok.type = TOK_COMMA;
-        break;
-      case '+':
-        tok.type = TOK_PLUS;
-        break;
-      case '=':
-        tok.type = TOK_ASSIGN;
-        break;
-      case '(':
-        tok.type = TOK_LPAREN;
-        break;
-      case ')':
-        tok.type = TOK_RPAREN;
-        break;
-      default:
-        tok.type = TOK_EOF;  // sentinel; handled below
-        break;
-    }
-    if (tok.type != TOK_EOF) {
-      tok.value = std::string(1, c);
-      tokens->push_back(tok);
+    // ---- Unknown character ----
+    // Skip unexpected characters (e.g. invalid bytes, weird unicode)
+    // instead of failing.
+    if (!IsTokenStart(c)) {
       ++i;
       continue;
     }
+    break;
+  }
 
-    // ---- String literal ----
-    if (c == '"') {
-      int start_line = line;
-      ++i;  // skip opening quote
-      std::string val;
-      bool closed = false;
-      while (i < n) {
-        char ch = source[i];
-        if (ch == '\\' && i + 1 < n) {
-          char next = source[i + 1];
-          switch (next) {
-            case 'n':
-              val.push_back('\n');
-              break;
-            case 't':
-              val.push_back('\t');
-              break;
-            case 'r':
-              val.push_back('\r');
-              break;
-            case '"':
-              val.push_back('"');
-              break;
-            case '\\':
-              val.push_back('\\');
-              break;
-            case '\n':
-              ++line;
-              break;  // line continuation
-            default:
-              val.push_back(next);
-              break;
-          }
-          i += 2;
-          continue;
-        }
-        if (ch == '"') {
-          ++i;
-          closed = true;
-          break;
-        }
-        if (ch == '\n') {
-          ++line;
-        }
-        val.push_back(ch);
-        ++i;
-      }
-      if (!closed) {
-        error_ = "unterminated string starting at line " +
-                 std::to_string(start_line);
-        return false;
-      }
-      tok.type = TOK_STRING;
-      tok.value = val;
-      tokens->push_back(tok);
-      continue;
-    }
+  char c = s[i];
+  tok->line = line_;
+
+  // ---- Single-char tokens ----
+  switch (c) {
+    case '{': tok->type = TOK_LBRACE; break;
+    case '}': tok->type = TOK_RBRACE; break;
+    case '[': tok->type = TOK_LBRACKET; break;
+    case ']': tok->type = TOK_RBRACKET; break;
+    case ':': tok->type = TOK_COLON; break;
+    case ',': tok->type = TOK_COMMA; break;
+    case '+': tok->type = TOK_PLUS; break;
+    case '=': tok->type = TOK_ASSIGN; break;
+    case '(': tok->type = TOK_LPAREN; break;
+    case ')': tok->type = TOK_RPAREN; break;
+    default: tok->type = TOK_EOF; break;  // sentinel; handled below
+  }
+  if (tok->type != TOK_EOF) {
+    tok->value = s.substr(i, 1);
+    ++i;
+    return;
+  }
 
-    // ---- Integer literal ----
-    if (c >= '0' && c <= '9') {
-      std::string num;
-      while (i < n && source[i] >= '0' && source[i] <= '9') {
-        num.push_back(source[i]);
-        ++i;
+  // ---- String literal ----
+  // The token is a slice of the source unless the literal has escapes;
+  // only then is an unescaped copy made.
+  if (c == '"') {
+    int start_line = line_;
+    size_t begin = ++i;  // skip opening quote
+    bool has_escape = false;
+    while (i < n && s[i] != '"') {
+      if (s[i] == '\\' && i + 1 < n) {
+        has_escape = true;
+        if (s[i + 1] == '\n') ++line_;
+        i += 2;
+        continue;
       }
-      tok.type = TOK_INT;
-      tok.value = num;
-      tokens->push_back(tok);
-      continue;
+      if (s[i] == '\n') ++line_;
+      ++i;
     }
+    if (i >= n) {
+      return LexError(tok, "unterminated string starting at line " +
+                               std::to_string(start_line));
+    }
+    tok->type = TOK_STRING;
+    tok->value = s.substr(begin, i - begin);
+    ++i;  // skip closing quote
+    if (has_escape) {
+      tok->value = Unescape(tok->value);
+    }
+    return;
+  }
 
-    // ---- Identifier ----
-    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '@') {
-      std::string ident;
-      while (i < n) {
-        char ch = source[i];
-        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
-            (ch >= '0' && ch <= '9') || ch == '_' || ch == '@' || ch == '.' || ch == '-') {
-          ident.push_back(ch);
-          ++i;
-        } else {
-          break;
-        }
-      }
-      tok.type = TOK_IDENT;
-      tok.value = ident;
-      tokens->push_back(tok);
-      continue;
+  // ---- Integer literal ----
+  if (c >= '0' && c <= '9') {
+    size_t begin = i;
+    while (i < n && s[i] >= '0' && s[i] <= '9') {
+      ++i;
     }
+    tok->type = TOK_INT;
+    tok->value = s.substr(begin, i - begin);
+    return;
+  }
 
-    // ---- Unknown character ----
-    // Skip unexpected characters (e.g. invalid bytes, weird unicode) instead of failing
+  // ---- Identifier ----
+  size_t begin = i;
+  while (i < n && IsIdentChar(s[i])) {
     ++i;
   }
+  tok->type = TOK_IDENT;
+  tok->value = s.substr(begin, i - begin);
+}
 
-  // End-of-file sentinel.
-  Token eof;
-  eof.type = TOK_EOF;
-  eof.value = "";
-  eof.line = line;
-  tokens->push_back(eof);
-  return true;
+std::string_view BpParser::Unescape(std::string_view raw) {
+  unescaped_.emplace_back();
+  std::string& val = unescaped_.back();
+  val.reserve(raw.size());
+  for (size_t i = 0; i < raw.size(); ++i) {
+    if (raw[i] != '\\' || i + 1 >= raw.size()) {
+      val.push_back(raw[i]);
+      continue;
+    }
+    char next = raw[++i];
+    switch (next) {
+      case 'n': val.push_back('\n'); break;
+      case 't': val.push_back('\t'); break;
+      case 'r': val.push_back('\r'); break;
+      case '\n': break;  // line continuation
+      default: val.push_back(next); break;  // \" \\ and the rest
+    }
+  }
+  return val;
+}
+
+void BpParser::LexError(Token* tok, const std::string& msg) {
+  if (lex_error_.empty()) lex_error_ = msg;
+  src_pos_ = src_.size();
+  tok->type = TOK_EOF;
+  tok->value = std::string_view();
+  tok->line = line_;
 }
 
 // =====================================================================
 // Token helpers
 // =====================================================================
 
-const BpParser::Token& BpParser::Current() const {
-  // tokens_ always ends with TOK_EOF, so pos_ is always in range.
-  return tokens_[pos_];
-}
+const BpParser::Token& BpParser::Current() const { return cur_; }
+
+const BpParser::Token& BpParser::Next() const { return next_; }
 
 void BpParser::Advance() {
-  if (pos_ < tokens_.size() - 1) {
-    ++pos_;
+  if (cur_.type != TOK_EOF) {
+    cur_ = next_;
+    Lex(&next_);
   }
 }
 
@@ -357,7 +455,7 @@ bool BpParser::Expect(TokenType type, const std::string& what) {
     Advance();
     return true;
   }
-  return Error("expected " + what + " but got '" + Current().value + "' at line " +
+  return Error("expected " + what + " but got '" + std::string(Current().value) + "' at line " +
                std::to_string(Current().line));
 }
 
@@ -383,18 +481,18 @@ bool BpParser::ParseTopLevel(BpFile* result) {
     // name, depending on whether it is followed by '{' or '='.
     if (tok.type != TOK_IDENT) {
       return Error("expected module type or variable name at line " +
-                   std::to_string(tok.line) + ", got '" + tok.value + "'");
+                   std::to_string(tok.line) + ", got '" +
+                   std::string(tok.value) + "'");
     }
 
     // Look ahead at the next token to decide.
-    // We need to peek two tokens: current is IDENT, next determines kind.
-    size_t next = pos_ + 1;
-    if (next >= tokens_.size()) {
-      return Error("unexpected end of input after identifier '" + tok.value +
-                   "' at line " + std::to_string(tok.line));
+    const Token& lookahead = Next();
+    if (lookahead.type == TOK_EOF) {
+      return Error("unexpected end of input after identifier '" +
+                   std::string(tok.value) + "' at line " +
+                   std::to_string(tok.line));
     }
 
-    const Token& lookahead = tokens_[next];
     if (lookahead.type == TOK_LBRACE) {
       // Module definition.
       BpModule module;
@@ -404,7 +502,7 @@ bool BpParser::ParseTopLevel(BpFile* result) {
       result->modules.push_back(std::move(module));
     } else if (lookahead.type == TOK_ASSIGN) {
       // Top-level variable assignment.
-      std::string var_name = tok.value;
+      std::string var_name(tok.value);
       Advance();  // consume IDENT
       Advance();  // consume '='
       BpValue val;
@@ -414,7 +512,7 @@ bool BpParser::ParseTopLevel(BpFile* result) {
       (*variables_)[var_name] = val;
     } else if (lookahead.type == TOK_PLUS) {
       // += append variable
-      std::string var_name = tok.value;
+      std::string var_name(tok.value);
       Advance();  // consume IDENT
       Advance();  // consume '+'
       if (Current().type == TOK_ASSIGN) Advance();  // consume '='
@@ -423,8 +521,9 @@ bool BpParser::ParseTopLevel(BpFile* result) {
         (*variables_)[var_name] = val;
       }
     } else {
-      return Error("expected '{' or '=' after identifier '" + tok.value +
-                   "' at line " + std::to_string(tok.line));
+      return Error("expected '{' or '=' after identifier '" +
+                   std::string(tok.value) + "' at line " +
+                   std::to_string(tok.line));
     }
   }
   return true;
@@ -435,7 +534,7 @@ bool BpParser::ParseTopLevel(BpFile* result) {
 // =====================================================================
 
 bool BpParser::ParseModule(BpModule* module) {
-  module->type = Current().value;
+  module->type = std::string(Current().value);
   Advance();  // consume type
 
   if (!Expect(TOK_LBRACE, "'{'")) {
@@ -443,8 +542,9 @@ bool BpParser::ParseModule(BpModule* module) {
   }
 
   // Parse properties.
+  std::vector<BpProperty> props;
   while (!AtEnd() && Current().type != TOK_RBRACE) {
-    if (!ParseProperty(&module->properties)) {
+    if (!ParseProperty(&props)) {
       // If property parsing failed, skip to next ',' or '}'
       while (!AtEnd() && Current().type != TOK_COMMA && Current().type != TOK_RBRACE) {
         Advance();
@@ -457,21 +557,23 @@ bool BpParser::ParseModule(BpModule* module) {
     return false;
   }
 
-  auto it = module->properties.find("name");
-  if (it != module->properties.end() && it->second.IsString()) {
-    module->name = it->second.str_val;
+  module->properties = BpMap::Build(arena_, std::move(props));
+  const BpValue* name = module->properties.Find("name");
+  if (name != nullptr && name->IsString()) {
+    module->name = name->AsString();
   }
 
   return true;
 }
 
-bool BpParser::ParseProperty(std::map<std::string, BpValue>* props) {
+bool BpParser::ParseProperty(std::vector<BpProperty>* props) {
   if (Current().type != TOK_IDENT && Current().type != TOK_STRING) {
-    return Error("expected property name but got '" + Current().value +
+    return Error("expected property name but got '" +
+                 std::string(Current().value) +
                  "' at line " + std::to_string(Current().line));
   }
 
-  std::string key = Current().value;
+  std::string_view key = arena_->Intern(Current().value);
   Advance();  // consume key
 
   if (Current().type == TOK_PLUS) {
@@ -488,16 +590,25 @@ bool BpParser::ParseProperty(std::map<std::string, BpValue>* props) {
     return false;
   }
 
-  auto it = props->find(key);
-  if (it != props->end() && it->second.IsList() && val.IsList()) {
-    for (auto& e : val.list_val) {
-      it->second.list_val.push_back(std::move(e));
+  SetProperty(props, key, val);
+  return true;
+}
+
+void BpParser::SetProperty(std::vector<BpProperty>* props,
+                           std::string_view key, const BpValue& val) {
+  // Modules have few properties; a linear scan beats sorting here.
+  for (auto& p : *props) {
+    if (p.key != key) continue;
+    if (p.value.IsList() && val.IsList()) {
+      std::vector<BpValue> items(p.value.list().begin(), p.value.list().end());
+      items.insert(items.end(), val.list().begin(), val.list().end());
+      p.value = BpValue::List(arena_, items);
+    } else {
+      p.value = val;
     }
-  } else {
-    (*props)[key] = std::move(val);
+    return;
   }
-
-  return true;
+  props->push_back(BpProperty{key, val});
 }
 
 // =====================================================================
@@ -520,45 +631,46 @@ bool BpParser::ParseValue(BpValue* value) {
     }
 
     // Concatenate based on types.
-    if (left.type == BpValue::STRING && right.type == BpValue::STRING) {
+    if (left.IsString() && right.IsString()) {
       // String concatenation.
-      left.str_val += right.str_val;
-    } else if (left.type == BpValue::LIST && right.type == BpValue::LIST) {
+      std::string joined(left.str());
+      joined += right.str();
+      left = BpValue::String(arena_, joined);
+    } else if (left.IsList() && right.IsList()) {
       // List concatenation.
-      for (const auto& e : right.list_val) {
-        left.list_val.push_back(e);
-      }
-    } else if (left.type == BpValue::MAP && right.type == BpValue::MAP) {
+      std::vector<BpValue> items(left.list().begin(), left.list().end());
+      items.insert(items.end(), right.list().begin(), right.list().end());
+      left = BpValue::List(arena_, items);
+    } else if (left.IsMap() && right.IsMap()) {
       // Map merge: right overrides left for duplicate keys.
-      for (const auto& [k, v] : right.map_val) {
-        left.map_val[k] = v;
-      }
-    } else if (left.type == BpValue::STRING && right.type == BpValue::LIST) {
+      std::vector<BpProperty> entries(left.map().begin(), left.map().end());
+      entries.insert(entries.end(), right.map().begin(), right.map().end());
+      left = BpValue::Map(BpMap::Build(arena_, std::move(entries)));
+    } else if (left.IsString() && right.IsList()) {
       // String + list: prepend the string as a single-element list.
-      left.list_val.insert(left.list_val.begin(), BpValue::String(left.str_val));
-      left.type = BpValue::LIST;
-      left.str_val.clear();
-      for (const auto& e : right.list_val) {
-        left.list_val.push_back(e);
-      }
-    } else if (left.type == BpValue::LIST && right.type == BpValue::STRING) {
+      std::vector<BpValue> items(1, left);
+      items.insert(items.end(), right.list().begin(), right.list().end());
+      left = BpValue::List(arena_, items);
+    } else if (left.IsList() && right.IsString()) {
       // List + string: append.
-      left.list_val.push_back(BpValue::String(right.str_val));
-    } else if (left.type == BpValue::NONE) {
+      std::vector<BpValue> items(left.list().begin(), left.list().end());
+      items.push_back(right);
+      left = BpValue::List(arena_, items);
+    } else if (left.type() == BpValue::NONE) {
       // Unresolved variable; adopt right.
       left = right;
-    } else if (right.type == BpValue::NONE) {
+    } else if (right.type() == BpValue::NONE) {
       // Unresolved variable on right; keep left.
       // (No-op.)
     } else {
       return Error("cannot concatenate types " +
-                   std::to_string(left.type) + " and " +
-                   std::to_string(right.type) + " at line " +
+                   std::to_string(left.type()) + " and " +
+                   std::to_string(right.type()) + " at line " +
                    std::to_string(Current().line));
     }
   }
 
-  *value = std::move(left);
+  *value = left;
   return true;
 }
 
@@ -570,16 +682,15 @@ bool BpParser::ParsePrimary(BpValue* value) {
       return ParseStringLiteral(value);
 
     case TOK_INT: {
-      value->type = BpValue::INT;
-      // Use strtoll for safety on large numbers.
-      errno = 0;
-      char* end = nullptr;
-      long long ll = std::strtoll(tok.value.c_str(), &end, 10);
-      if (errno != 0 || end == tok.value.c_str()) {
-        return Error("invalid integer '" + tok.value + "' at line " +
-                     std::to_string(tok.line));
+      const char* first = tok.value.data();
+      const char* last = first + tok.value.size();
+      int64_t v = 0;
+      auto [end, ec] = std::from_chars(first, last, v);
+      if (ec != std::errc() || end != last) {
+        return Error("invalid integer '" + std::string(tok.value) +
+                     "' at line " + std::to_string(tok.line));
       }
-      value->int_val = static_cast<int64_t>(ll);
+      *value = BpValue::Int(v);
       Advance();
       return true;
     }
@@ -592,33 +703,31 @@ bool BpParser::ParsePrimary(BpValue* value) {
 
     case TOK_LPAREN: {
       if (!SkipParenthesized()) return false;
-      value->type = BpValue::NONE;
+      *value = BpValue();
       return true;
     }
 
     case TOK_IDENT: {
       // Could be: true, false, a variable reference, or a function call.
       if (tok.value == "true") {
-        value->type = BpValue::BOOL;
-        value->bool_val = true;
+        *value = BpValue::Bool(true);
         Advance();
         return true;
       }
       if (tok.value == "false") {
-        value->type = BpValue::BOOL;
-        value->bool_val = false;
+        *value = BpValue::Bool(false);
         Advance();
         return true;
       }
       // Check if this is a function call: ident(...)
-      if (pos_ + 1 < tokens_.size() && tokens_[pos_ + 1].type == TOK_LPAREN) {
+      if (Next().type == TOK_LPAREN) {
         return ParseFunctionCall(value);
       }
       // Variable reference.
-      BpValue resolved = ResolveVariable(tok.value);
-      if (resolved.type == BpValue::NONE) {
+      BpValue resolved = ResolveVariable(std::string(tok.value));
+      if (resolved.type() == BpValue::NONE) {
         // Unknown variable — treat as empty string to be lenient
-        *value = BpValue::String("");
+        *value = BpValue::String(arena_, "");
         Advance();
         return true;
       }
@@ -628,7 +737,8 @@ bool BpParser::ParsePrimary(BpValue* value) {
     }
 
     default:
-      return Error("expected a value but got '" + tok.value + "' at line " +
+      return Error("expected a value but got '" + std::string(tok.value) +
+                   "' at line " +
                    std::to_string(tok.line));
   }
 }
@@ -645,7 +755,7 @@ bool BpParser::SkipParenthesized() {
 }
 
 bool BpParser::ParseFunctionCall(BpValue* value) {
-  std::string func_name = Current().value;
+  std::string func_name(Current().value);
   Advance();  // consume identifier
 
   if (!Expect(TOK_LPAREN, "'('")) {
@@ -671,68 +781,68 @@ bool BpParser::ParseFunctionCall(BpValue* value) {
 
   if (func_name == "select") {
     for (const auto& arg : args) {
-      if (arg.type == BpValue::MAP) {
-        auto it = arg.map_val.find("default");
-        if (it != arg.map_val.end()) {
-          *value = it->second;
+      if (arg.IsMap()) {
+        BpMap cases = arg.map();
+        const BpValue* def = cases.Find("default");
+        if (def != nullptr) {
+          *value = *def;
           return true;
         }
-        if (!arg.map_val.empty()) {
-          *value = arg.map_val.begin()->second;
+        if (!cases.empty()) {
+          *value = cases.begin()->value;
           return true;
         }
-      } else if (arg.type == BpValue::LIST || arg.type == BpValue::STRING) {
+      } else if (arg.IsList() || arg.IsString()) {
         *value = arg;
         return true;
       }
     }
   }
 
-  value->type = BpValue::NONE;
+  *value = BpValue();
   return true;
 }
 
 bool BpParser::ParseStringLiteral(BpValue* value) {
-  const Token& tok = Current();
-  value->type = BpValue::STRING;
-  value->str_val = tok.value;
+  *value = BpValue::String(arena_, Current().value);
   Advance();
   return true;
 }
 
 bool BpParser::ParseList(BpValue* value) {
-  value->type = BpValue::LIST;
-  value->list_val.clear();
-
   if (!Expect(TOK_LBRACKET, "'['")) {
     return false;
   }
 
+  std::vector<BpValue> items;
   while (!AtEnd() && Current().type != TOK_RBRACKET) {
     BpValue elem;
     if (!ParseValue(&elem)) {
       return false;
     }
 
-    if (elem.type == BpValue::LIST) {
-      for (auto& e : elem.list_val) {
-        value->list_val.push_back(std::move(e));
-      }
-    } else if (elem.type == BpValue::STRING &&
-               (elem.str_val.find('*') != std::string::npos ||
-                elem.str_val.find('?') != std::string::npos)) {
-      std::vector<std::string> matches = ExpandGlob(elem.str_val);
+    if (elem.IsList()) {
+      items.insert(items.end(), elem.list().begin(), elem.list().end());
+    } else if (elem.IsString() &&
+               (elem.str().find('*') != std::string_view::npos ||
+                elem.str().find('?') != std::string_view::npos)) {
+      std::string pattern = elem.AsString();
+      std::vector<std::string> matches = ExpandGlob(pattern);
       for (const auto& m : matches) {
-        value->list_val.push_back(BpValue::String(m));
+        items.push_back(BpValue::String(arena_, m));
+      }
+      if (globs_ != nullptr) {
+        globs_->push_back(BpGlob{pattern, std::move(matches)});
       }
     } else {
-      value->list_val.push_back(std::move(elem));
+      items.push_back(elem);
     }
 
     if (Current().type == TOK_COMMA) {
       Advance();
     } else if (Current().type != TOK_RBRACKET) {
-      return Error("expected ',' or ']' but got '" + Current().value +
+      return Error("expected ',' or ']' but got '" +
+                   std::string(Current().value) +
                    "' at line " + std::to_string(Current().line));
     }
   }
@@ -741,35 +851,36 @@ bool BpParser::ParseList(BpValue* value) {
     return false;
   }
 
+  *value = BpValue::List(arena_, items);
   return true;
 }
 
 bool BpParser::ParseMap(BpValue* value) {
-  value->type = BpValue::MAP;
-  value->map_val.clear();
-
   if (!Expect(TOK_LBRACE, "'{'")) {
     return false;
   }
 
+  std::vector<BpProperty> entries;
   while (!AtEnd() && Current().type != TOK_RBRACE) {
-    std::string key;
+    std::string_view key;
     if (Current().type == TOK_LPAREN) {
-      key = "(";
+      std::string paren_key = "(";
       Advance();
       while (!AtEnd() && Current().type != TOK_RPAREN) {
-        key += Current().value;
+        paren_key += Current().value;
         Advance();
       }
       if (Current().type == TOK_RPAREN) {
-        key += ")";
+        paren_key += ")";
         Advance();
       }
+      key = arena_->Intern(paren_key);
     } else if (Current().type == TOK_IDENT || Current().type == TOK_STRING) {
-      key = Current().value;
+      key = arena_->Intern(Current().value);
       Advance();
     } else {
-      return Error("expected map key but got '" + Current().value +
+      return Error("expected map key but got '" +
+                   std::string(Current().value) +
                    "' at line " + std::to_string(Current().line));
     }
 
@@ -782,7 +893,7 @@ bool BpParser::ParseMap(BpValue* value) {
       return false;
     }
 
-    value->map_val[key] = std::move(val);
+    entries.push_back(BpProperty{key, val});
 
     // Trailing comma is allowed.
     if (Current().type == TOK_COMMA) {
@@ -794,6 +905,7 @@ bool BpParser::ParseMap(BpValue* value) {
     return false;
   }
 
+  *value = BpValue::Map(BpMap::Build(arena_, std::move(entries)));
   return true;
 }
 
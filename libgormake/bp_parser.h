@@ -18,28 +18,64 @@
 #define GORMAKE_LIBGORMAKE_BP_PARSER_H_
 
 #include <cstdint>
+#include <deque>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
 #include <vector>
 
+#include "macros.h"
+
 namespace gormake {
 
+class BpArena;
+class BpMap;
+struct BpProperty;
+
+// A [begin, end) view into an array owned by a BpArena.
+template <typename T>
+class BpSpan {
+ public:
+  BpSpan() = default;
+  BpSpan(const T* b, size_t n) : begin_(b), end_(b + n) {}
+  const T* begin() const { return begin_; }
+  const T* end() const { return end_; }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+  const T& operator[](size_t i) const { return begin_[i]; }
+
+ private:
+  const T* begin_ = nullptr;
+  const T* end_ = nullptr;
+};
+
 // A value in the Blueprint type system.  Every literal, variable reference, or
 // evaluated expression in an Android.bp file reduces to one of these.
-struct BpValue {
-  enum Type { STRING, INT, BOOL, LIST, MAP, NONE };
+//
+// A BpValue is a 16-byte tagged union.  The characters of a string and the
+// elements of a list or map live in the BpArena of the BpFile that produced
+// the value, so a value must not outlive its file.  Values are immutable;
+// copying one is cheap and shares the arena data.
+class BpValue {
+ public:
+  enum Type : uint8_t { STRING, INT, BOOL, LIST, MAP, NONE };
 
-  Type type = NONE;
-  std::string str_val;
-  int64_t int_val = 0;
-  bool bool_val = false;
-  std::vector<BpValue> list_val;
-  std::map<std::string, BpValue> map_val;
+  BpValue() : type_(NONE), size_(0), int_(0) {}
 
-  // Helpers
-  bool IsString() const { return type == STRING; }
-  bool IsList() const { return type == LIST; }
-  bool IsMap() const { return type == MAP; }
+  Type type() const { return type_; }
+  bool IsString() const { return type_ == STRING; }
+  bool IsList() const { return type_ == LIST; }
+  bool IsMap() const { return type_ == MAP; }
+
+  // Accessors; each returns an empty/zero value for other types.
+  std::string_view str() const;
+  int64_t int_val() const { return type_ == INT ? int_ : 0; }
+  bool bool_val() const { return type_ == BOOL && bool_; }
+  BpSpan<BpValue> list() const;
+  BpMap map() const;
 
   // Returns the string representation for STRING-typed values, or the empty
   // string otherwise.
@@ -50,22 +86,114 @@ struct BpValue {
   // non-list values.
   std::vector<std::string> AsStringList() const;
 
-  // Factory helpers
-  static BpValue String(const std::string& s);
-  static BpValue List(const std::vector<std::string>& v);
+  // Factory helpers.  Strings and elements are copied into |arena|.
+  static BpValue Int(int64_t v);
+  static BpValue Bool(bool v);
+  static BpValue String(BpArena* arena, std::string_view s);
+  static BpValue List(BpArena* arena, const std::vector<BpValue>& items);
+  static BpValue Map(const BpMap& map);
+
+ private:
+  Type type_;
+  uint32_t size_;  // string length, or number of list/map elements
+  union {
+    const char* str_;
+    int64_t int_;
+    bool bool_;
+    const BpValue* list_;
+    const BpProperty* map_;
+  };
+};
+
+// One key of a map or module.  Keys are interned in the arena.
+struct BpProperty {
+  std::string_view key;
+  BpValue value;
+};
+
+// A map value or a module's property set: a vector of BpProperty sorted by
+// key, searched by binary search.
+class BpMap {
+ public:
+  BpMap() = default;
+
+  // Sort |entries| by key into |arena|.  Of entries with the same key the
+  // last one wins.
+  static BpMap Build(BpArena* arena, std::vector<BpProperty> entries);
+
+  // The value of |key|, or nullptr.
+  const BpValue* Find(std::string_view key) const;
+
+  const BpProperty* begin() const { return entries_.begin(); }
+  const BpProperty* end() const { return entries_.end(); }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+ private:
+  friend class BpValue;
+  BpMap(const BpProperty* p, size_t n) : entries_(p, n) {}
+
+  BpSpan<BpProperty> entries_;
+};
+
+// Bump allocator holding the strings and arrays of one parsed file.  Strings
+// are interned, so repeated keys and flags are stored once per file.
+class BpArena {
+ public:
+  BpArena();
+  ~BpArena();
+
+  std::string_view Intern(std::string_view s);
+
+  // Copy |n| elements of a trivially destructible type.
+  template <typename T>
+  const T* Copy(const T* src, size_t n) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena memory is never destroyed");
+    if (n == 0) return nullptr;
+    T* dst = static_cast<T*>(Allocate(n * sizeof(T), alignof(T)));
+    std::uninitialized_copy(src, src + n, dst);
+    return dst;
+  }
+
+  size_t bytes_allocated() const { return bytes_allocated_; }
+
+ private:
+  void* Allocate(size_t size, size_t align);
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char* ptr_ = nullptr;
+  size_t avail_ = 0;
+  size_t bytes_allocated_ = 0;
+  std::unordered_set<std::string_view> strings_;
+
+  DISALLOW_COPY_AND_ASSIGN(BpArena);
 };
 
 // A single module definition, e.g. cc_binary { name: "foo", ... }.
 struct BpModule {
   std::string type;  // "cc_binary", "cc_library", etc.
   std::string name;
-  std::map<std::string, BpValue> properties;
+  BpMap properties;
+};
+
+// A glob expanded while parsing, with the files it matched.
+struct BpGlob {
+  std::string pattern;
+  std::vector<std::string> matches;
 };
 
-// The result of parsing a single Android.bp file.
+// The result of parsing a single Android.bp file.  Movable, not copyable:
+// the values in |modules| and |variables| point into |arena|.
 struct BpFile {
+  BpFile() : arena(new BpArena) {}
+
+  std::unique_ptr<BpArena> arena;
   std::vector<BpModule> modules;
   std::map<std::string, BpValue> variables;
+  // Globs in list literals are expanded at parse time, so the parse
+  // depends on directory contents as well as on the file itself.
+  std::vector<BpGlob> globs;
 };
 
 // A recursive-descent parser for Android.bp (Blueprint) files.
@@ -88,9 +216,10 @@ class BpParser {
   bool ParseFile(const std::string& path, BpFile* result);
 
   // Parse a source string directly.  Useful for testing.  The |path| is
-  // only used as a base directory for glob expansion.
-  bool ParseSource(const std::string& source, const std::string& path,
-                    BpFile* result);
+  // only used as a base directory for glob expansion.  |source| must stay
+  // valid until this returns.
+  bool ParseSource(std::string_view source, const std::string& path,
+                   BpFile* result);
 
   // Get the most recent error message (includes line numbers).
   const std::string& GetError() const;
@@ -100,6 +229,10 @@ class BpParser {
   //   src/**/*.c    - all .c files under src/ recursively
   std::vector<std::string> ExpandGlob(const std::string& pattern);
 
+  // Directory that globs are relative to.  ParseFile() sets it from the
+  // file's path.
+  void set_base_dir(const std::string& dir) { base_dir_ = dir; }
+
  private:
   // ---- Tokenizer ----
   enum TokenType {
@@ -119,13 +252,23 @@ class BpParser {
     TOK_RPAREN,    // )
   };
 
+  // A token is a slice of the source being parsed, or of unescaped_ for
+  // string literals that had escapes.  Tokens are produced on demand as the
+  // parser advances; only the current one and the next are kept.
   struct Token {
-    TokenType type;
-    std::string value;
+    TokenType type = TOK_EOF;
+    std::string_view value;
     int line = 0;
   };
 
-  bool Tokenize(const std::string& source, std::vector<Token>* tokens);
+  // Scan the token at src_pos_ into |tok|.  At the end of the source, or
+  // after a lexical error (see lex_error_), yields TOK_EOF.
+  void Lex(Token* tok);
+
+  // Copy a string literal body with its escapes resolved into unescaped_.
+  std::string_view Unescape(std::string_view raw);
+
+  void LexError(Token* tok, const std::string& msg);
 
   // ---- Parser (recursive descent) ----
 
@@ -136,7 +279,7 @@ class BpParser {
   bool ParseModule(BpModule* module);
 
   // Parse a single property inside a module: <key>: <value>
-  bool ParseProperty(std::map<std::string, BpValue>* props);
+  bool ParseProperty(std::vector<BpProperty>* props);
 
   // Parse a value, including + operator expressions.
   bool ParseValue(BpValue* value);
@@ -153,6 +296,11 @@ class BpParser {
   // Parse a map literal: { k1: v1, k2: v2, ... }
   bool ParseMap(BpValue* value);
 
+  // Set |key| in a property list being built.  As with +=, a list value is
+  // appended to an existing list; anything else replaces the old value.
+  void SetProperty(std::vector<BpProperty>* props, std::string_view key,
+                   const BpValue& val);
+
   // Parse a function call: ident(args). Skips the arguments and returns NONE.
   bool ParseFunctionCall(BpValue* value);
 
@@ -164,6 +312,7 @@ class BpParser {
   bool Accept(TokenType type);
   bool Expect(TokenType type, const std::string& what);
   const Token& Current() const;
+  const Token& Next() const;  // one token of lookahead
   void Advance();
   bool AtEnd() const;
 
@@ -185,9 +334,16 @@ class BpParser {
 
   // ---- State ----
   std::string error_;
-  size_t pos_ = 0;
-  std::vector<Token> tokens_;
+  std::string lex_error_;
+  std::string_view src_;
+  size_t src_pos_ = 0;
+  int line_ = 1;
+  Token cur_;
+  Token next_;
+  std::deque<std::string> unescaped_;  // stable storage for Unescape()
   std::map<std::string, BpValue>* variables_ = nullptr;
+  std::vector<BpGlob>* globs_ = nullptr;
+  BpArena* arena_ = nullptr;
   std::string base_dir_;  // directory of the file being parsed (for globs)
 };
 
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "build_log.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <unordered_set>
+
+#include "build_engine_base.h"
+
+namespace gormake {
+
+static const char kHeader[] = "# gormake build log v2";
+
+// Rewrite the log once it holds this many lines and more than half of
+// them are overridden.
+static const size_t kMinCompactLines = 1000;
+
+BuildLog::BuildLog() {
+}
+
+BuildLog::~BuildLog() {
+  Close();
+}
+
+bool BuildLog::Load(const std::string& path, size_t* nr_lines) {
+  *nr_lines = 0;
+  std::ifstream in(path);
+  if (!in.is_open()) return false;
+  std::string line;
+  if (!std::getline(in, line) || line != kHeader) return false;
+  while (std::getline(in, line)) {
+    ++*nr_lines;
+    size_t tab = line.find('\t');
+    if (tab == std::string::npos) continue;
+    std::string output = line.substr(0, tab);
+    Entry entry;
+    size_t pos = tab + 1;
+    tab = line.find('\t', pos);
+    entry.mtime_ns = strtoll(line.c_str() + pos, nullptr, 10);
+    if (tab == std::string::npos) continue;
+    pos = tab + 1;
+    tab = line.find('\t', pos);
+    entry.command_hash = strtoull(line.c_str() + pos, nullptr, 16);
+    while (tab != std::string::npos) {
+      pos = tab + 1;
+      tab = line.find('\t', pos);
+      entry.deps.push_back(line.substr(
+          pos, tab == std::string::npos ? std::string::npos : tab - pos));
+    }
+    entries_[output] = std::move(entry);
+  }
+  return true;
+}
+
+bool BuildLog::Open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mu_);
+  size_t nr_lines = 0;
+  bool loaded = Load(path, &nr_lines);
+
+  std::string dir = buildutil::DirName(path);
+  if (!buildutil::FileExists(dir)) buildutil::MkdirP(dir);
+
+  if (!loaded || (nr_lines >= kMinCompactLines &&
+                  nr_lines > 2 * entries_.size())) {
+    // Start over with just the live records.
+    std::string tmp_path = path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "w");
+    if (f == nullptr) {
+      fprintf(stderr, "gor_make: warning: cannot write %s: %s\n",
+              tmp_path.c_str(), strerror(errno));
+      return false;
+    }
+    fprintf(f, "%s\n", kHeader);
+    for (const auto& [output, entry] : entries_) WriteEntry(f, output, entry);
+    if (fclose(f) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      fprintf(stderr, "gor_make: warning: cannot write %s: %s\n",
+              path.c_str(), strerror(errno));
+      return false;
+    }
+  }
+
+  file_ = fopen(path.c_str(), "a");
+  if (file_ == nullptr) {
+    fprintf(stderr, "gor_make: warning: cannot write %s: %s\n",
+            path.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool BuildLog::Lookup(const std::string& output, Entry* entry) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = entries_.find(output);
+  if (it == entries_.end()) return false;
+  *entry = it->second;
+  return true;
+}
+
+void BuildLog::Record(const std::string& output, Entry entry) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (file_ != nullptr) {
+    // One line per record, flushed at once, so that an interrupted build
+    // keeps what it finished.
+    WriteEntry(file_, output, entry);
+    fflush(file_);
+  }
+  entries_[output] = std::move(entry);
+}
+
+void BuildLog::WriteEntry(FILE* f, const std::string& output,
+                          const Entry& entry) {
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx",
+           static_cast<unsigned long long>(entry.command_hash));
+  std::string line = output + "\t" + std::to_string(entry.mtime_ns) + "\t" +
+                     hash;
+  for (const auto& dep : entry.deps) {
+    line += '\t';
+    line += dep;
+  }
+  line += '\n';
+  fwrite(line.data(), 1, line.size(), f);
+}
+
+void BuildLog::Close() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+uint64_t HashCommand(const std::string& cmd) {
+  // 64-bit FNV-1a.
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : cmd) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h != 0 ? h : 1;
+}
+
+void ParseDepFile(const std::string& content, std::vector<std::string>* deps) {
+  std::unordered_set<std::string> seen(deps->begin(), deps->end());
+  bool in_targets = true;  // before the ':' of the current rule
+  std::string word;
+  auto flush = [&]() {
+    if (word.empty()) return;
+    if (in_targets) {
+      if (word.back() == ':') in_targets = false;
+    } else if (seen.insert(word).second) {
+      deps->push_back(word);
+    }
+    word.clear();
+  };
+
+  const size_t n = content.size();
+  for (size_t i = 0; i < n; ++i) {
+    char c = content[i];
+    char next = (i + 1 < n) ? content[i + 1] : '\0';
+    if (c == '\\' && (next == '\n' || next == '\r')) {
+      // Line continuation.
+      flush();
+      ++i;
+      if (next == '\r' && i + 1 < n && content[i + 1] == '\n') ++i;
+    } else if (c == '\\' && (next == ' ' || next == '#')) {
+      word += next;
+      ++i;
+    } else if (c == '$' && next == '$') {
+      word += '$';
+      ++i;
+    } else if (c == '\n') {
+      flush();
+      in_targets = true;
+    } else if (c == ' ' || c == '\t' || c == '\r') {
+      flush();
+    } else {
+      word += c;
+    }
+  }
+  flush();
+}
+
+}  // namespace gormake
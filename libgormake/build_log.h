@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef GORMAKE_LIBGORMAKE_BUILD_LOG_H_
+#define GORMAKE_LIBGORMAKE_BUILD_LOG_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "macros.h"
+
+namespace gormake {
+
+// A persistent record of what each build output was made from, kept in
+// the build directory across runs.
+//
+// For each output the log holds the output's mtime when it was recorded,
+// a hash of the command line that made it, and the files it depends on
+// beyond its listed inputs (the headers a compiler reported in its
+// depfile).  A record whose mtime no longer matches the output belongs to
+// some other version of the file and is ignored.
+//
+// The file is a text log: one line per record, appended as actions
+// finish, later lines overriding earlier ones.  Open() rewrites it
+// without the overridden lines once they make up most of it.
+//
+//   # gormake build log v2
+//   out/obj/foo/a.o<TAB>mtime_ns<TAB>command_hash<TAB>src/a.h<TAB>...
+class BuildLog {
+ public:
+  struct Entry {
+    int64_t mtime_ns = 0;
+    uint64_t command_hash = 0;
+    std::vector<std::string> deps;
+  };
+
+  BuildLog();
+  ~BuildLog();
+
+  // Load |path| if it exists and open it for appending.  Returns false
+  // (after printing a warning) if the log cannot be written; the build
+  // then simply records nothing.
+  bool Open(const std::string& path);
+
+  // Copy the record of |output| into |entry|.  Safe to call from several
+  // threads.
+  bool Lookup(const std::string& output, Entry* entry) const;
+
+  // Record |output| and append the record to the file.  Safe to call from
+  // several threads.
+  void Record(const std::string& output, Entry entry);
+
+  void Close();
+
+ private:
+  bool Load(const std::string& path, size_t* nr_lines);
+  void WriteEntry(FILE* f, const std::string& output, const Entry& entry);
+
+  mutable std::mutex mu_;
+  std::unordered_map<std::string, Entry> entries_;
+  FILE* file_ = nullptr;
+
+  DISALLOW_COPY_AND_ASSIGN(BuildLog);
+};
+
+// Hash of a command line as stored in the log.  Never 0, which stands for
+// "unknown".
+uint64_t HashCommand(const std::string& cmd);
+
+// Append the prerequisites of the rules in a gcc/clang depfile (as written
+// by -MD or -MMD) to |deps|, in order and without duplicates.  Handles
+// line continuations and escaped spaces.
+void ParseDepFile(const std::string& content, std::vector<std::string>* deps);
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_BUILD_LOG_H_
@@ -16,6 +16,8 @@
 
 #include "cmake_scanner.h"
 #include "build_engine_base.h"
+#include "dir_walker.h"
+#include "rd_file.h"
 
 #include <algorithm>
 #include <cctype>
@@ -24,7 +26,7 @@
 #include <stdexcept>
 #include <cstdlib>
 #include <cstring>
-#include <filesystem>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <sys/stat.h>
@@ -33,8 +35,6 @@
 
 namespace gormake {
 
-namespace fs = std::filesystem;
-
 static std::string Trim(const std::string& s) {
   size_t start = 0;
   while (start < s.size() && (s[start] == ' ' || s[start] == '\t' ||
@@ -70,72 +70,167 @@ static std::string ToLower(const std::string& s) {
 CmakeScanner::CmakeScanner() {}
 CmakeScanner::~CmakeScanner() {}
 
-bool CmakeScanner::ScanFile(const std::string& path) {
-  std::ifstream file(path);
-  if (!file.is_open()) return false;
+// Length of the opening bracket "[", "=" * n, "[" at |pos|, or 0 if there
+// is none.  |*level| receives n.
+static size_t BracketOpenLength(std::string_view src, size_t pos,
+                                size_t* level) {
+  if (pos >= src.size() || src[pos] != '[') return 0;
+  size_t i = pos + 1;
+  while (i < src.size() && src[i] == '=') i++;
+  if (i >= src.size() || src[i] != '[') return 0;
+  *level = i - pos - 1;
+  return i - pos + 1;
+}
 
-  current_.path = path;
-  current_.src_dir = buildutil::DirName(path);
-  pending_line_.clear();
-  paren_depth_ = 0;
-
-  std::string line;
-  while (std::getline(file, line)) {
-    // Accumulate multi-line commands (CMake commands can span lines
-    // until parens are balanced)
-    if (paren_depth_ > 0) {
-      pending_line_ += " " + line;
-    } else {
-      pending_line_ = line;
+// Position just past the "]", "=" * |level|, "]" closing a bracket
+// argument or comment whose content starts at |pos|; the end of |src| if
+// it is unterminated.
+static size_t BracketClose(std::string_view src, size_t pos, size_t level) {
+  std::string close = "]" + std::string(level, '=') + "]";
+  size_t end = src.find(close, pos);
+  return end == std::string_view::npos ? src.size() : end + close.size();
+}
+
+namespace {
+
+// Splits a CMake source into complete commands in one pass, keeping track
+// of parentheses, quoted arguments, [[bracket arguments]], # line comments
+// and #[[ ]] block comments as it goes.  Commands are slices of the
+// source; only a command that contains a comment is copied, with the
+// comment blanked out.
+class CmakeCommandReader {
+ public:
+  explicit CmakeCommandReader(std::string_view src) : src_(src) {}
+
+  // Store the next command, from its name to its closing parenthesis, in
+  // |command|.  The view stays valid until the next call.
+  bool Next(std::string_view* command) {
+    const size_t n = src_.size();
+    while (pos_ < n) {
+      char c = src_[pos_];
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+        pos_++;
+      } else if (c == '#') {
+        pos_ = SkipComment(pos_);
+      } else if (ReadCommand(command)) {
+        return true;
+      }
     }
+    return false;
+  }
 
-    // Recompute paren depth from scratch (string-aware)
-    // to handle multi-line commands correctly.
-    paren_depth_ = 0;
-    bool in_string = false;
-    for (size_t i = 0; i < pending_line_.size(); ++i) {
-      char c = pending_line_[i];
-      if (c == '"' && (i == 0 || pending_line_[i - 1] != '\\')) {
-        in_string = !in_string;
-      } else if (!in_string) {
-        if (c == '(') paren_depth_++;
-        else if (c == ')') paren_depth_ = (paren_depth_ > 0) ? paren_depth_ - 1 : 0;
+ private:
+  // Position after the comment starting at |pos|.
+  size_t SkipComment(size_t pos) const {
+    size_t level;
+    size_t open = BracketOpenLength(src_, pos + 1, &level);
+    if (open > 0) return BracketClose(src_, pos + 1 + open, level);
+    size_t eol = src_.find('\n', pos);
+    return eol == std::string_view::npos ? src_.size() : eol;
+  }
+
+  // Read from pos_ to the parenthesis closing the command.  Text that
+  // ends its line without opening one is not a command and is skipped.
+  bool ReadCommand(std::string_view* command) {
+    const size_t n = src_.size();
+    size_t start = pos_;
+    int depth = 0;
+    comments_.clear();
+    while (pos_ < n) {
+      char c = src_[pos_];
+      size_t level;
+      size_t open;
+      if (c == '"') {
+        // Quoted argument; a backslash escapes the next character.
+        for (pos_++; pos_ < n && src_[pos_] != '"'; pos_++) {
+          if (src_[pos_] == '\\') pos_++;
+        }
+        pos_++;
+      } else if (c == '\\') {
+        pos_ += 2;
+      } else if (c == '#') {
+        size_t end = SkipComment(pos_);
+        comments_.emplace_back(pos_ - start, end - pos_);
+        pos_ = end;
+      } else if (depth > 0 && (src_[pos_ - 1] == '(' ||
+                               src_[pos_ - 1] == ' ' ||
+                               src_[pos_ - 1] == '\t' ||
+                               src_[pos_ - 1] == '\n') &&
+                 (open = BracketOpenLength(src_, pos_, &level)) > 0) {
+        pos_ = BracketClose(src_, pos_ + open, level);
+      } else if (c == '(') {
+        depth++;
+        pos_++;
+      } else if (c == ')' && depth > 0) {
+        pos_++;
+        if (--depth == 0) break;
+      } else if (c == '\n' && depth == 0) {
+        return false;
+      } else {
+        pos_++;
       }
     }
+    if (pos_ > n) pos_ = n;
+    // An unterminated command at the end of the file is passed on as is.
+    *command = src_.substr(start, pos_ - start);
+    if (!comments_.empty()) {
+      scratch_.assign(command->data(), command->size());
+      for (const auto& [offset, len] : comments_) {
+        size_t end = std::min(offset + len, scratch_.size());
+        for (size_t k = offset; k < end; ++k) {
+          if (scratch_[k] != '\n') scratch_[k] = ' ';
+        }
+      }
+      *command = scratch_;
+    }
+    return true;
+  }
 
-    if (paren_depth_ > 0) continue;
+  std::string_view src_;
+  size_t pos_ = 0;
+  // (offset in the command, length) of each comment in it.
+  std::vector<std::pair<size_t, size_t>> comments_;
+  std::string scratch_;
+};
 
-    // Process the complete command
-    std::string full_line = pending_line_;
-    pending_line_.clear();
-    ProcessLine(full_line);
-  }
+}  // namespace
 
-  // Process any remaining pending line
-  if (!pending_line_.empty()) {
-    ProcessLine(pending_line_);
-  }
+bool CmakeScanner::ScanFile(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return false;
 
+  current_.path = path;
+  current_.src_dir = buildutil::DirName(path);
+  // An empty file cannot be mapped, and has no commands anyway.
+  if (st.st_size == 0) return true;
+
+  // Commands point straight into the mapping, so it stays open while
+  // scanning.
+  UnixFile::RdFile file;
+  if (!file.Open(path, O_RDONLY)) return false;
+  std::string_view source(static_cast<const char*>(file.GetFileMem()),
+                          static_cast<size_t>(file.GetLength()));
+
+  CmakeCommandReader reader(source);
+  std::string_view command;
+  while (reader.Next(&command)) {
+    ProcessLine(std::string(command));
+  }
   return true;
 }
 
 void CmakeScanner::ScanDirectory(const std::string& dir_path) {
-  for (auto& entry : fs::recursive_directory_iterator(dir_path)) {
-    if (entry.path().filename() == "CMakeLists.txt") {
-      std::string entry_str = entry.path().string();
-      if (entry_str.find("/out/") != std::string::npos) continue;
-      if (entry_str.find("/bazel-") != std::string::npos) continue;
-      if (entry_str.find("/.git/") != std::string::npos) continue;
-      if (entry_str.find("/build/") != std::string::npos) continue;
-      try {
-        ScanFile(entry_str);
-      } catch (const std::exception& e) {
-        std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
-                     entry_str.c_str(), e.what());
-      } catch (...) {
-        std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
-                     entry_str.c_str());
-      }
+  DirWalker walker({"CMakeLists.txt"});
+  walker.AddIgnorePattern("build");
+  for (const auto& entry_str : walker.FindFiles(dir_path, jobs_)) {
+    try {
+      ScanFile(entry_str);
+    } catch (const std::exception& e) {
+      std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
+                   entry_str.c_str(), e.what());
+    } catch (...) {
+      std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
+                   entry_str.c_str());
     }
   }
 }
@@ -144,20 +239,6 @@ const std::vector<CmakeTarget>& CmakeScanner::GetTargets() const {
   return targets_;
 }
 
-std::string CmakeScanner::StripComment(const std::string& line) const {
-  std::string result;
-  bool in_string = false;
-  for (size_t i = 0; i < line.size(); ++i) {
-    char c = line[i];
-    if (c == '"' && (i == 0 || line[i - 1] != '\\')) {
-      in_string = !in_string;
-    }
-    if (c == '#' && !in_string) break;
-    result += c;
-  }
-  return result;
-}
-
 std::string CmakeScanner::ExpandVars(const std::string& s) const {
   std::string result;
   for (size_t i = 0; i < s.size(); ++i) {
@@ -185,6 +266,21 @@ std::vector<std::string> CmakeScanner::ParseArgs(const std::string& args) {
 
   for (size_t i = 0; i < args.size(); ++i) {
     char c = args[i];
+    size_t level;
+    size_t open;
+    if (!in_string && current.empty() &&
+        (open = BracketOpenLength(args, i, &level)) > 0) {
+      // [[bracket argument]]: taken literally, without a newline right
+      // after the opening bracket.
+      size_t begin = i + open;
+      if (begin < args.size() && args[begin] == '\n') begin++;
+      std::string close = "]" + std::string(level, '=') + "]";
+      size_t end = args.find(close, begin);
+      if (end == std::string::npos) end = args.size();
+      result.push_back(args.substr(begin, end - begin));
+      i = std::min(end + close.size(), args.size()) - 1;
+      continue;
+    }
     if (c == '"' && (i == 0 || args[i - 1] != '\\')) {
       in_string = !in_string;
       continue;
@@ -218,7 +314,9 @@ std::vector<std::string> CmakeScanner::ParseArgs(const std::string& args) {
 
 bool CmakeScanner::ParseCommand(const std::string& line, std::string* cmd,
                                 std::string* args) {
-  std::string trimmed = Trim(StripComment(line));
+  // Comments are gone already, and the command ends at the parenthesis
+  // matching its first one (see CmakeCommandReader).
+  std::string trimmed = Trim(line);
   if (trimmed.empty()) return false;
 
   // Find the opening paren
@@ -227,16 +325,8 @@ bool CmakeScanner::ParseCommand(const std::string& line, std::string* cmd,
 
   *cmd = ToLower(Trim(trimmed.substr(0, paren_pos)));
 
-  // Find the matching closing paren
-  int depth = 1;
-  size_t end_pos = paren_pos + 1;
-  while (end_pos < trimmed.size() && depth > 0) {
-    if (trimmed[end_pos] == '(') depth++;
-    else if (trimmed[end_pos] == ')') depth--;
-    if (depth > 0) end_pos++;
-  }
-
-  if (depth != 0) return false;
+  size_t end_pos = trimmed.size() - 1;
+  if (end_pos <= paren_pos || trimmed[end_pos] != ')') return false;
 
   *args = trimmed.substr(paren_pos + 1, end_pos - paren_pos - 1);
   return true;
@@ -279,7 +369,7 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
       for (size_t i = 1; i < arg_list.size(); ++i) {
         t.srcs.push_back(arg_list[i]);
       }
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -319,7 +409,7 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
       for (size_t i = src_start; i < arg_list.size(); ++i) {
         t.srcs.push_back(arg_list[i]);
       }
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -330,14 +420,12 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
     if (arg_list.size() >= 1) {
       std::string target_name = arg_list[0];
       // Find the target and add sources
-      for (auto& t : targets_) {
-        if (t.name == target_name) {
-          for (size_t i = 1; i < arg_list.size(); ++i) {
-            std::string a = ToUpper(arg_list[i]);
-            if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
-            t.srcs.push_back(arg_list[i]);
-          }
-          return;
+      CmakeTarget* t = FindTarget(target_name);
+      if (t != nullptr) {
+        for (size_t i = 1; i < arg_list.size(); ++i) {
+          std::string a = ToUpper(arg_list[i]);
+          if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
+          t->srcs.push_back(arg_list[i]);
         }
       }
     }
@@ -348,14 +436,12 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
     // target_link_libraries(target [PRIVATE|PUBLIC|INTERFACE] lib1 ...)
     if (arg_list.size() >= 1) {
       std::string target_name = arg_list[0];
-      for (auto& t : targets_) {
-        if (t.name == target_name) {
-          for (size_t i = 1; i < arg_list.size(); ++i) {
-            std::string a = ToUpper(arg_list[i]);
-            if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
-            t.link_libs.push_back(arg_list[i]);
-          }
-          return;
+      CmakeTarget* t = FindTarget(target_name);
+      if (t != nullptr) {
+        for (size_t i = 1; i < arg_list.size(); ++i) {
+          std::string a = ToUpper(arg_list[i]);
+          if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
+          t->link_libs.push_back(arg_list[i]);
         }
       }
     }
@@ -365,15 +451,13 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
   if (cmd == "target_include_directories") {
     if (arg_list.size() >= 1) {
       std::string target_name = arg_list[0];
-      for (auto& t : targets_) {
-        if (t.name == target_name) {
-          for (size_t i = 1; i < arg_list.size(); ++i) {
-            std::string a = ToUpper(arg_list[i]);
-            if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
-            if (a == "BEFORE" || a == "SYSTEM") continue;
-            t.include_dirs.push_back(arg_list[i]);
-          }
-          return;
+      CmakeTarget* t = FindTarget(target_name);
+      if (t != nullptr) {
+        for (size_t i = 1; i < arg_list.size(); ++i) {
+          std::string a = ToUpper(arg_list[i]);
+          if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
+          if (a == "BEFORE" || a == "SYSTEM") continue;
+          t->include_dirs.push_back(arg_list[i]);
         }
       }
     }
@@ -383,14 +467,12 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
   if (cmd == "target_compile_definitions") {
     if (arg_list.size() >= 1) {
       std::string target_name = arg_list[0];
-      for (auto& t : targets_) {
-        if (t.name == target_name) {
-          for (size_t i = 1; i < arg_list.size(); ++i) {
-            std::string a = ToUpper(arg_list[i]);
-            if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
-            t.defines.push_back(arg_list[i]);
-          }
-          return;
+      CmakeTarget* t = FindTarget(target_name);
+      if (t != nullptr) {
+        for (size_t i = 1; i < arg_list.size(); ++i) {
+          std::string a = ToUpper(arg_list[i]);
+          if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
+          t->defines.push_back(arg_list[i]);
         }
       }
     }
@@ -400,14 +482,12 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
   if (cmd == "target_compile_options") {
     if (arg_list.size() >= 1) {
       std::string target_name = arg_list[0];
-      for (auto& t : targets_) {
-        if (t.name == target_name) {
-          for (size_t i = 1; i < arg_list.size(); ++i) {
-            std::string a = ToUpper(arg_list[i]);
-            if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
-            t.compile_options.push_back(arg_list[i]);
-          }
-          return;
+      CmakeTarget* t = FindTarget(target_name);
+      if (t != nullptr) {
+        for (size_t i = 1; i < arg_list.size(); ++i) {
+          std::string a = ToUpper(arg_list[i]);
+          if (a == "PRIVATE" || a == "PUBLIC" || a == "INTERFACE") continue;
+          t->compile_options.push_back(arg_list[i]);
         }
       }
     }
@@ -498,7 +578,7 @@ void CmakeScanner::ProcessLine(const std::string& raw_line) {
       t.type = "custom_target";
       t.src_dir = current_.src_dir;
       t.path = current_.path;
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -509,7 +589,7 @@ void CmakeScanner::FlushTarget(const std::string& type,
   if (!in_target_) return;
   current_.type = type;
   current_.name = name;
-  targets_.push_back(current_);
+  AddTarget(current_);
   in_target_ = false;
 }
 
@@ -611,12 +691,14 @@ static std::string ReplaceExt(const std::string& path,
   return base + new_ext;
 }
 
-static const CmakeTarget* FindTarget(const std::vector<CmakeTarget>& targets,
-                                      const std::string& name) {
-  for (const auto& t : targets) {
-    if (t.name == name) return &t;
-  }
-  return nullptr;
+void CmakeScanner::AddTarget(CmakeTarget t) {
+  target_index_.emplace(t.name, targets_.size());
+  targets_.push_back(std::move(t));
+}
+
+CmakeTarget* CmakeScanner::FindTarget(const std::string& name) {
+  auto it = target_index_.find(name);
+  return it != target_index_.end() ? &targets_[it->second] : nullptr;
 }
 
 int CmakeScanner::BuildAll() {
@@ -626,12 +708,17 @@ int CmakeScanner::BuildAll() {
     return 1;
   }
 
+  // Plan every target after the libraries it links, then build with up
+  // to -j compiles and links at once.  As before, a failure does not stop
+  // the targets that do not depend on it.
   int result = 0;
-  for (const auto& target : targets_) {
-    if (!BuildTarget(target)) {
-      result = 1;
-    }
+  ActionGraph graph;
+  std::vector<int> state(targets_.size(), 0);
+  std::vector<ActionId> done(targets_.size(), kNoAction);
+  for (size_t i = 0; i < targets_.size(); ++i) {
+    if (!PlanTarget(i, &graph, &state, &done)) result = 1;
   }
+  if (!graph.Run(jobs_, true)) result = 1;
 
   if (result == 0) {
     fprintf(stderr, "Build completed successfully.\n");
@@ -640,16 +727,42 @@ int CmakeScanner::BuildAll() {
   return result;
 }
 
-bool CmakeScanner::BuildTarget(const CmakeTarget& target) {
-  // Skip non-compilable targets
-  if (target.type == "custom_target") {
-    return true;
+bool CmakeScanner::PlanTarget(size_t index, ActionGraph* graph,
+                              std::vector<int>* state,
+                              std::vector<ActionId>* done) {
+  if ((*state)[index] == 2) return true;
+  // A target that failed to plan fails every dependent, not just the first.
+  if ((*state)[index] == 3) return false;
+  const CmakeTarget& target = targets_[index];
+  if ((*state)[index] == 1) {
+    fprintf(stderr, "gor_make: *** Circular dependency involving %s\n",
+            target.name.c_str());
+    return false;
   }
-  if (target.type == "interface_library") {
-    // Header-only, nothing to build
-    return true;
+  (*state)[index] = 1;
+
+  // Internal targets among the link libraries; the rest are system
+  // libraries.
+  bool ok = true;
+  std::vector<size_t> deps;
+  for (const auto& lib : target.link_libs) {
+    auto it = target_index_.find(lib);
+    if (it == target_index_.end() || it->second == index) continue;
+    if (!PlanTarget(it->second, graph, state, done)) ok = false;
+    deps.push_back(it->second);
   }
-  if (target.srcs.empty()) {
+  if (!ok) {
+    (*state)[index] = 3;
+    return false;
+  }
+  (*state)[index] = 2;
+
+  // Skip non-compilable targets; they still order their dependents after
+  // their own link libraries (e.g. an interface library).
+  if (target.type == "custom_target" ||
+      target.type == "interface_library" || target.srcs.empty()) {
+    (*done)[index] = graph->AddAction([]() { return true; });
+    for (size_t d : deps) graph->AddDep((*done)[index], (*done)[d]);
     return true;
   }
 
@@ -658,24 +771,30 @@ bool CmakeScanner::BuildTarget(const CmakeTarget& target) {
   if (!dry_run_) if (!buildutil::MkdirP(obj_dir)) {
     fprintf(stderr, "gor_make: *** Failed to create obj directory: %s\n",
             obj_dir.c_str());
+    (*state)[index] = 3;
     return false;
   }
 
-  // Compile all source files
+  // One action per source file.  Compiles depend on nothing: headers of
+  // other targets are sources, not build outputs.
+  std::vector<ActionId> compiles;
   for (const auto& src : target.srcs) {
-    std::string obj_file = GetObjectPath(target, src);
-    if (!CompileSource(target, src, obj_file)) {
-      return false;
-    }
+    compiles.push_back(graph->AddAction([this, &target, src]() {
+      return CompileSource(target, src, GetObjectPath(target, src));
+    }));
   }
 
-  // Link (except object libraries)
+  // Link (except object libraries) once the objects and the libraries it
+  // links are built.
+  ActionId last;
   if (target.type != "object_library") {
-    if (!LinkTarget(target)) {
-      return false;
-    }
+    last = graph->AddAction([this, &target]() { return LinkTarget(target); });
+  } else {
+    last = graph->AddAction([]() { return true; });
   }
-
+  for (ActionId c : compiles) graph->AddDep(last, c);
+  for (size_t d : deps) graph->AddDep(last, (*done)[d]);
+  (*done)[index] = last;
   return true;
 }
 
@@ -789,7 +908,7 @@ bool CmakeScanner::LinkTarget(const CmakeTarget& target) {
 
     // Add link libraries
     for (const auto& lib : target.link_libs) {
-      const CmakeTarget* dep_target = FindTarget(targets_, lib);
+      const CmakeTarget* dep_target = FindTarget(lib);
       if (dep_target) {
         // Local target — add its output path
         cmd += " " + GetOutputPath(*dep_target);
@@ -814,7 +933,7 @@ bool CmakeScanner::LinkTarget(const CmakeTarget& target) {
 
     // Add link libraries
     for (const auto& lib : target.link_libs) {
-      const CmakeTarget* dep_target = FindTarget(targets_, lib);
+      const CmakeTarget* dep_target = FindTarget(lib);
       if (dep_target) {
         // Local target — add its output path
         cmd += " " + GetOutputPath(*dep_target);
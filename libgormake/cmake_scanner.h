@@ -20,8 +20,11 @@
 #include <cstdint>
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "action_graph.h"
+
 namespace gormake {
 
 // Represents a target extracted from a CMakeLists.txt file.
@@ -53,7 +56,8 @@ class CmakeScanner {
   void SetDryRun(bool v) { dry_run_ = v; }
   void SetJobs(int j) { jobs_ = j; }
 
-  // Build all targets. Returns 0 on success.
+  // Build all targets, each after the internal targets it links, running
+  // up to SetJobs() compiles and links at once.  Returns 0 on success.
   int BuildAll();
 
  private:
@@ -70,15 +74,23 @@ class CmakeScanner {
   // Expand ${VAR} references
   std::string ExpandVars(const std::string& s) const;
 
-  // Strip comments
-  std::string StripComment(const std::string& line) const;
-
   // JSON helpers
   static std::string JsonEscape(const std::string& s);
   static void OutputArray(const std::vector<std::string>& arr);
 
-  // Build a single target (compile + link).
-  bool BuildTarget(const CmakeTarget& target);
+  // Append a target to targets_ and index it by name.  Lookups find the
+  // first target of a name.
+  void AddTarget(CmakeTarget t);
+
+  // The target named |name|, or nullptr.  Valid until the next AddTarget().
+  CmakeTarget* FindTarget(const std::string& name);
+
+  // Add the compile and link actions of targets_[index] to |graph| after
+  // those of the internal targets in its link_libs.  |state| is 0 (new),
+  // 1 (planning), 2 (planned) or 3 (failed) per target; |done| receives
+  // each target's last action.
+  bool PlanTarget(size_t index, ActionGraph* graph, std::vector<int>* state,
+                  std::vector<ActionId>* done);
 
   // Compile a source file into an object file.
   bool CompileSource(const CmakeTarget& target, const std::string& src,
@@ -102,6 +114,8 @@ class CmakeScanner {
                       const std::string& src_file) const;
 
   std::vector<CmakeTarget> targets_;
+  // Target name -> index in targets_.
+  std::unordered_map<std::string, size_t> target_index_;
   std::map<std::string, std::string> variables_;
 
   // Current target being built
@@ -109,10 +123,6 @@ class CmakeScanner {
   bool in_target_ = false;
   std::string current_target_name_;
 
-  // Track multi-line commands
-  std::string pending_line_;
-  int paren_depth_ = 0;
-
   // If/else stack
   std::vector<bool> cond_stack_;
   bool dry_run_ = false;
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dep_graph.h"
+
+#include <cstdio>
+
+#include "rule_db.h"
+#include "var_db.h"
+
+namespace gormake {
+
+// Split a string by whitespace into words.
+static void SplitWords(const std::string& s, std::vector<std::string>* out) {
+  size_t i = 0;
+  while (i < s.size()) {
+    while (i < s.size() && (s[i] == ' ' || s[i] == '\t')) i++;
+    size_t start = i;
+    while (i < s.size() && s[i] != ' ' && s[i] != '\t') i++;
+    if (i > start) out->push_back(s.substr(start, i - start));
+  }
+}
+
+DepGraph::DepGraph() {
+}
+
+DepGraph::~DepGraph() {
+}
+
+NodeId DepGraph::Intern(const std::string& name) {
+  auto it = ids_.find(name);
+  if (it != ids_.end()) return it->second;
+  NodeId id = static_cast<NodeId>(names_.size());
+  names_.push_back(name);
+  ids_.emplace(name, id);
+  return id;
+}
+
+NodeId DepGraph::Find(const std::string& name) const {
+  auto it = ids_.find(name);
+  return (it != ids_.end()) ? it->second : kInvalidNode;
+}
+
+bool DepGraph::Freeze(const RuleDB& rules, VariableDB* vars) {
+  names_.clear();
+  ids_.clear();
+
+  const auto& all_rules = rules.GetExplicitRules();
+
+  // Targets first, so that goals and rule owners get the lowest ids.
+  for (const auto& rule : all_rules) {
+    for (const auto& t : rule->targets) Intern(t);
+  }
+
+  // Intern each rule's prerequisites.  They were expanded when the rule
+  // was read; only rules under .SECONDEXPANSION are expanded again, once
+  // per target, with $@ set and $<, $^ and $+ naming the prerequisites of
+  // the target's earlier rules, as in GNU make.
+  bool any_second_expansion = false;
+  for (const auto& rule : all_rules) {
+    if (rule->second_expansion) any_second_expansion = true;
+  }
+  // Prerequisites of the rules read so far, per target.  Only kept if some
+  // rule needs them.
+  std::unordered_map<NodeId, std::vector<NodeId>> earlier;
+  auto set_earlier = [&](const std::vector<NodeId>& prev) {
+    std::string all;
+    std::string unique;
+    NodeSet seen;
+    for (NodeId p : prev) {
+      all += (all.empty() ? "" : " ") + names_[p];
+      if (seen.Test(p)) continue;
+      seen.Set(p);
+      unique += (unique.empty() ? "" : " ") + names_[p];
+    }
+    vars->SetAutomatic("<", prev.empty() ? "" : names_[prev[0]]);
+    vars->SetAutomatic("^", unique);
+    vars->SetAutomatic("+", all);
+  };
+  std::vector<std::vector<NodeId>> rule_prereqs(all_rules.size());
+  std::vector<std::vector<NodeId>> rule_order_only(all_rules.size());
+  // [rule][target index] for second-expansion rules.
+  std::vector<std::vector<std::vector<NodeId>>> target_prereqs(
+      all_rules.size());
+  std::vector<std::vector<std::vector<NodeId>>> target_order_only(
+      all_rules.size());
+  std::vector<std::string> words;
+  auto intern_list = [&](const std::vector<std::string>& list,
+                         const std::string* target,
+                         std::vector<NodeId>* out) {
+    for (const auto& p : list) {
+      if (target == nullptr) {
+        out->push_back(Intern(p));
+        continue;
+      }
+      words.clear();
+      vars->PushAutomaticScope();
+      vars->SetAutomatic("@", *target);
+      set_earlier(earlier[Intern(*target)]);
+      SplitWords(vars->Expand(p), &words);
+      vars->PopAutomaticScope();
+      for (const auto& w : words) out->push_back(Intern(w));
+    }
+  };
+  for (size_t r = 0; r < all_rules.size(); ++r) {
+    const Rule& rule = *all_rules[r];
+    if (!rule.second_expansion) {
+      intern_list(rule.prereqs, nullptr, &rule_prereqs[r]);
+      intern_list(rule.order_only_prereqs, nullptr, &rule_order_only[r]);
+      if (!any_second_expansion) continue;
+      for (const auto& t : rule.targets) {
+        auto& prev = earlier[Intern(t)];
+        prev.insert(prev.end(), rule_prereqs[r].begin(),
+                    rule_prereqs[r].end());
+      }
+      continue;
+    }
+    target_prereqs[r].resize(rule.targets.size());
+    target_order_only[r].resize(rule.targets.size());
+    for (size_t k = 0; k < rule.targets.size(); ++k) {
+      intern_list(rule.prereqs, &rule.targets[k], &target_prereqs[r][k]);
+      intern_list(rule.order_only_prereqs, &rule.targets[k],
+                  &target_order_only[r][k]);
+      auto& prev = earlier[Intern(rule.targets[k])];
+      prev.insert(prev.end(), target_prereqs[r][k].begin(),
+                  target_prereqs[r][k].end());
+    }
+  }
+
+  frozen_count_ = names_.size();
+  const size_t n = frozen_count_;
+
+  // Rules per target, in definition order.  Rule slots remember which
+  // entry of all_rules (and which of its targets) they came from.
+  std::vector<uint32_t> rule_count(n, 0);
+  for (const auto& rule : all_rules) {
+    for (const auto& t : rule->targets) rule_count[ids_[t]]++;
+  }
+  rule_offsets_.assign(n + 1, 0);
+  for (size_t id = 0; id < n; ++id) {
+    rule_offsets_[id + 1] = rule_offsets_[id] + rule_count[id];
+  }
+  rules_.assign(rule_offsets_[n], nullptr);
+  std::vector<uint32_t> slot_rule(rule_offsets_[n]);
+  std::vector<uint32_t> slot_target(rule_offsets_[n]);
+  std::vector<uint32_t> fill(rule_offsets_.begin(), rule_offsets_.end() - 1);
+  for (size_t r = 0; r < all_rules.size(); ++r) {
+    const auto& targets = all_rules[r]->targets;
+    for (size_t k = 0; k < targets.size(); ++k) {
+      uint32_t slot = fill[ids_[targets[k]]]++;
+      rules_[slot] = all_rules[r].get();
+      slot_rule[slot] = static_cast<uint32_t>(r);
+      slot_target[slot] = static_cast<uint32_t>(k);
+    }
+  }
+
+  // Per-slot prerequisites.
+  slot_prereq_offsets_.assign(1, 0);
+  slot_order_only_offsets_.assign(1, 0);
+  slot_prereqs_.clear();
+  slot_order_only_.clear();
+  for (size_t slot = 0; slot < slot_rule.size(); ++slot) {
+    uint32_t r = slot_rule[slot];
+    bool per_target = all_rules[r]->second_expansion;
+    const auto& prereqs = per_target ? target_prereqs[r][slot_target[slot]]
+                                     : rule_prereqs[r];
+    const auto& order_only = per_target
+        ? target_order_only[r][slot_target[slot]] : rule_order_only[r];
+    slot_prereqs_.insert(slot_prereqs_.end(), prereqs.begin(), prereqs.end());
+    slot_order_only_.insert(slot_order_only_.end(), order_only.begin(),
+                            order_only.end());
+    slot_prereq_offsets_.push_back(slot_prereqs_.size());
+    slot_order_only_offsets_.push_back(slot_order_only_.size());
+  }
+
+  // Recipe rule and merged prerequisites per target.
+  bool ok = true;
+  recipe_rule_.assign(n, 0);
+  prereq_offsets_.assign(1, 0);
+  order_only_offsets_.assign(1, 0);
+  prereqs_.clear();
+  order_only_.clear();
+  NodeSet seen;
+  for (size_t id = 0; id < n; ++id) {
+    uint32_t begin = rule_offsets_[id];
+    uint32_t end = rule_offsets_[id + 1];
+    uint32_t recipe = begin;
+    bool has_recipe = false;
+    for (uint32_t slot = begin; slot < end; ++slot) {
+      if (rules_[slot]->is_double_colon != rules_[begin]->is_double_colon) {
+        fprintf(stderr,
+                "gor_make: *** target file '%s' has both : and :: entries."
+                "  Stop.\n", names_[id].c_str());
+        ok = false;
+        break;
+      }
+      if (rules_[slot]->recipes.empty()) continue;
+      if (has_recipe && !rules_[slot]->is_double_colon) {
+        fprintf(stderr,
+                "gor_make: warning: overriding recipe for target '%s'\n",
+                names_[id].c_str());
+      }
+      recipe = slot;
+      has_recipe = true;
+    }
+    if (begin < end && rules_[begin]->is_double_colon) recipe = begin;
+    recipe_rule_[id] = recipe;
+
+    auto merge = [&](const std::vector<uint32_t>& offsets,
+                     const std::vector<NodeId>& cols,
+                     std::vector<NodeId>* out) {
+      size_t first = out->size();
+      auto add_slot = [&](uint32_t slot) {
+        for (uint32_t i = offsets[slot]; i < offsets[slot + 1]; ++i) {
+          if (seen.Test(cols[i])) continue;
+          seen.Set(cols[i]);
+          out->push_back(cols[i]);
+        }
+      };
+      if (begin < end) add_slot(recipe);
+      for (uint32_t slot = begin; slot < end; ++slot) {
+        if (slot != recipe) add_slot(slot);
+      }
+      for (size_t i = first; i < out->size(); ++i) seen.Reset((*out)[i]);
+    };
+    merge(slot_prereq_offsets_, slot_prereqs_, &prereqs_);
+    merge(slot_order_only_offsets_, slot_order_only_, &order_only_);
+    prereq_offsets_.push_back(prereqs_.size());
+    order_only_offsets_.push_back(order_only_.size());
+  }
+  return ok;
+}
+
+DepGraph::Row<NodeId> DepGraph::Prereqs(NodeId id) const {
+  return RowOf(prereq_offsets_, prereqs_, id);
+}
+
+DepGraph::Row<NodeId> DepGraph::OrderOnlyPrereqs(NodeId id) const {
+  return RowOf(order_only_offsets_, order_only_, id);
+}
+
+DepGraph::Row<Rule*> DepGraph::Rules(NodeId id) const {
+  return RowOf(rule_offsets_, rules_, id);
+}
+
+DepGraph::Row<NodeId> DepGraph::RulePrereqs(NodeId id, size_t k) const {
+  return RowOf(slot_prereq_offsets_, slot_prereqs_, rule_offsets_[id] + k);
+}
+
+DepGraph::Row<NodeId> DepGraph::RuleOrderOnlyPrereqs(NodeId id,
+                                                     size_t k) const {
+  return RowOf(slot_order_only_offsets_, slot_order_only_,
+               rule_offsets_[id] + k);
+}
+
+Rule* DepGraph::RecipeRule(NodeId id) const {
+  if (Rules(id).empty()) return nullptr;
+  return rules_[recipe_rule_[id]];
+}
+
+bool DepGraph::IsDoubleColon(NodeId id) const {
+  Row<Rule*> r = Rules(id);
+  return !r.empty() && r[0]->is_double_colon;
+}
+
+}  // namespace gormake
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GORMAKE_LIBGORMAKE_DEP_GRAPH_H_
+#define GORMAKE_LIBGORMAKE_DEP_GRAPH_H_
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace gormake {
+
+struct Rule;
+class RuleDB;
+class VariableDB;
+
+// Dense identifier of a target or prerequisite in a DepGraph.
+typedef uint32_t NodeId;
+static const NodeId kInvalidNode = 0xffffffffu;
+
+// A bitset indexed by NodeId.  Used instead of string hash sets for the
+// visited/building state of graph walks.
+class NodeSet {
+ public:
+  bool Test(NodeId id) const {
+    size_t w = id >> 6;
+    return w < words_.size() && (words_[w] >> (id & 63)) & 1;
+  }
+  void Set(NodeId id) {
+    Resize(id + 1);
+    words_[id >> 6] |= uint64_t(1) << (id & 63);
+  }
+  void Reset(NodeId id) {
+    size_t w = id >> 6;
+    if (w < words_.size()) words_[w] &= ~(uint64_t(1) << (id & 63));
+  }
+  // Make room for at least |nr_nodes| bits.
+  void Resize(size_t nr_nodes) {
+    size_t nr_words = (nr_nodes + 63) >> 6;
+    if (nr_words > words_.size()) words_.resize(nr_words, 0);
+  }
+
+ private:
+  std::vector<uint64_t> words_;
+};
+
+// The frozen prerequisite graph of a parsed makefile.
+//
+// Freeze() interns every target and prerequisite into a dense NodeId and
+// stores the prerequisite lists (and the rules of each target) in
+// compressed-sparse-row form: one offsets array per relation plus one flat
+// array of ids.  Walking the graph is then a linear scan over two flat
+// arrays instead of a string hash lookup per edge.
+//
+// Nodes may still be interned after Freeze() (e.g. prerequisites produced
+// by pattern rules); such nodes simply have empty rows.
+class DepGraph {
+ public:
+  // A [begin, end) view into one CSR row.
+  template <typename T>
+  class Row {
+   public:
+    Row(const T* b, const T* e) : begin_(b), end_(e) {}
+    const T* begin() const { return begin_; }
+    const T* end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+    const T& operator[](size_t i) const { return begin_[i]; }
+
+   private:
+    const T* begin_;
+    const T* end_;
+  };
+
+  DepGraph();
+  ~DepGraph();
+
+  // Build the graph from all explicit rules.  Prerequisites were expanded
+  // when the rules were read; those of .SECONDEXPANSION rules are expanded
+  // again here with |vars|, per target, with $@ and with $<, $^ and $+ set
+  // from the target's earlier rules.  Node ids follow first appearance in
+  // the makefile, so iteration order is deterministic.  Returns false (after
+  // printing an error) if a target has both single- and double-colon rules.
+  bool Freeze(const RuleDB& rules, VariableDB* vars);
+
+  // Return the id of |name|, adding a new node if necessary.
+  NodeId Intern(const std::string& name);
+
+  // Return the id of |name|, or kInvalidNode.
+  NodeId Find(const std::string& name) const;
+
+  // Name of a node.  The reference stays valid across later Intern() calls.
+  const std::string& Name(NodeId id) const { return names_[id]; }
+
+  size_t NodeCount() const { return names_.size(); }
+
+  // Number of nodes that have CSR rows (those interned by Freeze()).
+  size_t FrozenCount() const { return frozen_count_; }
+
+  // Normal and order-only prerequisites of a target, merged over all of
+  // its rules without duplicates.  The prerequisites of the rule with the
+  // recipe come first.
+  Row<NodeId> Prereqs(NodeId id) const;
+  Row<NodeId> OrderOnlyPrereqs(NodeId id) const;
+
+  // All explicit rules of a target, in definition order.
+  Row<Rule*> Rules(NodeId id) const;
+
+  // Prerequisites of the |k|th rule of a target only.  Used for
+  // double-colon rules, which are updated independently.
+  Row<NodeId> RulePrereqs(NodeId id, size_t k) const;
+  Row<NodeId> RuleOrderOnlyPrereqs(NodeId id, size_t k) const;
+
+  // The rule whose recipe makes a target: the last rule with a recipe, or
+  // the first rule if none has one.  nullptr if the target has no rules.
+  Rule* RecipeRule(NodeId id) const;
+
+  // True if the target's rules are double-colon rules.
+  bool IsDoubleColon(NodeId id) const;
+
+ private:
+  template <typename T>
+  static Row<T> RowOf(const std::vector<uint32_t>& offsets,
+                      const std::vector<T>& cols, NodeId id) {
+    if (id + 1 >= offsets.size()) return Row<T>(nullptr, nullptr);
+    return Row<T>(cols.data() + offsets[id], cols.data() + offsets[id + 1]);
+  }
+
+  // Node names.  A deque keeps references stable as nodes are added.
+  std::deque<std::string> names_;
+  std::unordered_map<std::string, NodeId> ids_;
+  size_t frozen_count_ = 0;
+
+  // CSR: prerequisites.
+  std::vector<uint32_t> prereq_offsets_;
+  std::vector<NodeId> prereqs_;
+
+  // CSR: order-only prerequisites.
+  std::vector<uint32_t> order_only_offsets_;
+  std::vector<NodeId> order_only_;
+
+  // CSR: rules per target.
+  std::vector<uint32_t> rule_offsets_;
+  std::vector<Rule*> rules_;
+
+  // Index into rules_ of each target's recipe rule.
+  std::vector<uint32_t> recipe_rule_;
+
+  // CSR over rule slots (positions in rules_): per-rule prerequisites.
+  std::vector<uint32_t> slot_prereq_offsets_;
+  std::vector<NodeId> slot_prereqs_;
+  std::vector<uint32_t> slot_order_only_offsets_;
+  std::vector<NodeId> slot_order_only_;
+};
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_DEP_GRAPH_H_
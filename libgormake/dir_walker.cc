@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dir_walker.h"
+
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <fstream>
+#include <mutex>
+#include <sys/stat.h>
+
+#include "thread_pool.h"
+
+namespace gormake {
+
+DirWalker::DirWalker(const std::vector<std::string>& file_names)
+    : file_names_(file_names) {
+  AddIgnorePattern(".git");
+  AddIgnorePattern(".repo");
+  AddIgnorePattern("out");
+  AddIgnorePattern("bazel-*");
+}
+
+DirWalker::~DirWalker() {
+}
+
+// Add |pattern| to |names| or, if it contains '/', to |paths|.
+static void AddPattern(const std::string& pattern,
+                       std::vector<std::string>* names,
+                       std::vector<std::string>* paths) {
+  std::string p = pattern;
+  while (!p.empty() && p.back() == '/') p.pop_back();
+  while (p.size() > 1 && p[0] == '/') p.erase(0, 1);
+  if (p.empty()) return;
+  if (p.find('/') == std::string::npos) {
+    names->push_back(p);
+  } else {
+    paths->push_back(p);
+  }
+}
+
+// True if |name| matches any of the fnmatch |patterns|.
+static bool MatchesAny(const std::vector<std::string>& patterns,
+                       const char* name, int flags) {
+  for (const auto& p : patterns) {
+    if (fnmatch(p.c_str(), name, flags) == 0) return true;
+  }
+  return false;
+}
+
+void DirWalker::AddIgnorePattern(const std::string& pattern) {
+  AddPattern(pattern, &name_patterns_, &path_patterns_);
+}
+
+void DirWalker::LoadIgnoreFile(const std::string& path) {
+  // The patterns of each walk's own root replace those of the last walk.
+  file_name_patterns_.clear();
+  file_path_patterns_.clear();
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    size_t hash = line.find('#');
+    if (hash != std::string::npos) line.erase(hash);
+    size_t b = line.find_first_not_of(" \t\r");
+    size_t e = line.find_last_not_of(" \t\r");
+    if (b == std::string::npos) continue;
+    AddPattern(line.substr(b, e - b + 1), &file_name_patterns_,
+               &file_path_patterns_);
+  }
+}
+
+bool DirWalker::Ignored(const char* name, const std::string& rel_path) const {
+  return MatchesAny(name_patterns_, name, 0) ||
+         MatchesAny(file_name_patterns_, name, 0) ||
+         MatchesAny(path_patterns_, rel_path.c_str(), FNM_PATHNAME) ||
+         MatchesAny(file_path_patterns_, rel_path.c_str(), FNM_PATHNAME);
+}
+
+void DirWalker::Walk(const std::string& root, ThreadPool* pool,
+                     const std::function<void(const std::string&)>& on_file) {
+  std::string dir = root;
+  while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+  LoadIgnoreFile(dir + "/.gormakeignore");
+  if (pool == nullptr) {
+    WalkDir(dir, "", nullptr, on_file);
+  } else {
+    pool->Submit([this, dir, pool, &on_file]() {
+      WalkDir(dir, "", pool, on_file);
+    });
+  }
+}
+
+void DirWalker::WalkDir(
+    const std::string& dir, const std::string& rel_path, ThreadPool* pool,
+    const std::function<void(const std::string&)>& on_file) {
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) return;
+  struct dirent* ent;
+  while ((ent = readdir(d)) != nullptr) {
+    const char* name = ent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+    std::string path = dir + "/" + name;
+    unsigned char type = ent->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat(path.c_str(), &st) != 0) continue;
+      type = S_ISDIR(st.st_mode) ? DT_DIR
+           : S_ISREG(st.st_mode) ? DT_REG
+           : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+    }
+    if (type == DT_DIR) {
+      std::string rel = rel_path.empty() ? name : rel_path + "/" + name;
+      if (Ignored(name, rel)) continue;
+      if (pool == nullptr) {
+        WalkDir(path, rel, nullptr, on_file);
+      } else {
+        pool->Submit([this, path, rel, pool, &on_file]() {
+          WalkDir(path, rel, pool, on_file);
+        });
+      }
+    } else if (type == DT_REG || type == DT_LNK) {
+      if (!MatchesAny(file_names_, name, 0)) continue;
+      // A symlinked build file is reported like a regular one; symlinked
+      // directories are not entered.
+      struct stat st;
+      if (type == DT_LNK &&
+          (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))) {
+        continue;
+      }
+      on_file(path);
+    }
+  }
+  closedir(d);
+}
+
+std::vector<std::string> DirWalker::FindFiles(const std::string& root,
+                                              int jobs) {
+  std::mutex mu;
+  std::vector<std::string> found;
+  std::function<void(const std::string&)> add = [&](const std::string& path) {
+    std::lock_guard<std::mutex> lock(mu);
+    found.push_back(path);
+  };
+  {
+    ThreadPool pool(jobs);
+    Walk(root, &pool, add);
+    pool.Wait();
+  }
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+}  // namespace gormake
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GORMAKE_LIBGORMAKE_DIR_WALKER_H_
+#define GORMAKE_LIBGORMAKE_DIR_WALKER_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "macros.h"
+
+namespace gormake {
+
+class ThreadPool;
+
+// Finds build files in a directory tree for the scanners.
+//
+// Ignored directories are pruned before they are entered, so nothing
+// below them is ever listed.  By default .git, .repo, out and bazel-* are
+// ignored; more patterns come from AddIgnorePattern() and from a
+// .gormakeignore file in the walk root (one fnmatch pattern per line, '#'
+// starts a comment).  A pattern without '/' matches a directory name at
+// any depth; one with '/' matches the path relative to the root, e.g.
+// "prebuilts" or "vendor/*/out".
+//
+// Entry types come from readdir's d_type, so most entries need no stat().
+// Symlinks to matching files are reported; symlinked directories are not
+// followed.
+class DirWalker {
+ public:
+  // |file_names| are fnmatch patterns of the file names to report.
+  explicit DirWalker(const std::vector<std::string>& file_names);
+  ~DirWalker();
+
+  void AddIgnorePattern(const std::string& pattern);
+
+  // Walk |root|, calling |on_file| with the path ("root/sub/name") of each
+  // matching file.  With a |pool|, every directory is listed by its own
+  // task and |on_file| runs on pool threads; the caller waits for the pool,
+  // and |on_file| must live until then.  Without one the walk is
+  // sequential.
+  void Walk(const std::string& root, ThreadPool* pool,
+            const std::function<void(const std::string&)>& on_file);
+
+  // Walk with |jobs| threads (<= 0: one per hardware thread) and return
+  // the matching paths sorted.
+  std::vector<std::string> FindFiles(const std::string& root, int jobs);
+
+ private:
+  void LoadIgnoreFile(const std::string& path);
+
+  // True if the directory |name| at |rel_path| (relative to the root) is
+  // to be skipped.
+  bool Ignored(const char* name, const std::string& rel_path) const;
+
+  void WalkDir(const std::string& dir, const std::string& rel_path,
+               ThreadPool* pool,
+               const std::function<void(const std::string&)>& on_file);
+
+  std::vector<std::string> file_names_;
+  std::vector<std::string> name_patterns_;
+  std::vector<std::string> path_patterns_;
+  // From the .gormakeignore of the current walk's root.
+  std::vector<std::string> file_name_patterns_;
+  std::vector<std::string> file_path_patterns_;
+
+  DISALLOW_COPY_AND_ASSIGN(DirWalker);
+};
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_DIR_WALKER_H_
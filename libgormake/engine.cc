@@ -21,8 +21,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
-#include <sstream>
+#include <spawn.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -70,35 +69,76 @@ static std::vector<std::string> SplitWords(const std::string& s) {
   return result;
 }
 
-// Handle line continuation (backslash-newline).
-static std::string JoinContinuations(const std::string& input) {
-  std::string result;
-  result.reserve(input.size());
-  for (size_t i = 0; i < input.size(); ++i) {
-    if (input[i] == '\\' && i + 1 < input.size()) {
-      if (input[i+1] == '\n') {
-        // Line continuation: replace with single space, skip newline
-        result += ' ';
-        i++;  // skip newline
-        // Skip leading whitespace on next line
-        while (i + 1 < input.size() && (input[i+1] == ' ' || input[i+1] == '\t')) {
-          i++;
-        }
-      } else if (input[i+1] == '\r' && i + 2 < input.size() &&
-                 input[i+2] == '\n') {
-        result += ' ';
-        i += 2;
-        while (i + 1 < input.size() && (input[i+1] == ' ' || input[i+1] == '\t')) {
-          i++;
-        }
-      } else {
-        result += input[i];
+// Find |c| in |s| outside of $(...) and ${...} references.
+static size_t FindTopLevel(const std::string& s, char c) {
+  int depth = 0;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '$' && i + 1 < s.size()) {
+      if (s[i+1] == '(' || s[i+1] == '{') {
+        depth++;
+        i++;
+        continue;
       }
-    } else {
-      result += input[i];
+      if (s[i+1] == '$') {
+        i++;
+        continue;
+      }
+    }
+    if (depth > 0) {
+      if (s[i] == ')' || s[i] == '}') depth--;
+      continue;
     }
+    if (s[i] == c) return i;
   }
-  return result;
+  return std::string::npos;
+}
+
+// True if |s| is a variable assignment (=, :=, ::=, += or ?=) rather than
+// a rule.  An '=' after the rule colon is a target-specific assignment,
+// which is treated as a rule.
+static bool IsAssignmentLine(const std::string& s) {
+  size_t eq = FindTopLevel(s, '=');
+  if (eq == std::string::npos) return false;
+  size_t colon = FindTopLevel(s, ':');
+  if (colon == std::string::npos || colon > eq) return true;
+  // := and ::=
+  return s.find_first_not_of(':', colon) == eq;
+}
+
+// The parts of "NAME op value".
+struct Assignment {
+  std::string name;
+  std::string value;
+  VarFlavor flavor = VarFlavor::FLAVOR_RECURSIVE;
+  bool append = false;
+  bool conditional = false;
+};
+
+// Split an assignment line (or a define header followed by its body) at
+// the top-level operator.
+static void ParseAssignment(const std::string& s, Assignment* out) {
+  size_t eq = FindTopLevel(s, '=');
+  size_t op = eq;
+  if (eq > 0 && s[eq-1] == ':') {
+    op = (eq > 1 && s[eq-2] == ':') ? eq - 2 : eq - 1;
+    out->flavor = VarFlavor::FLAVOR_SIMPLE;
+  } else if (eq > 0 && s[eq-1] == '+') {
+    op = eq - 1;
+    out->append = true;
+  } else if (eq > 0 && s[eq-1] == '?') {
+    op = eq - 1;
+    out->conditional = true;
+  }
+  out->name = Strip(s.substr(0, op));
+  out->value = s.substr(eq + 1);
+}
+
+// Apply a parsed assignment with |value| (the stripped value or a define
+// body).  ?= does nothing if the variable is already set.
+static void Assign(VariableDB* vars, const Assignment& a,
+                   const std::string& value, VarOrigin origin) {
+  if (a.conditional && vars->IsDefined(a.name)) return;
+  vars->Set(a.name, value, a.flavor, origin, a.append);
 }
 
 // Trim leading tabs from a recipe line (keeping recipe context).
@@ -137,8 +177,51 @@ static RecipeLine ParseRecipeLine(const std::string& raw) {
 
 // Engine implementation --------------------------------------------------
 
+// Quote |s| for a POSIX shell.
+static std::string ShellQuote(const std::string& s) {
+  std::string result = "'";
+  for (char c : s) {
+    if (c == '\'') {
+      result += "'\\''";
+    } else {
+      result += c;
+    }
+  }
+  return result + "'";
+}
+
+// Run |script| as "shell flags... script", like system() but honouring
+// SHELL and .SHELLFLAGS, with environment |envp|.  Returns the wait status,
+// or -1 if the shell could not be started.
+static int RunShell(const std::string& shell,
+                    const std::vector<std::string>& flags,
+                    const std::string& script, char* const* envp) {
+  std::vector<char*> argv;
+  argv.push_back(const_cast<char*>(shell.c_str()));
+  for (const auto& f : flags) argv.push_back(const_cast<char*>(f.c_str()));
+  argv.push_back(const_cast<char*>(script.c_str()));
+  argv.push_back(nullptr);
+
+  pid_t pid;
+  if (posix_spawnp(&pid, shell.c_str(), nullptr, nullptr, argv.data(),
+                   envp) != 0) {
+    return -1;
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) return -1;
+  }
+  return status;
+}
+
+// True if a wait status from RunShell() means success.
+static bool ShellSucceeded(int status) {
+  return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 Engine::Engine() {
   vars_.ImportEnvironment();
+  vars_.SetEvalHandler([this](const std::string& text) { ParseText(text); });
 }
 
 Engine::~Engine() {
@@ -199,13 +282,24 @@ int Engine::Run(const MakeOptions& opts) {
     }
   }
 
-  // Parse the makefile
-  if (!ParseMakefile(opts.makefile_path)) {
+  // Parse the makefile.  Included files are read ahead on worker threads.
+  prefetcher_.reset(new MakefilePrefetcher(0));
+  bool parsed = ParseMakefile(opts.makefile_path);
+  prefetcher_.reset();
+  if (!parsed) {
     fprintf(stderr, "gor_make: *** No rule to make target '%s'. Stop.\n",
             opts.makefile_path.c_str());
     return 2;
   }
 
+  // Intern targets and expand explicit prerequisites once.
+  if (!graph_.Freeze(rules_, &vars_)) {
+    return 2;
+  }
+  frozen_ = true;
+  vpath_.SetVpathVariable(vars_.Expand("$(VPATH)"));
+  rules_.CompilePatterns(!opts.no_builtin_rules);
+
   // JSON output mode: print rule relationships and exit
   if (opts.json_output) {
     OutputJson();
@@ -232,48 +326,107 @@ int Engine::Run(const MakeOptions& opts) {
     return 2;
   }
 
-  // Build each goal
+  for (const auto& goal : goals) goals_.Set(graph_.Intern(goal));
+  BuildEnvironment();
+
+  // Plan each goal, then run whatever could be planned.
   int result = 0;
+  NodeSet building;
   for (const auto& goal : goals) {
-    std::unordered_set<std::string> visited;
-    std::unordered_set<std::string> building;
-    if (!BuildTarget(goal, visited, building)) {
+    ActionId action;
+    if (!PlanTarget(graph_.Intern(goal), building, &action)) {
       result = 1;
       if (!opts.keep_going) break;
     }
   }
+  if (!actions_.Run(opts.jobs, opts.keep_going)) {
+    result = 1;
+  }
 
+  DeleteIntermediates();
   return result;
 }
 
+void Engine::BuildEnvironment() {
+  env_strings_ = vars_.ExportedEnvironment();
+
+  // Recipes run with the SHELL make was started with, not $(SHELL).
+  const char* shell = getenv("SHELL");
+  if (shell != nullptr) env_strings_.push_back(std::string("SHELL=") + shell);
+
+  int level = 0;
+  const char* makelevel = getenv("MAKELEVEL");
+  if (makelevel != nullptr) level = atoi(makelevel);
+  env_strings_.erase(
+      std::remove_if(env_strings_.begin(), env_strings_.end(),
+                     [](const std::string& e) {
+                       return e.compare(0, 10, "MAKELEVEL=") == 0;
+                     }),
+      env_strings_.end());
+  env_strings_.push_back("MAKELEVEL=" + std::to_string(level + 1));
+
+  envp_.clear();
+  for (auto& e : env_strings_) envp_.push_back(&e[0]);
+  envp_.push_back(nullptr);
+}
+
+std::unique_ptr<MakefileText> Engine::LoadMakefile(const std::string& path) {
+  std::unique_ptr<MakefileText> text;
+  if (prefetcher_) {
+    text = prefetcher_->Get(path);
+    // Start on this file's includes while it is being evaluated.
+    for (const auto& inc : text->literal_includes) prefetcher_->Prefetch(inc);
+  } else {
+    text.reset(new MakefileText);
+    ReadMakefile(path, text.get());
+  }
+  return text;
+}
+
 bool Engine::ParseMakefile(const std::string& path) {
-  std::ifstream file(path);
-  if (!file.is_open()) {
+  std::unique_ptr<MakefileText> text = LoadMakefile(path);
+  if (!text->ok) {
     // Try GNUmakefile, makefile
-    file.open("GNUmakefile");
-    if (!file.is_open()) {
-      file.open("makefile");
-      if (!file.is_open()) {
+    text = LoadMakefile("GNUmakefile");
+    if (!text->ok) {
+      text = LoadMakefile("makefile");
+      if (!text->ok) {
         return false;
       }
     }
   }
 
-  std::string content((std::istreambuf_iterator<char>(file)),
-                       std::istreambuf_iterator<char>());
-  file.close();
+  ParseLines(text->lines);
+  return true;
+}
+
+// Maximum nesting of $(eval) and computed rule lines.
+static const int kMaxParseDepth = 64;
+
+void Engine::ParseText(const std::string& text) {
+  MakefileText lexed;
+  LexMakefile(text, &lexed);
+  ParseLines(lexed.lines);
+}
 
-  // Handle line continuations
-  content = JoinContinuations(content);
+void Engine::ParseLines(const std::vector<MakefileLine>& lines) {
+  if (parse_depth_ >= kMaxParseDepth) {
+    fprintf(stderr, "gor_make: *** $(eval) nested too deeply.  Stop.\n");
+    return;
+  }
+  parse_depth_++;
 
-  // Process line by line
-  std::istringstream stream(content);
-  std::string line;
-  int line_num = 0;
   Rule* current_rule = nullptr;
 
-  while (std::getline(stream, line)) {
-    line_num++;
+  for (size_t line_idx = 0; line_idx < lines.size(); ++line_idx) {
+    const std::string& line = lines[line_idx].text;
+    MakefileLineKind kind = lines[line_idx].kind;
+
+    // Blank and comment lines never matter outside a define body.
+    if (kind == MakefileLineKind::BLANK ||
+        kind == MakefileLineKind::COMMENT) {
+      continue;
+    }
 
     // Check if conditional is active
     bool cond_active = true;
@@ -283,6 +436,7 @@ bool Engine::ParseMakefile(const std::string& path) {
 
     // Handle conditionals first (even if inactive, to track nesting)
     std::string stripped = Strip(line);
+    bool export_assignment = false;
 
     // Check for directives
     if (!stripped.empty() && stripped[0] != '\t') {
@@ -345,13 +499,68 @@ bool Engine::ParseMakefile(const std::string& path) {
         continue;
       }
 
+      // define NAME [op] ... endef.  The body is consumed even inside an
+      // inactive conditional so that its lines are not taken as directives.
+      std::string define_line = stripped;
+      bool define_override = false;
+      bool define_export = false;
+      for (;;) {
+        if (define_line.substr(0, 9) == "override ") {
+          define_override = true;
+          define_line = LStrip(define_line.substr(9));
+        } else if (define_line.substr(0, 7) == "export ") {
+          define_export = true;
+          define_line = LStrip(define_line.substr(7));
+        } else {
+          break;
+        }
+      }
+      if (define_line.substr(0, 7) == "define " ||
+          define_line.substr(0, 7) == "define\t") {
+        std::string header = Strip(define_line.substr(7));
+        std::string body;
+        int nesting = 1;
+        bool first = true;
+        while (++line_idx < lines.size()) {
+          const std::string& raw = lines[line_idx].text;
+          std::string body_line = Strip(raw);
+          if (body_line.substr(0, 7) == "define " ||
+              body_line.substr(0, 7) == "define\t") {
+            nesting++;
+          } else if (body_line == "endef" ||
+                     body_line.substr(0, 6) == "endef " ||
+                     body_line.substr(0, 6) == "endef#") {
+            if (--nesting == 0) break;
+          }
+          if (!first) body += '\n';
+          body += raw;
+          first = false;
+        }
+        if (cond_active) {
+          Assignment assign;
+          if (FindTopLevel(header, '=') != std::string::npos) {
+            ParseAssignment(header, &assign);
+          } else {
+            assign.name = header;
+          }
+          assign.name = vars_.Expand(assign.name);
+          Assign(&vars_, assign, body,
+                 define_override ? VarOrigin::ORIGIN_OVERRIDE
+                                 : VarOrigin::ORIGIN_FILE);
+          if (define_export) {
+            vars_.SetExport(assign.name, VarExport::EXPORT_EXPORT);
+          }
+        }
+        current_rule = nullptr;
+        continue;
+      }
+
       if (!cond_active) continue;
 
-      // Include directive
-      if (stripped.substr(0, 8) == "include " || stripped == "include" ||
-          stripped.substr(0, 9) == "-include " || stripped.substr(0, 2) == "-!") {
-        std::string args = Strip(stripped.substr(stripped.find_first_of(" \t")));
-        ProcessInclude(args);
+      // Include directive (include, -include, sinclude)
+      if (kind == MakefileLineKind::INCLUDE) {
+        size_t sp = stripped.find_first_of(" \t");
+        if (sp != std::string::npos) ProcessInclude(Strip(stripped.substr(sp)));
         continue;
       }
 
@@ -363,16 +572,39 @@ bool Engine::ParseMakefile(const std::string& path) {
         stripped = "override " + rest;
       }
 
+      // export/unexport [VAR...], or export VAR = value.
       if (stripped.substr(0, 7) == "export " || stripped == "export" ||
-          stripped.substr(0, 9) == "unexport " || stripped == "unexport" ||
-          stripped.substr(0, 6) == "define " || stripped == "define") {
-        // Simplified: skip export/unexport, handle define later
-        if (stripped.substr(0, 6) == "define") {
-          // Skip until endef
-          while (std::getline(stream, line)) {
-            line_num++;
-            if (Strip(line) == "endef") break;
+          stripped.substr(0, 9) == "unexport " || stripped == "unexport") {
+        bool unexport = stripped[0] == 'u';
+        std::string rest = Strip(stripped.substr(unexport ? 8 : 6));
+        if (rest.empty()) {
+          vars_.SetExportAll(!unexport);
+          continue;
+        }
+        if (!unexport && IsAssignmentLine(rest)) {
+          export_assignment = true;
+          stripped = rest;
+        } else {
+          for (const auto& name : SplitWords(vars_.Expand(rest))) {
+            vars_.SetExport(name, unexport ? VarExport::EXPORT_UNEXPORT
+                                           : VarExport::EXPORT_EXPORT);
           }
+          continue;
+        }
+      }
+
+      // vpath [PATTERN [DIRS]]
+      if ((stripped.substr(0, 6) == "vpath " || stripped == "vpath") &&
+          !IsAssignmentLine(stripped)) {
+        auto words = SplitWords(vars_.Expand(stripped.substr(5)));
+        if (words.empty()) {
+          vpath_.ClearAll();
+        } else if (words.size() == 1) {
+          vpath_.ClearVpath(words[0]);
+        } else {
+          std::string dirs;
+          for (size_t i = 1; i < words.size(); ++i) dirs += words[i] + " ";
+          vpath_.AddVpath(words[0], dirs);
         }
         continue;
       }
@@ -391,6 +623,27 @@ bool Engine::ParseMakefile(const std::string& path) {
             }
             continue;
           }
+          if (targets == ".INTERMEDIATE" || targets == ".SECONDARY" ||
+              targets == ".PRECIOUS") {
+            auto words = SplitWords(vars_.Expand(prereqs));
+            for (const auto& w : words) {
+              if (targets == ".INTERMEDIATE") rules_.MarkIntermediate(w);
+              if (targets == ".SECONDARY") rules_.MarkSecondary(w);
+              if (targets == ".PRECIOUS") rules_.MarkPrecious(w);
+            }
+            if (targets == ".SECONDARY" && words.empty()) {
+              rules_.MarkSecondary("");
+            }
+            continue;
+          }
+          if (targets == ".ONESHELL") {
+            oneshell_ = true;
+            continue;
+          }
+          if (targets == ".SECONDEXPANSION") {
+            second_expansion_ = true;
+            continue;
+          }
           if (targets == ".DEFAULT_GOAL") {
             vars_.Set(".DEFAULT_GOAL", vars_.Expand(prereqs),
                       VarFlavor::FLAVOR_RECURSIVE, VarOrigin::ORIGIN_FILE, false);
@@ -435,86 +688,32 @@ bool Engine::ParseMakefile(const std::string& path) {
     processed_line = Strip(processed_line);
     if (processed_line.empty()) continue;
 
-    // Check for variable assignment: VAR = / := / += / ?=
-    bool is_assignment = false;
-    for (size_t i = 0; i < processed_line.size(); ++i) {
-      if (processed_line[i] == '=') {
-        is_assignment = true;
-        break;
+    // Check for variable assignment: VAR = / := / ::= / += / ?=
+    if (IsAssignmentLine(processed_line)) {
+      Assignment assign;
+      ParseAssignment(processed_line, &assign);
+      VarOrigin origin = VarOrigin::ORIGIN_FILE;
+      if (assign.name.substr(0, 9) == "override ") {
+        assign.name = Strip(assign.name.substr(9));
+        origin = VarOrigin::ORIGIN_OVERRIDE;
       }
-      if (processed_line[i] == ':') {
-        // Could be := or a target rule
-        if (i + 1 < processed_line.size() && processed_line[i+1] == '=') {
-          is_assignment = true;
-        }
-        break;  // : without = means it's a target
+      Assign(&vars_, assign, Strip(assign.value), origin);
+      if (export_assignment) {
+        vars_.SetExport(assign.name, VarExport::EXPORT_EXPORT);
       }
+      current_rule = nullptr;
+      continue;
     }
 
-    if (is_assignment) {
-      // Parse variable assignment
-      size_t op_pos = std::string::npos;
-      VarFlavor flavor = VarFlavor::FLAVOR_RECURSIVE;
-      bool append = false;
-      bool conditional = false;
-
-      for (size_t i = 0; i < processed_line.size(); ++i) {
-        if (processed_line[i] == '=' && op_pos == std::string::npos) {
-          op_pos = i;
-          flavor = VarFlavor::FLAVOR_RECURSIVE;
-          break;
-        }
-        if (processed_line[i] == ':' && i + 1 < processed_line.size() &&
-            processed_line[i+1] == '=') {
-          op_pos = i;
-          flavor = VarFlavor::FLAVOR_SIMPLE;
-          break;
-        }
-        if (processed_line[i] == '+' && i + 1 < processed_line.size() &&
-            processed_line[i+1] == '=') {
-          op_pos = i;
-          flavor = VarFlavor::FLAVOR_RECURSIVE;
-          append = true;
-          break;
-        }
-        if (processed_line[i] == '?' && i + 1 < processed_line.size() &&
-            processed_line[i+1] == '=') {
-          op_pos = i;
-          flavor = VarFlavor::FLAVOR_RECURSIVE;
-          conditional = true;
-          break;
-        }
-      }
-
-      if (op_pos != std::string::npos) {
-        std::string name = Strip(processed_line.substr(0, op_pos));
-        std::string value;
-        size_t val_start = op_pos + 1;
-        if (flavor == VarFlavor::FLAVOR_SIMPLE || append || conditional) {
-          val_start = op_pos + 2;
-        }
-        if (val_start <= processed_line.size()) {
-          value = Strip(processed_line.substr(val_start));
-        }
-
-        if (conditional && vars_.IsDefined(name)) {
-          // ?= and already defined: skip
-        } else {
-          VarOrigin origin = VarOrigin::ORIGIN_FILE;
-          if (name.substr(0, 9) == "override ") {
-            name = Strip(name.substr(9));
-            origin = VarOrigin::ORIGIN_OVERRIDE;
-          }
-          vars_.Set(name, value, flavor, origin, append);
-        }
+    // It must be a rule: target : prereqs
+    size_t colon = FindTopLevel(processed_line, ':');
+    if (colon != std::string::npos) {
+      if (frozen_) {
+        fprintf(stderr,
+                "gor_make: *** prerequisites cannot be defined in recipes.\n");
         current_rule = nullptr;
         continue;
       }
-    }
-
-    // It must be a rule: target : prereqs
-    size_t colon = processed_line.find(':');
-    if (colon != std::string::npos) {
       // Check for ::= (double colon)
       bool double_colon = false;
       size_t rule_start = colon + 1;
@@ -523,7 +722,15 @@ bool Engine::ParseMakefile(const std::string& path) {
         rule_start++;
       }
 
-      std::string targets_str = Strip(processed_line.substr(0, colon));
+      // Check for &: (grouped targets)
+      bool grouped = false;
+      size_t targets_end = colon;
+      if (!double_colon && colon > 0 && processed_line[colon - 1] == '&') {
+        grouped = true;
+        targets_end--;
+      }
+
+      std::string targets_str = Strip(processed_line.substr(0, targets_end));
       std::string prereqs_str = Strip(processed_line.substr(rule_start));
 
       // Expand targets and prereqs
@@ -547,12 +754,31 @@ bool Engine::ParseMakefile(const std::string& path) {
         }
       }
 
+      // After .SECONDEXPANSION, prerequisite text that still holds
+      // references is kept whole and expanded again per target.  Other
+      // rules never pay for a second expansion.
+      bool second_expansion = second_expansion_ &&
+          expanded_prereqs.find('$') != std::string::npos;
+      if (second_expansion) {
+        normal_prereqs.clear();
+        order_only_prereqs.clear();
+        size_t pipe = FindTopLevel(expanded_prereqs, '|');
+        std::string normal = Strip(expanded_prereqs.substr(0, pipe));
+        if (!normal.empty()) normal_prereqs.push_back(normal);
+        if (pipe != std::string::npos) {
+          std::string order_only = Strip(expanded_prereqs.substr(pipe + 1));
+          if (!order_only.empty()) order_only_prereqs.push_back(order_only);
+        }
+      }
+
       if (!targets.empty()) {
         auto rule = std::make_unique<Rule>();
         rule->targets = targets;
         rule->prereqs = normal_prereqs;
         rule->order_only_prereqs = order_only_prereqs;
+        rule->second_expansion = second_expansion;
         rule->is_double_colon = double_colon;
+        rule->is_grouped = grouped && targets.size() > 1;
 
         // Check for pattern rules
         for (const auto& t : targets) {
@@ -562,24 +788,40 @@ bool Engine::ParseMakefile(const std::string& path) {
           }
         }
 
+        // Pattern rules with several targets are always grouped.
+        if (rule->is_pattern && targets.size() > 1) {
+          rule->is_grouped = true;
+        }
+
         current_rule = rule.get();
         rules_.AddRule(std::move(rule));
         continue;
       }
     }
 
-    // Unrecognized line, skip
+    // Anything else is a computed line such as $(eval ...) or a variable
+    // holding a rule or an assignment: expand it and parse whatever it
+    // produced.
+    std::string computed = vars_.Expand(processed_line);
+    if (computed != processed_line && !Strip(computed).empty()) {
+      ParseText(computed);
+    }
     current_rule = nullptr;
   }
 
-  return true;
+  parse_depth_--;
 }
 
 void Engine::ProcessInclude(const std::string& args) {
   std::string expanded = vars_.Expand(args);
   auto files = SplitWords(expanded);
+  // Read all of them in parallel, then evaluate in order.
+  if (prefetcher_) {
+    for (const auto& f : files) prefetcher_->Prefetch(f);
+  }
   for (const auto& f : files) {
-    ParseMakefile(f);
+    std::unique_ptr<MakefileText> text = LoadMakefile(f);
+    if (text->ok) ParseLines(text->lines);
   }
 }
 
@@ -650,161 +892,441 @@ bool Engine::ProcessConditional(const std::string& directive,
   return false;
 }
 
-bool Engine::BuildTarget(const std::string& target,
-                         std::unordered_set<std::string>& visited,
-                         std::unordered_set<std::string>& building) {
+bool Engine::ResolveTarget(NodeId id, ResolvedTarget* out) {
+  Rule* rule = graph_.RecipeRule(id);
+  out->rule = rule;
+  out->stem.clear();
+  out->prereqs.clear();
+  out->order_only.clear();
+
+  // Like GNU make, an explicit rule without a recipe still gets its recipe
+  // from an implicit rule, and keeps its own prerequisites after the
+  // implicit ones.
+  if (!rule || (rule->recipes.empty() && !rule->is_double_colon &&
+                !rules_.IsPhony(graph_.Name(id)))) {
+    bool cut_off = false;
+    int m = FindImplicitRule(id, 0, &cut_off);
+    if (m >= 0) {
+      const ImplicitMatch& match = implicit_matches_[m];
+      out->rule = match.rule;
+      out->stem = match.stem;
+      out->prereqs = match.prereqs;
+      out->order_only = match.order_only;
+    }
+  }
+  if (rule) {
+    auto p = graph_.Prereqs(id);
+    out->prereqs.insert(out->prereqs.end(), p.begin(), p.end());
+    auto o = graph_.OrderOnlyPrereqs(id);
+    out->order_only.insert(out->order_only.end(), o.begin(), o.end());
+  }
+  return out->rule != nullptr;
+}
+
+// Bound on implicit rule chain length, as a guard against rules such as
+// "%.a: %.a.b" that generate endless new names.
+static const int kMaxImplicitDepth = 8;
+
+int Engine::FindImplicitRule(NodeId id, int depth, bool* cut_off) {
+  auto& memo = implicit_memo_[depth > 0 ? 1 : 0];
+  auto it = memo.find(id);
+  if (it != memo.end()) return it->second;
+  if (depth > kMaxImplicitDepth || implicit_searching_.Test(id)) {
+    *cut_off = true;
+    return -1;
+  }
+  implicit_searching_.Set(id);
+
+  // Copy: interning prerequisites may add nodes.
+  const std::string name = graph_.Name(id);
+  std::vector<PatternMatch> candidates;
+  rules_.MatchPatternRules(name, depth == 0, &candidates);
+
+  std::vector<std::vector<NodeId>> prereqs(candidates.size());
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    ExpandPatternPrereqs(*candidates[i].rule, false, name,
+                         candidates[i].stem, &prereqs[i]);
+  }
+
+  // First look for a rule whose prerequisites all exist or ought to exist;
+  // only then allow prerequisites that are themselves made by implicit
+  // rules (intermediate files).
+  int result = -1;
+  bool searched_all = true;
+  for (int pass = 0; pass < 2 && result < 0; ++pass) {
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      bool usable = true;
+      for (NodeId p : prereqs[i]) {
+        if (OughtToExist(p)) continue;
+        bool sub_cut_off = false;
+        if (pass == 1 && FindImplicitRule(p, depth + 1, &sub_cut_off) >= 0) {
+          continue;
+        }
+        if (sub_cut_off) searched_all = false;
+        usable = false;
+        break;
+      }
+      if (!usable) continue;
+
+      ImplicitMatch match;
+      match.rule = candidates[i].rule;
+      match.stem = candidates[i].stem;
+      match.prereqs = std::move(prereqs[i]);
+      ExpandPatternPrereqs(*match.rule, true, name, match.stem,
+                           &match.order_only);
+      for (NodeId p : match.prereqs) {
+        if (!OughtToExist(p)) chained_.Set(p);
+      }
+      result = static_cast<int>(implicit_matches_.size());
+      implicit_matches_.push_back(std::move(match));
+      break;
+    }
+  }
+
+  // A candidate rejected only because the depth limit or the cycle guard
+  // stopped its chain may work when reached another way, so such a result
+  // is not memoized.
+  implicit_searching_.Reset(id);
+  if (searched_all) {
+    memo[id] = result;
+  } else {
+    *cut_off = true;
+  }
+  return result;
+}
+
+void Engine::ExpandPatternPrereqs(const Rule& rule, bool order_only,
+                                  const std::string& target,
+                                  const std::string& stem,
+                                  std::vector<NodeId>* out) {
+  const auto& prereqs = order_only ? rule.order_only_prereqs : rule.prereqs;
+  for (const auto& prereq : prereqs) {
+    // Second expansion sees $@ and $*; the words then get the stem.
+    std::vector<std::string> words;
+    if (rule.second_expansion) {
+      vars_.PushAutomaticScope();
+      vars_.SetAutomatic("@", target);
+      vars_.SetAutomatic("*", stem);
+      words = SplitWords(vars_.Expand(prereq));
+      vars_.PopAutomaticScope();
+    } else {
+      words.push_back(prereq);
+    }
+    for (auto& w : words) {
+      // In pattern rules, replace % with stem in prereqs
+      size_t pct = w.find('%');
+      if (pct != std::string::npos) {
+        w = w.substr(0, pct) + stem + w.substr(pct + 1);
+      }
+      out->push_back(graph_.Intern(w));
+    }
+  }
+}
+
+bool Engine::OughtToExist(NodeId id) {
+  // Every node interned by Freeze() is mentioned in the makefile.
+  return id < graph_.FrozenCount() ||
+         GetFileMtime(FilePath(graph_.Name(id))) != 0;
+}
+
+bool Engine::IsIntermediate(NodeId id) const {
+  if (goals_.Test(id)) return false;
+  return chained_.Test(id) || rules_.IsIntermediate(graph_.Name(id));
+}
+
+bool Engine::IntermediateOutOfDate(NodeId id, long target_mtime) {
+  ResolvedTarget resolved;
+  if (!ResolveTarget(id, &resolved)) return true;
+  for (NodeId p : resolved.prereqs) {
+    const std::string& name = graph_.Name(p);
+    if (rules_.IsPhony(name)) return true;
+    long mtime = GetFileMtime(FilePath(name));
+    if (mtime == 0) {
+      if (IsIntermediate(p) && !IntermediateOutOfDate(p, target_mtime)) {
+        continue;
+      }
+      return true;
+    }
+    if (mtime > target_mtime) return true;
+  }
+  return false;
+}
+
+void Engine::DeleteIntermediates() {
+  std::string removed;
+  for (NodeId id : created_intermediates_) {
+    const std::string& name = graph_.Name(id);
+    if (unlink(name.c_str()) != 0) continue;
+    removed += removed.empty() ? "rm " : " ";
+    removed += name;
+  }
+  created_intermediates_.clear();
+  if (!removed.empty() && !opts_->silent) {
+    printf("%s\n", removed.c_str());
+    fflush(stdout);
+  }
+}
+
+// planned_ entry of a node that has not been planned yet.
+static const ActionId kUnplanned = -2;
+
+void Engine::SetPlanned(NodeId id, ActionId action) {
+  if (planned_.size() <= id) planned_.resize(graph_.NodeCount(), kUnplanned);
+  planned_[id] = action;
+}
+
+bool Engine::PlanTarget(NodeId id, NodeSet& building, ActionId* action) {
+  *action = kNoAction;
+
+  // Copy: interning pattern prerequisites below may add nodes.
+  const std::string target = graph_.Name(id);
+
   // Cycle detection
-  if (building.count(target) > 0) {
+  if (building.Test(id)) {
     fprintf(stderr, "gor_make: Circular dependency detected for '%s'.\n",
             target.c_str());
     return false;
   }
 
-  // Already built?
-  if (visited.count(target) > 0) return true;
-
-  // Find the rule for this target
-  Rule* rule = rules_.FindFirstRule(target);
-  std::string stem;
-  bool is_pattern = false;
-
-  if (!rule) {
-    // Try pattern rules
-    rule = rules_.FindPatternRule(target, stem);
-    if (rule) {
-      is_pattern = true;
-    }
+  // Already planned?
+  if (plan_failed_.Test(id)) return false;
+  if (id < planned_.size() && planned_[id] != kUnplanned) {
+    *action = planned_[id];
+    return true;
   }
 
-  // If no rule and file exists, it's a source file — nothing to do
-  if (!rule) {
+  // Find the rule for this target, explicit or implicit
+  ResolvedTarget resolved;
+  if (!ResolveTarget(id, &resolved)) {
+    // If no rule and file exists, it's a source file — nothing to do
     struct stat st;
-    if (stat(target.c_str(), &st) == 0) {
-      visited.insert(target);
+    if (stat(FilePath(target).c_str(), &st) == 0) {
+      SetPlanned(id, kNoAction);
       return true;
     }
     fprintf(stderr, "gor_make: *** No rule to make target '%s'.  Stop.\n",
             target.c_str());
+    plan_failed_.Set(id);
     return false;
   }
 
-  building.insert(target);
-
-  // Build prerequisites first
-  std::vector<std::string> expanded_prereqs;
-  for (const auto& prereq : rule->prereqs) {
-    std::string expanded;
-    if (is_pattern) {
-      // In pattern rules, replace % with stem in prereqs
-      std::string p = prereq;
-      size_t pct = p.find('%');
+  // A grouped rule is one action for all of its targets.
+  std::vector<NodeId> outputs(1, id);
+  std::pair<const Rule*, std::string> group(resolved.rule, resolved.stem);
+  if (resolved.rule->is_grouped) {
+    auto it = group_actions_.find(group);
+    if (it != group_actions_.end()) {
+      SetPlanned(id, it->second);
+      *action = it->second;
+      return true;
+    }
+    for (const auto& t : resolved.rule->targets) {
+      std::string name = t;
+      size_t pct = name.find('%');
       if (pct != std::string::npos) {
-        p = p.substr(0, pct) + stem + p.substr(pct + 1);
+        name = name.substr(0, pct) + resolved.stem + name.substr(pct + 1);
       }
-      expanded = vars_.Expand(p);
-    } else {
-      expanded = vars_.Expand(prereq);
+      NodeId out = graph_.Intern(name);
+      if (out != id) outputs.push_back(out);
     }
-    auto words = SplitWords(expanded);
-    for (const auto& w : words) {
-      expanded_prereqs.push_back(w);
-      if (!BuildTarget(w, visited, building)) {
-        building.erase(target);
-        if (!opts_->keep_going) return false;
-      }
+  }
+
+  building.Set(id);
+
+  long target_mtime = opts_->always_make ? 0 : GetFileMtime(FilePath(target));
+  bool ok = true;
+  ActionId last = kNoAction;
+
+  // Add the job after its prerequisites' actions.  Double-colon rules of
+  // one target run in order, each after the previous one.
+  auto add_job = [&](const Rule* rule, const std::vector<NodeId>& prereqs,
+                     const std::vector<NodeId>& order_only, bool double_colon) {
+    std::vector<ActionId> deps;
+    ok = PlanPrereqs(prereqs, false, target_mtime, building, &deps);
+    if (!ok) return;
+    PlanPrereqs(order_only, true, target_mtime, building, &deps);
+
+    TargetJob job;
+    job.id = id;
+    job.outputs = outputs;
+    job.rule = rule;
+    job.stem = resolved.stem;
+    for (NodeId p : prereqs) job.prereqs.push_back(FilePath(graph_.Name(p)));
+    job.double_colon = double_colon;
+    job.planned_mtime = GetFileMtime(FilePath(target));
+
+    ActionId a = actions_.AddAction([this, job]() { return RunJob(job); });
+    for (ActionId d : deps) actions_.AddDep(a, d);
+    actions_.AddDep(a, last);
+    last = a;
+  };
+
+  if (graph_.IsDoubleColon(id)) {
+    auto rules = graph_.Rules(id);
+    for (size_t k = 0; k < rules.size() && ok; ++k) {
+      auto p = graph_.RulePrereqs(id, k);
+      auto o = graph_.RuleOrderOnlyPrereqs(id, k);
+      add_job(rules[k], std::vector<NodeId>(p.begin(), p.end()),
+              std::vector<NodeId>(o.begin(), o.end()), true);
     }
+  } else {
+    add_job(resolved.rule, resolved.prereqs, resolved.order_only, false);
   }
 
-  // Build order-only prerequisites (they don't affect timestamp checking)
-  for (const auto& prereq : rule->order_only_prereqs) {
-    std::string expanded = vars_.Expand(prereq);
-    auto words = SplitWords(expanded);
-    for (const auto& w : words) {
-      BuildTarget(w, visited, building);
+  building.Reset(id);
+  if (!ok) {
+    plan_failed_.Set(id);
+    return false;
+  }
+  if (resolved.rule->is_grouped) group_actions_[group] = last;
+  for (NodeId out : outputs) SetPlanned(out, last);
+  *action = last;
+  return true;
+}
+
+bool Engine::PlanPrereqs(const std::vector<NodeId>& prereqs, bool order_only,
+                         long target_mtime, NodeSet& building,
+                         std::vector<ActionId>* deps) {
+  bool ok = true;
+  for (NodeId p : prereqs) {
+    // A missing intermediate file is left alone unless something it is
+    // made from is newer than the target that needs it.
+    if (!order_only && target_mtime != 0 && IsIntermediate(p) &&
+        GetFileMtime(FilePath(graph_.Name(p))) == 0 &&
+        !IntermediateOutOfDate(p, target_mtime)) {
+      continue;
+    }
+    ActionId dep;
+    if (PlanTarget(p, building, &dep)) {
+      deps->push_back(dep);
+    } else if (!order_only) {
+      // Order-only prerequisites don't stop the build.
+      ok = false;
+      if (!opts_->keep_going) break;
     }
   }
+  return ok;
+}
 
-  building.erase(target);
-  visited.insert(target);
+bool Engine::RunJob(const TargetJob& job) {
+  const std::string& target = graph_.Name(job.id);
 
-  // Check if we need to rebuild
+  // Check if we need to rebuild.  Each double-colon rule is checked against
+  // the target as it was before the build, and one without prerequisites
+  // always runs.  A grouped rule runs if any of its targets is out of date.
   bool need_rebuild = opts_->always_make;
-  if (!need_rebuild) {
-    need_rebuild = NeedsRebuild(target, expanded_prereqs);
+  if (!need_rebuild && job.double_colon) {
+    need_rebuild = job.planned_mtime == 0 || job.prereqs.empty();
+    for (const auto& p : job.prereqs) {
+      if (GetFileMtime(p) > job.planned_mtime) need_rebuild = true;
+    }
+  } else if (!need_rebuild) {
+    for (NodeId out : job.outputs) {
+      if (NeedsRebuild(FilePath(graph_.Name(out)), job.prereqs)) {
+        need_rebuild = true;
+      }
+    }
   }
 
   // If target is .PHONY, always rebuild
-  if (rules_.IsPhony(target)) {
-    need_rebuild = true;
+  for (NodeId out : job.outputs) {
+    if (rules_.IsPhony(graph_.Name(out))) need_rebuild = true;
   }
 
 #ifdef DEBUG_GORMAKE
-  fprintf(stderr, "[DEBUG] BuildTarget '%s' need_rebuild=%d is_phony=%d recipes=%zu\n",
-          target.c_str(), need_rebuild, rules_.IsPhony(target), rule->recipes.size());
+  fprintf(stderr, "[DEBUG] RunJob '%s' need_rebuild=%d is_phony=%d recipes=%zu\n",
+          target.c_str(), need_rebuild, rules_.IsPhony(target),
+          job.rule->recipes.size());
 #endif
 
   // If no rebuild needed, nothing to do
-  if (!need_rebuild) {
+  if (!need_rebuild || job.rule->recipes.empty()) {
     return true;
   }
 
-  if (rule->recipes.empty()) {
-    return true;  // Nothing to do
+  std::vector<NodeId> created;
+  for (NodeId out : job.outputs) {
+    if (GetFileMtime(graph_.Name(out)) == 0) created.push_back(out);
   }
-
-  // Execute the recipe
-  if (!rule->recipes.empty()) {
-    // Set automatic variables
-    vars_.PushAutomaticScope();
-
-    std::string prereq_str;
-    for (size_t i = 0; i < expanded_prereqs.size(); ++i) {
-      if (i > 0) prereq_str += " ";
-      prereq_str += expanded_prereqs[i];
+  bool success = ExecuteRecipe(job);
+
+  std::lock_guard<std::mutex> lock(mu_);
+  for (NodeId out : created) {
+    const std::string& name = graph_.Name(out);
+    if (success && !opts_->dry_run && IsIntermediate(out) &&
+        !rules_.IsSecondary(name) && !rules_.IsPrecious(name)) {
+      created_intermediates_.push_back(out);
     }
-    std::string first_prereq = expanded_prereqs.empty() ? "" : expanded_prereqs[0];
+  }
+  if (!success) {
+    fprintf(stderr, "gor_make: *** [%s] Error\n", target.c_str());
+    return opts_->ignore_errors;
+  }
+  return true;
+}
 
+bool Engine::ExecuteRecipe(const TargetJob& job) {
+  const std::string& target = graph_.Name(job.id);
+
+  // $^ names each prerequisite once; $+ keeps repeats, e.g. when an
+  // explicit rule lists a prerequisite the implicit rule already has.
+  std::string prereq_str;
+  std::string all_prereq_str;
+  std::unordered_set<std::string> seen;
+  for (const auto& p : job.prereqs) {
+    if (!all_prereq_str.empty()) all_prereq_str += " ";
+    all_prereq_str += p;
+    if (!seen.insert(p).second) continue;
+    if (!prereq_str.empty()) prereq_str += " ";
+    prereq_str += p;
+  }
+  std::string first_prereq = job.prereqs.empty() ? "" : job.prereqs[0];
+
+  // Expand every line up front; VariableDB is shared by all jobs.
+  std::vector<RecipeLine> commands;
+  std::string shell;
+  std::vector<std::string> shell_flags;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    vars_.PushAutomaticScope();
     vars_.SetAutomatic("@", target);
     vars_.SetAutomatic("<", first_prereq);
     vars_.SetAutomatic("^", prereq_str);
+    vars_.SetAutomatic("+", all_prereq_str);
     vars_.SetAutomatic("?", prereq_str);  // simplified
-    vars_.SetAutomatic("*", stem);
-
-    bool success = ExecuteRecipe(rule, target, stem);
-
-    vars_.PopAutomaticScope();
-
-    if (!success) {
-      fprintf(stderr, "gor_make: *** [%s] Error\n", target.c_str());
-      if (!opts_->ignore_errors && !opts_->keep_going) {
-        return false;
-      }
+    vars_.SetAutomatic("*", job.stem);
+    for (const auto& recipe : job.rule->recipes) {
+      RecipeLine cmd = recipe;
+      cmd.text = vars_.Expand(recipe.text, target, prereq_str, job.stem);
+      if (cmd.text.empty()) continue;
+      commands.push_back(std::move(cmd));
     }
+    shell = Strip(vars_.Expand("$(SHELL)"));
+    shell_flags = SplitWords(vars_.Expand("$(.SHELLFLAGS)"));
+    vars_.PopAutomaticScope();
   }
+  if (shell.empty()) shell = "/bin/sh";
 
-  return true;
+  if (oneshell_) {
+    return RunOneShell(commands, shell, shell_flags);
+  }
+  if (opts_->batch_recipes && !opts_->dry_run && commands.size() > 1) {
+    return RunBatched(commands, shell, shell_flags);
+  }
+  return RunLines(commands, shell, shell_flags);
 }
 
-bool Engine::ExecuteRecipe(const Rule* rule, const std::string& target,
-                            const std::string& stem) {
-  for (const auto& recipe : rule->recipes) {
-    std::string cmd = vars_.Expand(recipe.text, target, "", stem);
-
-    // Get automatic variable values for ^ and <
-    const Variable* v_less = vars_.Get("<");
-    const Variable* v_caret = vars_.Get("^");
-    std::string prereq_str = v_caret ? v_caret->value : "";
-    std::string first_prereq = v_less ? v_less->value : "";
-
-    // Re-expand with proper context
-    cmd = vars_.Expand(recipe.text, target, prereq_str, stem);
-
-    if (cmd.empty()) continue;
+bool Engine::RunLines(const std::vector<RecipeLine>& lines,
+                      const std::string& shell,
+                      const std::vector<std::string>& shell_flags) {
+  for (const auto& recipe : lines) {
+    const std::string& cmd = recipe.text;
 
     bool silent = recipe.silent || opts_->silent;
     bool ignore_error = recipe.ignore_error || opts_->ignore_errors;
 
     if (!silent || opts_->dry_run) {
+      std::lock_guard<std::mutex> lock(mu_);
       printf("%s\n", cmd.c_str());
       fflush(stdout);
     }
@@ -813,25 +1335,67 @@ bool Engine::ExecuteRecipe(const Rule* rule, const std::string& target,
       continue;
     }
 
-    // Execute via /bin/sh -c
-    std::string shell_cmd = vars_.Expand("$(SHELL)");
-    std::string shell_flags = vars_.Expand("$(.SHELLFLAGS)");
-
-    int status = system(cmd.c_str());
-    if (status == -1) {
-      if (!ignore_error) return false;
-    } else if (WIFEXITED(status)) {
-      int code = WEXITSTATUS(status);
-      if (code != 0) {
-        if (!ignore_error) return false;
-      }
-    } else if (WIFSIGNALED(status)) {
-      if (!ignore_error) return false;
+    if (!ShellSucceeded(RunShell(shell, shell_flags, cmd, envp_.data())) &&
+        !ignore_error) {
+      return false;
     }
   }
   return true;
 }
 
+bool Engine::RunOneShell(const std::vector<RecipeLine>& lines,
+                         const std::string& shell,
+                         const std::vector<std::string>& shell_flags) {
+  if (lines.empty()) return true;
+
+  // With .ONESHELL only the prefixes of the first line count; they apply
+  // to the whole recipe.
+  std::string script;
+  for (const auto& recipe : lines) {
+    if (!script.empty()) script += "\n";
+    script += recipe.text;
+  }
+  const RecipeLine& first = lines[0];
+  bool silent = first.silent || opts_->silent;
+  bool ignore_error = first.ignore_error || opts_->ignore_errors;
+
+  if (!silent || opts_->dry_run) {
+    std::lock_guard<std::mutex> lock(mu_);
+    printf("%s\n", script.c_str());
+    fflush(stdout);
+  }
+  if (opts_->dry_run && !first.always_run) {
+    return true;
+  }
+  return ShellSucceeded(RunShell(shell, shell_flags, script, envp_.data())) ||
+         ignore_error;
+}
+
+bool Engine::RunBatched(const std::vector<RecipeLine>& lines,
+                        const std::string& shell,
+                        const std::vector<std::string>& shell_flags) {
+  // One shell runs every line.  Each line still echoes itself unless it has
+  // @, and stops the script on failure unless it has -.  Shell state such
+  // as the working directory carries over between lines, which is why this
+  // mode is opt-in.
+  std::string script;
+  for (const auto& recipe : lines) {
+    bool silent = recipe.silent || opts_->silent;
+    bool ignore_error = recipe.ignore_error || opts_->ignore_errors;
+    if (!silent) {
+      script += "printf '%s\\n' " + ShellQuote(recipe.text) + "\n";
+    }
+    script += "{ " + recipe.text + "\n}";
+    script += ignore_error ? " || true\n" : " || exit $?\n";
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    fflush(stdout);
+  }
+  return ShellSucceeded(RunShell(shell, shell_flags, script, envp_.data()));
+}
+
 bool Engine::NeedsRebuild(const std::string& target,
                            const std::vector<std::string>& prereqs) const {
   long target_mtime = GetFileMtime(target);
@@ -848,6 +1412,11 @@ bool Engine::NeedsRebuild(const std::string& target,
   return false;
 }
 
+std::string Engine::FilePath(const std::string& name) {
+  if (vpath_.empty() || GetFileMtime(name) != 0) return name;
+  return vpath_.Resolve(name);
+}
+
 long Engine::GetFileMtime(const std::string& path) const {
   struct stat st;
   if (stat(path.c_str(), &st) != 0) return 0;
@@ -896,9 +1465,11 @@ void Engine::OutputJson() const {
   printf("  \"target_count\": %zu,\n", all_rules.size() + pattern_rules.size());
   printf("  \"targets\": [\n");
 
+  // Targets in order of first appearance, so the output is stable.
   bool first = true;
-  for (const auto& [target, rule_list] : all_rules) {
-    for (const auto* rule : rule_list) {
+  for (NodeId id = 0; id < graph_.FrozenCount(); ++id) {
+    const std::string& target = graph_.Name(id);
+    for (const auto* rule : graph_.Rules(id)) {
       if (!first) printf(",\n");
       first = false;
 
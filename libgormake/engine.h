@@ -18,12 +18,20 @@
 #define GORMAKE_LIBGORMAKE_ENGINE_H_
 
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "action_graph.h"
+#include "dep_graph.h"
+#include "makefile_reader.h"
 #include "var_db.h"
 #include "rule_db.h"
+#include "vpath.h"
 
 namespace gormake {
 
@@ -39,6 +47,8 @@ struct MakeOptions {
   bool always_make = false;              // -B: unconditionally rebuild
   bool print_dir = false;               // -w: print directory
   bool json_output = false;              // --json: output relationship JSON
+  bool no_builtin_rules = false;         // -r: no built-in implicit rules
+  bool batch_recipes = false;            // --batch-recipes: one shell per recipe
   int jobs = 1;                         // -j: parallel jobs (1=serial)
 };
 
@@ -57,6 +67,19 @@ class Engine {
   // Parse a makefile and populate vars_ and rules_.
   bool ParseMakefile(const std::string& path);
 
+  // Read and lex a makefile, from prefetcher_ while parsing.
+  std::unique_ptr<MakefileText> LoadMakefile(const std::string& path);
+
+  // Parse makefile text.  Used for $(eval) and lines that expand to rules.
+  void ParseText(const std::string& text);
+
+  // Evaluate lexed lines in order.  Conditional state carries over between
+  // calls.
+  void ParseLines(const std::vector<MakefileLine>& lines);
+
+  // Build the recipe environment (envp_) from the exported variables.
+  void BuildEnvironment();
+
   // Parse a single line from a makefile.
   // Returns true if the line was handled.
   bool ProcessLine(const std::string& line, int line_num);
@@ -69,25 +92,107 @@ class Engine {
   bool ProcessConditional(const std::string& directive,
                           const std::string& args);
 
-  // Build a target with dependency resolution.
-  // Returns true if target was built or is up-to-date.
-  bool BuildTarget(const std::string& target,
-                   std::unordered_set<std::string>& visited,
-                   std::unordered_set<std::string>& building);
+  // How a target is made: the rule whose recipe runs (explicit, or found
+  // by implicit rule search) and the full prerequisite lists.
+  struct ResolvedTarget {
+    Rule* rule = nullptr;
+    std::string stem;
+    std::vector<NodeId> prereqs;
+    std::vector<NodeId> order_only;
+  };
+
+  // Resolve the rule for a target.  Returns false if there is none.
+  bool ResolveTarget(NodeId id, ResolvedTarget* out);
+
+  // Search the pattern rules for a way to make |id|, chaining through
+  // intermediate files if needed.  Results are memoized per node unless
+  // the search was cut short by the depth limit or a cycle, in which case
+  // |*cut_off| is set.  Returns an index into implicit_matches_, or -1.
+  int FindImplicitRule(NodeId id, int depth, bool* cut_off);
+
+  // Substitute |stem| into the (order-only) prerequisites of a pattern
+  // rule matching |target| and intern them.  Only .SECONDEXPANSION rules
+  // expand them again.
+  void ExpandPatternPrereqs(const Rule& rule, bool order_only,
+                            const std::string& target,
+                            const std::string& stem,
+                            std::vector<NodeId>* out);
+
+  // True if a file is mentioned in the makefile or exists on disk.
+  bool OughtToExist(NodeId id);
+
+  // True for .INTERMEDIATE/.SECONDARY targets and for files that are only
+  // reachable through an implicit rule chain.
+  bool IsIntermediate(NodeId id) const;
+
+  // True if a missing intermediate must be made to bring a target with
+  // modification time |target_mtime| up to date.
+  bool IntermediateOutOfDate(NodeId id, long target_mtime);
+
+  // Remove intermediate files created during this run.
+  void DeleteIntermediates();
+
+  // Add the actions that bring |id| up to date to actions_, after those of
+  // its prerequisites.  Sets |*action| to the action that completes the
+  // target, or kNoAction if there is nothing to run (an existing file
+  // without a rule).  Returns false if the target cannot be made.
+  bool PlanTarget(NodeId id, NodeSet& building, ActionId* action);
+
+  // Plan a prerequisite list of a target with modification time
+  // |target_mtime|, appending the prerequisites' actions to |deps|.
+  bool PlanPrereqs(const std::vector<NodeId>& prereqs, bool order_only,
+                   long target_mtime, NodeSet& building,
+                   std::vector<ActionId>* deps);
+
+  // Record the planned action of a node.
+  void SetPlanned(NodeId id, ActionId action);
 
-  // Execute the recipe for a rule.
-  bool ExecuteRecipe(const Rule* rule, const std::string& target,
-                      const std::string& stem);
+  // One schedulable unit of work: the recipe of a target, or of one of the
+  // double-colon rules of a target.
+  struct TargetJob {
+    NodeId id = 0;                     // the target that is $@
+    std::vector<NodeId> outputs;       // every target the recipe makes
+    const Rule* rule = nullptr;
+    std::string stem;
+    std::vector<std::string> prereqs;  // for $^ and timestamp checks
+    bool double_colon = false;
+    long planned_mtime = 0;            // target mtime when planned
+  };
+
+  // Run a job's recipe if the target is out of date.  Called from
+  // ActionGraph workers.
+  bool RunJob(const TargetJob& job);
+
+  // Expand and execute the recipe of a job.
+  bool ExecuteRecipe(const TargetJob& job);
+
+  // Run expanded recipe lines through |shell|: one shell per line, one for
+  // the whole recipe (.ONESHELL), or a batch script that keeps per-line
+  // echo and error semantics (--batch-recipes).
+  bool RunLines(const std::vector<RecipeLine>& lines, const std::string& shell,
+                const std::vector<std::string>& shell_flags);
+  bool RunOneShell(const std::vector<RecipeLine>& lines,
+                   const std::string& shell,
+                   const std::vector<std::string>& shell_flags);
+  bool RunBatched(const std::vector<RecipeLine>& lines,
+                  const std::string& shell,
+                  const std::vector<std::string>& shell_flags);
 
   // Check if target needs rebuilding based on timestamps.
   bool NeedsRebuild(const std::string& target,
                     const std::vector<std::string>& prereqs) const;
 
+  // Where the file |name| is: |name| itself if it exists, otherwise the
+  // path found by vpath/VPATH search (or |name| if none).
+  std::string FilePath(const std::string& name);
+
   // Get file modification time. Returns 0 if file doesn't exist.
   long GetFileMtime(const std::string& path) const;
 
   VariableDB vars_;
   RuleDB rules_;
+  DepGraph graph_;  // frozen after parsing
+  VpathSearch vpath_;
   std::vector<MakeOptions> opts_stack_;  // for nested make calls
   const MakeOptions* opts_ = nullptr;
 
@@ -102,8 +207,53 @@ class Engine {
   // Track targets currently being built (cycle detection)
   std::unordered_set<std::string> building_;
 
+  // Build plan: one action per target (per rule for double-colon targets).
+  ActionGraph actions_;
+  std::vector<ActionId> planned_;  // per NodeId
+  NodeSet plan_failed_;
+
+  // Actions of grouped rules, keyed by rule and pattern stem.
+  std::map<std::pair<const Rule*, std::string>, ActionId> group_actions_;
+
+  // Serializes VariableDB access, stdout and created_intermediates_ while
+  // jobs run in parallel.
+  std::mutex mu_;
   // Current default goal
   std::string default_goal_;
+
+  // .ONESHELL was given.
+  bool oneshell_ = false;
+
+  // .SECONDEXPANSION was given; applies to rules read after it.
+  bool second_expansion_ = false;
+
+  // Reads included makefiles ahead; only set while parsing.
+  std::unique_ptr<MakefilePrefetcher> prefetcher_;
+
+  // Nesting of ParseLines() calls ($(eval) inside $(eval), ...).
+  int parse_depth_ = 0;
+
+  // Set once graph_ is built; $(eval) may no longer add rules.
+  bool frozen_ = false;
+
+  // Environment for recipes, built once after parsing.  envp_ points into
+  // env_strings_ and is null-terminated.
+  std::vector<std::string> env_strings_;
+  std::vector<char*> envp_;
+
+  // Implicit rule search state.
+  struct ImplicitMatch {
+    Rule* rule = nullptr;
+    std::string stem;
+    std::vector<NodeId> prereqs;
+    std::vector<NodeId> order_only;
+  };
+  std::vector<ImplicitMatch> implicit_matches_;
+  std::unordered_map<NodeId, int> implicit_memo_[2];  // [depth > 0]
+  NodeSet implicit_searching_;
+  NodeSet chained_;  // made only via implicit rule chains
+  NodeSet goals_;
+  std::vector<NodeId> created_intermediates_;
 };
 
 }  // namespace gormake
@@ -16,6 +16,8 @@
 
 #include "gn_scanner.h"
 #include "build_engine_base.h"
+#include "dir_walker.h"
+#include "thread_pool.h"
 
 #include <algorithm>
 #include <cctype>
@@ -30,8 +32,6 @@
 
 namespace gormake {
 
-namespace fs = std::filesystem;
-
 // ---------------------------------------------------------------------------
 // Helper functions
 // ---------------------------------------------------------------------------
@@ -124,7 +124,9 @@ static bool IsTargetType(const std::string& name) {
 // GnScanner public methods
 // ---------------------------------------------------------------------------
 
-GnScanner::GnScanner() : in_target_(false), brace_depth_(0) {}
+GnScanner::GnScanner()
+    : in_target_(false), brace_depth_(0),
+      import_cache_(std::make_shared<GnImportCache>()) {}
 
 GnScanner::~GnScanner() {}
 
@@ -134,6 +136,8 @@ bool GnScanner::ScanFile(const std::string& path) {
     return false;
   }
 
+  if (root_dir_.empty()) root_dir_ = buildutil::DirName(path);
+  if (global_scope_ == nullptr && importing_.empty()) LoadGlobalScope();
   current_.path = path;
   current_.src_dir = buildutil::DirName(path);
 
@@ -175,25 +179,35 @@ bool GnScanner::ScanFile(const std::string& path) {
 }
 
 void GnScanner::ScanDirectory(const std::string& dir_path) {
-  std::error_code ec;
-  for (auto& entry : fs::recursive_directory_iterator(dir_path, ec)) {
-    if (ec) continue;
-    if (entry.path().filename() == "BUILD.gn") {
-      std::string entry_str = entry.path().string();
-      // Skip common output/build directories.
-      if (entry_str.find("/out/") != std::string::npos) continue;
-      if (entry_str.find("/bazel-") != std::string::npos) continue;
-      if (entry_str.find("/.git/") != std::string::npos) continue;
-      try {
-        ScanFile(entry_str);
-      } catch (const std::exception& e) {
-        std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
-                     entry_str.c_str(), e.what());
-      } catch (...) {
-        std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
-                     entry_str.c_str());
-      }
+  if (root_dir_.empty()) root_dir_ = dir_path;
+  if (global_scope_ == nullptr) LoadGlobalScope();
+
+  DirWalker walker({"BUILD.gn"});
+  std::vector<std::string> files = walker.FindFiles(dir_path, jobs_);
+
+  // A scanner per file, so that no variable or half-read target leaks
+  // from one BUILD.gn into the next.  They share the global scope and the
+  // evaluated imports.
+  std::vector<std::vector<GnTarget>> results(files.size());
+  ParallelFor(files.size(), jobs_, [&](size_t i) {
+    GnScanner scanner;
+    scanner.root_dir_ = root_dir_;
+    scanner.global_scope_ = global_scope_;
+    scanner.import_cache_ = import_cache_;
+    try {
+      scanner.ScanFile(files[i]);
+    } catch (const std::exception& e) {
+      std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
+                   files[i].c_str(), e.what());
+    } catch (...) {
+      std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
+                   files[i].c_str());
     }
+    results[i] = std::move(scanner.targets_);
+  });
+
+  for (auto& targets : results) {
+    for (auto& t : targets) AddTarget(std::move(t));
   }
 }
 
@@ -350,9 +364,9 @@ std::string GnScanner::ExpandVars(const std::string& s) const {
         size_t close = s.find('}', i + 2);
         if (close != std::string::npos) {
           std::string var_name = s.substr(i + 2, close - i - 2);
-          auto it = variables_.find(var_name);
-          if (it != variables_.end()) {
-            result += it->second;
+          const std::string* value = FindVar(var_name);
+          if (value != nullptr) {
+            result += *value;
           }
           i = close;
           continue;
@@ -361,9 +375,9 @@ std::string GnScanner::ExpandVars(const std::string& s) const {
         size_t j = i + 1;
         while (j < s.size() && IsIdentChar(s[j])) j++;
         std::string var_name = s.substr(i + 1, j - i - 1);
-        auto it = variables_.find(var_name);
-        if (it != variables_.end()) {
-          result += it->second;
+        const std::string* value = FindVar(var_name);
+        if (value != nullptr) {
+          result += *value;
         }
         i = j - 1;
         continue;
@@ -384,19 +398,19 @@ std::vector<std::string> GnScanner::ResolveValue(const std::string& s) const {
 
   // If it's a bare identifier that is a known list variable, return that list.
   {
-    auto it = list_variables_.find(trimmed);
-    if (it != list_variables_.end()) {
-      return it->second;
+    const std::vector<std::string>* list = FindListVar(trimmed);
+    if (list != nullptr) {
+      return *list;
     }
   }
 
   // If it's a bare identifier that is a known scalar variable, return
   // it as a single-element list.
   {
-    auto it = variables_.find(trimmed);
-    if (it != variables_.end() && !it->second.empty()) {
+    const std::string* value = FindVar(trimmed);
+    if (value != nullptr && !value->empty()) {
       // If the variable's value looks like a list, try to parse it.
-      std::string val = Trim(it->second);
+      std::string val = Trim(*value);
       if (!val.empty() && val.front() == '[') {
         return ParseList(val);
       }
@@ -408,6 +422,134 @@ std::vector<std::string> GnScanner::ResolveValue(const std::string& s) const {
   return ParseList(trimmed);
 }
 
+// ---------------------------------------------------------------------------
+// Scopes and imports
+// ---------------------------------------------------------------------------
+
+const std::string* GnScope::FindVar(const std::string& name) const {
+  auto it = variables.find(name);
+  if (it != variables.end()) return &it->second;
+  for (auto i = imports.rbegin(); i != imports.rend(); ++i) {
+    const std::string* value = (*i)->FindVar(name);
+    if (value != nullptr) return value;
+  }
+  return nullptr;
+}
+
+const std::vector<std::string>* GnScope::FindListVar(
+    const std::string& name) const {
+  auto it = list_variables.find(name);
+  if (it != list_variables.end()) return &it->second;
+  for (auto i = imports.rbegin(); i != imports.rend(); ++i) {
+    const std::vector<std::string>* list = (*i)->FindListVar(name);
+    if (list != nullptr) return list;
+  }
+  return nullptr;
+}
+
+const std::string* GnScanner::FindVar(const std::string& name) const {
+  auto it = variables_.find(name);
+  if (it != variables_.end()) return &it->second;
+  for (auto i = imports_.rbegin(); i != imports_.rend(); ++i) {
+    const std::string* value = (*i)->FindVar(name);
+    if (value != nullptr) return value;
+  }
+  return global_scope_ != nullptr ? global_scope_->FindVar(name) : nullptr;
+}
+
+const std::vector<std::string>* GnScanner::FindListVar(
+    const std::string& name) const {
+  auto it = list_variables_.find(name);
+  if (it != list_variables_.end()) return &it->second;
+  for (auto i = imports_.rbegin(); i != imports_.rend(); ++i) {
+    const std::vector<std::string>* list = (*i)->FindListVar(name);
+    if (list != nullptr) return list;
+  }
+  return global_scope_ != nullptr ? global_scope_->FindListVar(name)
+                                  : nullptr;
+}
+
+void GnScanner::LoadGlobalScope() {
+  auto global = std::make_shared<GnScope>();
+  struct stat st;
+  std::string dot_gn = root_dir_ + "/.gn";
+  if (stat(dot_gn.c_str(), &st) == 0) {
+    std::shared_ptr<const GnScope> scope = ImportFile(dot_gn);
+    const std::string* buildconfig =
+        scope != nullptr ? scope->FindVar("buildconfig") : nullptr;
+    if (buildconfig != nullptr) {
+      std::string path = Trim(*buildconfig);
+      if (path.size() >= 2 && path.front() == '"' && path.back() == '"') {
+        path = path.substr(1, path.size() - 2);
+      }
+      if (path.substr(0, 2) == "//") path = root_dir_ + "/" + path.substr(2);
+      if (stat(path.c_str(), &st) == 0) {
+        std::shared_ptr<const GnScope> config = ImportFile(path);
+        if (config != nullptr) global->imports.push_back(config);
+      }
+    }
+  }
+  // Build arguments override the defaults of BUILDCONFIG.
+  std::string args_gn = root_dir_ + "/args.gn";
+  if (stat(args_gn.c_str(), &st) == 0) {
+    std::shared_ptr<const GnScope> args = ImportFile(args_gn);
+    if (args != nullptr) global->imports.push_back(args);
+  }
+  global_scope_ = global;
+}
+
+std::shared_ptr<const GnScope> GnScanner::ImportFile(const std::string& path) {
+  std::error_code ec;
+  std::string key = std::filesystem::weakly_canonical(path, ec).string();
+  if (ec) key = path;
+
+  {
+    std::lock_guard<std::mutex> lock(import_cache_->mu);
+    auto it = import_cache_->scopes.find(key);
+    if (it != import_cache_->scopes.end()) return it->second;
+  }
+  if (importing_.count(key) > 0) {
+    std::fprintf(stderr, "gor_make: [warning] import cycle at %s\n",
+                 path.c_str());
+    return nullptr;
+  }
+  importing_.insert(key);
+
+  // Evaluate the file on its own, as if it were the only one, keeping the
+  // importer's state aside.
+  GnTarget saved_current = std::move(current_);
+  bool saved_in_target = in_target_;
+  int saved_brace_depth = brace_depth_;
+  auto saved_variables = std::move(variables_);
+  auto saved_list_variables = std::move(list_variables_);
+  auto saved_imports = std::move(imports_);
+  current_ = GnTarget();
+  in_target_ = false;
+  brace_depth_ = 0;
+  variables_.clear();
+  list_variables_.clear();
+  imports_.clear();
+
+  ScanFile(path);
+
+  auto scope = std::make_shared<GnScope>();
+  scope->variables = std::move(variables_);
+  scope->list_variables = std::move(list_variables_);
+  scope->imports = std::move(imports_);
+
+  current_ = std::move(saved_current);
+  in_target_ = saved_in_target;
+  brace_depth_ = saved_brace_depth;
+  variables_ = std::move(saved_variables);
+  list_variables_ = std::move(saved_list_variables);
+  imports_ = std::move(saved_imports);
+
+  importing_.erase(key);
+  // Another thread may have evaluated the file meanwhile; keep one scope.
+  std::lock_guard<std::mutex> lock(import_cache_->mu);
+  return import_cache_->scopes.emplace(key, scope).first->second;
+}
+
 // ---------------------------------------------------------------------------
 // Property assignment
 // ---------------------------------------------------------------------------
@@ -578,7 +720,7 @@ void GnScanner::ProcessLine(const std::string& raw_line) {
             }
             // Flush the target.
             if (!current_.name.empty()) {
-              targets_.push_back(current_);
+              AddTarget(current_);
             }
             // Preserve path/src_dir for the next target in the same file.
             std::string saved_path = current_.path;
@@ -641,7 +783,11 @@ void GnScanner::ProcessLine(const std::string& raw_line) {
         if (it != list_variables_.end()) {
           it->second.insert(it->second.end(), values.begin(), values.end());
         } else {
-          list_variables_[prop_name] = values;
+          // Append to what an import defined, if anything.
+          const std::vector<std::string>* inherited = FindListVar(prop_name);
+          std::vector<std::string>& list = list_variables_[prop_name];
+          if (inherited != nullptr) list = *inherited;
+          list.insert(list.end(), values.begin(), values.end());
         }
       } else {
         list_variables_[prop_name] = values;
@@ -697,7 +843,11 @@ void GnScanner::ProcessLine(const std::string& raw_line) {
         if (it != list_variables_.end()) {
           it->second.insert(it->second.end(), values.begin(), values.end());
         } else {
-          list_variables_[var_name] = values;
+          // Append to what an import defined, if anything.
+          const std::vector<std::string>* inherited = FindListVar(var_name);
+          std::vector<std::string>& list = list_variables_[var_name];
+          if (inherited != nullptr) list = *inherited;
+          list.insert(list.end(), values.begin(), values.end());
         }
       } else {
         list_variables_[var_name] = values;
@@ -712,6 +862,10 @@ void GnScanner::ProcessLine(const std::string& raw_line) {
     } else {
       // Scalar variable.
       if (is_append) {
+        if (variables_.count(var_name) == 0) {
+          const std::string* inherited = FindVar(var_name);
+          if (inherited != nullptr) variables_[var_name] = *inherited;
+        }
         variables_[var_name] += " " + expanded;
       } else {
         variables_[var_name] = expanded;
@@ -734,22 +888,27 @@ void GnScanner::ProcessLine(const std::string& raw_line) {
       }
       // Resolve //path to filesystem path
       std::string import_path;
+      struct stat st;
       if (arg.substr(0, 2) == "//") {
-        // Try relative to root_dir_ if set, otherwise current src_dir
-        // Walk up to find the source root
-        import_path = current_.src_dir + "/../" + arg.substr(2);
+        // Relative to the source root; failing that, the parent of the
+        // current directory.
+        import_path = root_dir_ + "/" + arg.substr(2);
+        if (stat(import_path.c_str(), &st) != 0) {
+          import_path = current_.src_dir + "/../" + arg.substr(2);
+        }
       } else if (arg[0] == '/') {
         import_path = arg;
       } else {
         import_path = current_.src_dir + "/" + arg;
       }
       // Check if file exists
-      struct stat st;
       if (stat(import_path.c_str(), &st) == 0) {
-        // Avoid re-importing the same file
-        if (visited_files_.find(import_path) == visited_files_.end()) {
-          visited_files_.insert(import_path);
-          ScanFile(import_path);
+        std::shared_ptr<const GnScope> scope = ImportFile(import_path);
+        // Importing a file twice into the same scope changes nothing.
+        if (scope != nullptr &&
+            std::find(imports_.begin(), imports_.end(), scope) ==
+                imports_.end()) {
+          imports_.push_back(scope);
         }
       }
     }
@@ -859,17 +1018,17 @@ bool GnScanner::ExecuteCmd(const std::string& cmd) {
 
 bool GnScanner::CompileSource(const GnTarget& target, const std::string& src,
                                const std::string& obj_file) {
-  if (!NeedsRecompile(obj_file, src)) {
-    std::printf("  [skip] %s (up-to-date)\n", src.c_str());
-    return true;
-  }
-
   std::string src_path = src;
   if (src_path[0] != '/') {
     std::string dir = target.src_dir.empty() ? "." : target.src_dir;
     src_path = dir + "/" + src_path;
   }
 
+  if (!NeedsRecompile(obj_file, src_path)) {
+    std::printf("  [skip] %s (up-to-date)\n", src.c_str());
+    return true;
+  }
+
   std::string compiler = buildutil::GetCompiler(src);
   std::string cmd = compiler + " -MMD -MP -c -o " + obj_file + " " + src_path;
 
@@ -900,6 +1059,20 @@ bool GnScanner::LinkTarget(const GnTarget& target) {
     obj_files += " " + GetObjectPath(target, src);
   }
 
+  // Objects of source_set deps go into the archive or link, as with gn;
+  // an executable also links the libraries of its deps.
+  std::string dep_libs;
+  for (size_t d : TargetDeps(target)) {
+    const GnTarget& t = targets_[d];
+    if (t.type == "source_set") {
+      for (const auto& src : t.srcs) obj_files += " " + GetObjectPath(t, src);
+    } else if (target.type == "executable") {
+      std::string path = GetOutputPath(t);
+      if (t.type == "static_library") dep_libs += " " + path + ".a";
+      else if (t.type == "shared_library") dep_libs += " " + path + ".so";
+    }
+  }
+
   if (target.type == "static_library") {
     std::string cmd = "ar rcs " + output_path + ".a" + obj_files;
     return ExecuteCmd(cmd);
@@ -916,69 +1089,145 @@ bool GnScanner::LinkTarget(const GnTarget& target) {
     for (const auto& f : target.ldflags) cmd += " " + f;
 
     // Link deps (static/shared libraries built by us)
-    for (const auto& dep : target.deps) {
-      std::string dep_name = dep;
-      if (!dep_name.empty() && dep_name[0] == ':') dep_name = dep_name.substr(1);
-      for (const auto& t : targets_) {
-        if (t.name == dep_name) {
-          std::string path = GetOutputPath(t);
-          if (t.type == "static_library") cmd += " " + path + ".a";
-          else if (t.type == "shared_library") cmd += " " + path + ".so";
-          break;
-        }
-      }
-    }
+    cmd += dep_libs;
     return ExecuteCmd(cmd);
   }
 
   return true;
 }
 
-bool GnScanner::BuildTarget(const GnTarget& target) {
-  if (target.type == "config" || target.type == "group" ||
-      target.type == "action" || target.type == "action_foreach" ||
-      target.type == "template") {
-    return true;
+std::string GnScanner::Label(const GnTarget& target) const {
+  std::string dir = target.src_dir;
+  if (dir.compare(0, root_dir_.size(), root_dir_) == 0 &&
+      (dir.size() == root_dir_.size() || dir[root_dir_.size()] == '/' ||
+       root_dir_.back() == '/')) {
+    dir = dir.substr(root_dir_.size());
+  }
+  while (!dir.empty() && dir[0] == '/') dir = dir.substr(1);
+  return "//" + dir + ":" + target.name;
+}
+
+std::string GnScanner::ResolveLabel(const GnTarget& from,
+                                    const std::string& dep) const {
+  std::string label = dep.substr(0, dep.find('('));
+  if (label.empty()) return label;
+  if (label[0] == ':') {
+    std::string own = Label(from);
+    return own.substr(0, own.rfind(':')) + label;
+  }
+  if (label.compare(0, 2, "//") != 0) {
+    // Relative to the directory of |from|.
+    std::string own = Label(from);
+    std::string dir = own.substr(0, own.rfind(':'));
+    label = (dir == "//" ? dir : dir + "/") + label;
+  }
+  if (label.find(':') == std::string::npos) {
+    // "//base" means "//base:base".
+    label += ":" + label.substr(label.rfind('/') + 1);
   }
-  if (target.srcs.empty()) {
+  return label;
+}
+
+void GnScanner::AddTarget(GnTarget target) {
+  target_index_.emplace(Label(target), targets_.size());
+  targets_.push_back(std::move(target));
+}
+
+int GnScanner::FindTarget(const std::string& label) const {
+  auto it = target_index_.find(label);
+  return it != target_index_.end() ? static_cast<int>(it->second) : -1;
+}
+
+std::vector<size_t> GnScanner::TargetDeps(const GnTarget& target) const {
+  std::vector<size_t> result;
+  for (const auto* deps : {&target.deps, &target.public_deps}) {
+    for (const auto& dep : *deps) {
+      int index = FindTarget(ResolveLabel(target, dep));
+      if (index >= 0 &&
+          std::find(result.begin(), result.end(), index) == result.end()) {
+        result.push_back(index);
+      }
+    }
+  }
+  return result;
+}
+
+bool GnScanner::PlanTarget(size_t index, ActionGraph* graph,
+                           std::vector<int>* state,
+                           std::vector<ActionId>* done) {
+  if ((*state)[index] == 2) return true;
+  const GnTarget& target = targets_[index];
+  if ((*state)[index] == 1) {
+    std::fprintf(stderr, "gor_make: *** Dependency cycle involving %s\n",
+                 Label(target).c_str());
+    return false;
+  }
+  (*state)[index] = 1;
+
+  std::vector<size_t> deps = TargetDeps(target);
+  for (size_t d : deps) {
+    if (!PlanTarget(d, graph, state, done)) return false;
+  }
+  (*state)[index] = 2;
+
+  // Targets without a build step still order their dependents after
+  // their own deps (e.g. a group).
+  bool buildable = target.type == "executable" ||
+                   target.type == "static_library" ||
+                   target.type == "shared_library" ||
+                   target.type == "source_set";
+  if (buildable && target.srcs.empty()) {
     std::printf("  [skip] %s (%s) — no sources\n",
                 target.name.c_str(), target.type.c_str());
+  }
+  if (!buildable || target.srcs.empty()) {
+    (*done)[index] = graph->AddAction([]() { return true; });
+    for (size_t d : deps) graph->AddDep((*done)[index], (*done)[d]);
     return true;
   }
 
   std::printf("Building: %s (%s)\n", target.name.c_str(), target.type.c_str());
 
-  for (const auto& src : target.srcs) {
-    std::string obj_file = GetObjectPath(target, src);
-    if (!CompileSource(target, src, obj_file)) {
-      std::fprintf(stderr, "gor_make: *** [%s] Error compiling %s\n",
-                   target.name.c_str(), src.c_str());
+  // Object directories are made here, not by concurrent compiles.
+  std::string obj_dir = buildutil::DirName(GetObjectPath(target, "x"));
+  if (!dry_run_) buildutil::MkdirP(obj_dir);
+
+  ActionId link = graph->AddAction([this, &target]() {
+    if (!LinkTarget(target)) {
+      std::fprintf(stderr, "gor_make: *** [%s] Error linking\n",
+                   target.name.c_str());
       return false;
     }
+    return true;
+  });
+  for (const auto& src : target.srcs) {
+    ActionId compile = graph->AddAction([this, &target, src]() {
+      if (!CompileSource(target, src, GetObjectPath(target, src))) {
+        std::fprintf(stderr, "gor_make: *** [%s] Error compiling %s\n",
+                     target.name.c_str(), src.c_str());
+        return false;
+      }
+      return true;
+    });
+    graph->AddDep(link, compile);
   }
-
-  if (!LinkTarget(target)) {
-    std::fprintf(stderr, "gor_make: *** [%s] Error linking\n",
-                 target.name.c_str());
-    return false;
-  }
+  // Compiles need nothing built: headers are sources.  The link needs the
+  // libraries and objects of its deps.
+  for (size_t d : deps) graph->AddDep(link, (*done)[d]);
+  (*done)[index] = link;
   return true;
 }
 
 int GnScanner::BuildAll() {
   std::printf("Building %zu targets...\n", targets_.size());
 
-  // Build static/shared libraries first, then executables
-  for (const auto& t : targets_) {
-    if (t.type == "static_library" || t.type == "shared_library") {
-      if (!BuildTarget(t)) return 1;
-    }
-  }
-  for (const auto& t : targets_) {
-    if (t.type == "executable" || t.type == "source_set") {
-      if (!BuildTarget(t)) return 1;
-    }
+  ActionGraph graph;
+  std::vector<int> state(targets_.size(), 0);
+  std::vector<ActionId> done(targets_.size(), kNoAction);
+  for (size_t i = 0; i < targets_.size(); ++i) {
+    if (!PlanTarget(i, &graph, &state, &done)) return 1;
   }
+  if (!graph.Run(jobs_, false)) return 1;
 
   std::printf("Build complete.\n");
   return 0;
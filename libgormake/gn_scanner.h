@@ -18,10 +18,15 @@
 #define GORMAKE_LIBGORMAKE_GN_SCANNER_H_
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "action_graph.h"
+
 namespace gormake {
 
 // Represents a single GN target parsed from a BUILD.gn file.
@@ -44,6 +49,25 @@ struct GnTarget {
   std::string path;
 };
 
+// The variables a .gni file defines, evaluated once and shared by every
+// file that imports it.  Variables of the files it imports in turn are
+// reached through |imports|, latest first.
+struct GnScope {
+  std::map<std::string, std::string> variables;
+  std::map<std::string, std::vector<std::string>> list_variables;
+  std::vector<std::shared_ptr<const GnScope>> imports;
+
+  const std::string* FindVar(const std::string& name) const;
+  const std::vector<std::string>* FindListVar(const std::string& name) const;
+};
+
+// Evaluated .gni files by canonical path, shared by the scanners of all
+// BUILD.gn files of a tree.
+struct GnImportCache {
+  std::mutex mu;
+  std::map<std::string, std::shared_ptr<const GnScope>> scopes;
+};
+
 // Scans GN (BUILD.gn) build files and extracts target information.
 //
 // Supported GN syntax features:
@@ -58,6 +82,8 @@ struct GnTarget {
 //   - Block scope: target_type("name") { ... }
 //   - Line continuations (backslash at end of line)
 //   - Nested braces tracked by depth
+//   - import("//x.gni"): each .gni is evaluated once, in a scope of its
+//     own, and its variables are visible to every file importing it
 class GnScanner {
  public:
   GnScanner();
@@ -67,7 +93,9 @@ class GnScanner {
   bool ScanFile(const std::string& path);
 
   // Recursively scans a directory tree for BUILD.gn files.
-  // Skips directories matching /out/, /bazel-*, /.git/.
+  // Skips directories matching /out/, /bazel-*, /.git/.  Each file is
+  // evaluated on up to SetJobs() threads in a scope of its own, seeded
+  // only from the global scope; targets are added in path order.
   void ScanDirectory(const std::string& dir_path);
 
   // Returns all targets collected from scanning.
@@ -79,7 +107,9 @@ class GnScanner {
   void SetDryRun(bool v) { dry_run_ = v; }
   void SetJobs(int j) { jobs_ = j; }
 
-  // Build all targets. Returns 0 on success.
+  // Build all targets, each after the targets in its deps and
+  // public_deps, running up to SetJobs() compiles and links at once.
+  // Returns 0 on success.
   int BuildAll();
 
  private:
@@ -96,6 +126,20 @@ class GnScanner {
   // Supports both bare-name references and $name / ${name} forms.
   std::string ExpandVars(const std::string& s) const;
 
+  // Evaluate the files GN reads before any BUILD.gn into global_scope_:
+  // the root .gn, the BUILDCONFIG file it names, and args.gn.
+  void LoadGlobalScope();
+
+  // Look up a variable in this file, then in the files it imported, then
+  // in the global scope.
+  const std::string* FindVar(const std::string& name) const;
+  const std::vector<std::string>* FindListVar(const std::string& name) const;
+
+  // Evaluate the .gni file at |path| in a scope of its own, or return the
+  // scope from an earlier import of the same file.  nullptr on an import
+  // cycle.
+  std::shared_ptr<const GnScope> ImportFile(const std::string& path);
+
   // Resolves a possibly-bare variable reference to a list of strings.
   // If the name is a known list variable, returns its value.
   // Otherwise returns s split as a fallback.
@@ -106,7 +150,30 @@ class GnScanner {
                       const std::vector<std::string>& values, bool append);
 
   // --- Build engine methods ---
-  bool BuildTarget(const GnTarget& target);
+
+  // Fully qualified label of a target: "//dir:name", with dir relative to
+  // the directory scanning started from.
+  std::string Label(const GnTarget& target) const;
+
+  // Qualify a dependency written in |from|: ":name", "//dir:name", "//dir"
+  // or "dir:name".  A toolchain suffix "(...)" is dropped.
+  std::string ResolveLabel(const GnTarget& from, const std::string& dep) const;
+
+  // Append a target to targets_ and index it by label.
+  void AddTarget(GnTarget target);
+
+  // Index in targets_ of the target with a fully qualified |label|, or -1.
+  int FindTarget(const std::string& label) const;
+
+  // Indices of the scanned targets in deps and public_deps; others (e.g.
+  // from a toolchain) are ignored.
+  std::vector<size_t> TargetDeps(const GnTarget& target) const;
+
+  // Add the compile and link actions of targets_[index] to |graph| after
+  // those of its dependencies.  |state| is 0 (new), 1 (planning) or 2
+  // (planned) per target; |done| receives each target's last action.
+  bool PlanTarget(size_t index, ActionGraph* graph, std::vector<int>* state,
+                  std::vector<ActionId>* done);
   bool CompileSource(const GnTarget& target, const std::string& src,
                      const std::string& obj_file);
   bool LinkTarget(const GnTarget& target);
@@ -118,6 +185,9 @@ class GnScanner {
                       const std::string& src_file) const;
 
   std::vector<GnTarget> targets_;
+  // Fully qualified label -> index in targets_.  The first target of a
+  // label wins.
+  std::unordered_map<std::string, size_t> target_index_;
   // Top-level (and target-local) variables: name -> string value.
   std::map<std::string, std::string> variables_;
   // List-typed variables: name -> list of strings.
@@ -128,8 +198,15 @@ class GnScanner {
   bool in_target_;
   int brace_depth_;  // Nesting depth inside the current target block.
 
-  // For import() tracking
-  std::unordered_set<std::string> visited_files_;
+  // Scopes imported by the file being scanned, in import order.
+  std::vector<std::shared_ptr<const GnScope>> imports_;
+  // Read-only variables every file sees (see LoadGlobalScope()).
+  std::shared_ptr<const GnScope> global_scope_;
+  // Evaluated .gni files, and those this scanner is evaluating.
+  std::shared_ptr<GnImportCache> import_cache_;
+  std::unordered_set<std::string> importing_;
+  // Directory "//" stands for: the first file's or directory's.
+  std::string root_dir_;
   bool dry_run_ = false;
   int jobs_ = 1;
 };
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "makefile_reader.h"
+
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+
+namespace gormake {
+
+static bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// True if |s| starts with directive |d| followed by whitespace or the end.
+static bool StartsWithWord(const std::string& s, size_t pos, const char* d) {
+  size_t n = 0;
+  while (d[n] != '\0') {
+    if (pos + n >= s.size() || s[pos + n] != d[n]) return false;
+    n++;
+  }
+  return pos + n == s.size() || IsSpace(s[pos + n]);
+}
+
+static void StatFile(const std::string& path, long* mtime, long* size) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0) {
+    *mtime = static_cast<long>(st.st_mtime);
+    *size = static_cast<long>(st.st_size);
+  } else {
+    *mtime = 0;
+    *size = -1;
+  }
+}
+
+static void AddLine(const std::string& text, MakefileText* out) {
+  MakefileLine line;
+  line.text = text;
+  size_t i = 0;
+  while (i < text.size() && IsSpace(text[i])) i++;
+  if (!text.empty() && text[0] == '\t') {
+    line.kind = MakefileLineKind::RECIPE;
+  } else if (i == text.size()) {
+    line.kind = MakefileLineKind::BLANK;
+  } else if (text[i] == '#') {
+    line.kind = MakefileLineKind::COMMENT;
+  } else if (StartsWithWord(text, i, "include") ||
+             StartsWithWord(text, i, "-include") ||
+             StartsWithWord(text, i, "sinclude")) {
+    line.kind = MakefileLineKind::INCLUDE;
+    // Remember names that need no expansion (and are not globs).  A bare
+    // "include" has no arguments and names nothing.
+    size_t args = text.find_first_of(" \t\r", i);
+    if (args == std::string::npos) args = text.size();
+    size_t end = text.find('#', args);
+    std::string rest = text.substr(args, end == std::string::npos ?
+                                         std::string::npos : end - args);
+    if (rest.find_first_of("$*?[") == std::string::npos) {
+      size_t p = 0;
+      while (p < rest.size()) {
+        while (p < rest.size() && IsSpace(rest[p])) p++;
+        size_t start = p;
+        while (p < rest.size() && !IsSpace(rest[p])) p++;
+        if (p > start) {
+          out->literal_includes.push_back(rest.substr(start, p - start));
+        }
+      }
+    }
+  } else {
+    line.kind = MakefileLineKind::OTHER;
+  }
+  out->lines.push_back(std::move(line));
+}
+
+void LexMakefile(const std::string& content, MakefileText* out) {
+  std::string line;
+  for (size_t i = 0; i < content.size(); ++i) {
+    char c = content[i];
+    if (c == '\\' && i + 1 < content.size() &&
+        (content[i+1] == '\n' ||
+         (content[i+1] == '\r' && i + 2 < content.size() &&
+          content[i+2] == '\n'))) {
+      // Line continuation: one space, and skip the next line's indent.
+      line += ' ';
+      i += (content[i+1] == '\n') ? 1 : 2;
+      while (i + 1 < content.size() &&
+             (content[i+1] == ' ' || content[i+1] == '\t')) {
+        i++;
+      }
+    } else if (c == '\n') {
+      AddLine(line, out);
+      line.clear();
+    } else {
+      line += c;
+    }
+  }
+  if (!line.empty()) AddLine(line, out);
+}
+
+void ReadMakefile(const std::string& path, MakefileText* out) {
+  StatFile(path, &out->mtime, &out->size);
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    out->ok = false;
+    return;
+  }
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  LexMakefile(content, out);
+  out->ok = true;
+}
+
+MakefilePrefetcher::MakefilePrefetcher(int nr_threads)
+    : pool_(nr_threads) {
+}
+
+MakefilePrefetcher::~MakefilePrefetcher() {
+}
+
+void MakefilePrefetcher::Prefetch(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!entries_.emplace(path, Entry()).second) return;
+  }
+  pool_.Submit([this, path]() { Load(path); });
+}
+
+void MakefilePrefetcher::Load(const std::string& path) {
+  std::unique_ptr<MakefileText> text(new MakefileText);
+  ReadMakefile(path, text.get());
+  for (const auto& inc : text->literal_includes) Prefetch(inc);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    Entry& e = entries_[path];
+    e.text = std::move(text);
+    e.done = true;
+  }
+  done_cv_.notify_all();
+}
+
+std::unique_ptr<MakefileText> MakefilePrefetcher::Get(const std::string& path) {
+  std::unique_ptr<MakefileText> text;
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    auto it = entries_.find(path);
+    if (it != entries_.end()) {
+      // Element references survive rehashing by concurrent Prefetch().
+      Entry& e = it->second;
+      done_cv_.wait(lock, [&]() { return e.done; });
+      text = std::move(e.text);
+    }
+  }
+
+  if (text) {
+    long mtime, size;
+    StatFile(path, &mtime, &size);
+    if (text->ok && mtime == text->mtime && size == text->size) {
+      return text;
+    }
+  }
+  text.reset(new MakefileText);
+  ReadMakefile(path, text.get());
+  return text;
+}
+
+}  // namespace gormake
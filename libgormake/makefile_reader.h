@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GORMAKE_LIBGORMAKE_MAKEFILE_READER_H_
+#define GORMAKE_LIBGORMAKE_MAKEFILE_READER_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "macros.h"
+#include "thread_pool.h"
+
+namespace gormake {
+
+// Coarse class of a makefile line, decided without any variable state.
+enum class MakefileLineKind {
+  BLANK,      // empty or whitespace only
+  COMMENT,    // starts with '#' (not a recipe line)
+  RECIPE,     // starts with a tab
+  INCLUDE,    // include / -include / sinclude
+  OTHER,      // directive, assignment or rule
+};
+
+struct MakefileLine {
+  MakefileLineKind kind;
+  std::string text;  // continuation lines already joined
+};
+
+// A makefile split into classified logical lines.
+struct MakefileText {
+  bool ok = false;  // the file could be read
+  std::vector<MakefileLine> lines;
+  // Files named by include lines that need no expansion.
+  std::vector<std::string> literal_includes;
+  // File identity when read, to notice later rewrites.
+  long mtime = 0;
+  long size = 0;
+};
+
+// Join continuation lines of |content| and classify each logical line.
+void LexMakefile(const std::string& content, MakefileText* out);
+
+// Read and lex a makefile.  Sets out->ok to false if it cannot be read.
+void ReadMakefile(const std::string& path, MakefileText* out);
+
+// Reads and lexes makefiles on a thread pool ahead of the parser.
+//
+// Prefetch() queues a file; once it is lexed, the files it includes by
+// literal name are queued too, so a chain of includes is read while the
+// parser is still evaluating earlier files.  Get() hands out a file in
+// whatever order the parser needs it, waiting only if it is not read yet.
+// Evaluation stays sequential; only I/O and lexing run in parallel.
+class MakefilePrefetcher {
+ public:
+  explicit MakefilePrefetcher(int nr_threads);
+  ~MakefilePrefetcher();
+
+  void Prefetch(const std::string& path);
+
+  // Return the lexed file.  Files that changed or appeared since they were
+  // prefetched (e.g. written by $(shell)) are read again.  Each prefetched
+  // copy is handed out once; asking again reads the file again.
+  std::unique_ptr<MakefileText> Get(const std::string& path);
+
+ private:
+  struct Entry {
+    bool done = false;
+    std::unique_ptr<MakefileText> text;
+  };
+
+  void Load(const std::string& path);
+
+  std::mutex mu_;
+  std::condition_variable done_cv_;
+  std::unordered_map<std::string, Entry> entries_;
+  // Declared last so that the workers are joined before the state above
+  // is destroyed.
+  ThreadPool pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(MakefilePrefetcher);
+};
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_MAKEFILE_READER_H_
@@ -16,6 +16,7 @@
 
 #include "mk_scanner.h"
 #include "build_engine_base.h"
+#include "dir_walker.h"
 
 #include <algorithm>
 #include <cerrno>
@@ -23,15 +24,12 @@
 #include <stdexcept>
 #include <cstdlib>
 #include <cstring>
-#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <sys/stat.h>
 
 namespace gormake {
 
-namespace fs = std::filesystem;
-
 // Helper: trim whitespace
 static std::string Trim(const std::string& s) {
   size_t start = 0;
@@ -101,22 +99,16 @@ bool MkScanner::ScanFile(const std::string& path) {
 }
 
 void MkScanner::ScanDirectory(const std::string& dir_path) {
-  for (auto& entry : fs::recursive_directory_iterator(dir_path)) {
-    if (entry.path().filename() == "Android.mk") {
-      std::string entry_str = entry.path().string();
-      // Skip common output/build directories
-      if (entry_str.find("/out/") != std::string::npos) continue;
-      if (entry_str.find("/bazel-") != std::string::npos) continue;
-      if (entry_str.find("/.git/") != std::string::npos) continue;
-      try {
-        ScanFile(entry_str);
-      } catch (const std::exception& e) {
-        std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
-                     entry_str.c_str(), e.what());
-      } catch (...) {
-        std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
-                     entry_str.c_str());
-      }
+  DirWalker walker({"Android.mk"});
+  for (const auto& entry_str : walker.FindFiles(dir_path, jobs_)) {
+    try {
+      ScanFile(entry_str);
+    } catch (const std::exception& e) {
+      std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
+                   entry_str.c_str(), e.what());
+    } catch (...) {
+      std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
+                   entry_str.c_str());
     }
   }
 }
@@ -16,10 +16,84 @@
 
 #include "rule_db.h"
 
+#include <algorithm>
 #include <memory>
 
 namespace gormake {
 
+namespace {
+
+// Built-in implicit rules, as in GNU make's default rule set.  Recipe lines
+// may carry the usual @, - and + prefixes.
+struct BuiltinRuleDef {
+  const char* target;
+  const char* prereq;
+  const char* recipes[2];
+};
+
+const BuiltinRuleDef kBuiltinRules[] = {
+  {"%.o", "%.c",   {"$(COMPILE.c) $(OUTPUT_OPTION) $<", nullptr}},
+  {"%.o", "%.cc",  {"$(COMPILE.cc) $(OUTPUT_OPTION) $<", nullptr}},
+  {"%.o", "%.cpp", {"$(COMPILE.cpp) $(OUTPUT_OPTION) $<", nullptr}},
+  {"%.o", "%.s",   {"$(COMPILE.s) -o $@ $<", nullptr}},
+  {"%.c", "%.y",   {"$(YACC.y) $<", "mv -f y.tab.c $@"}},
+  {"%.c", "%.l",   {"@$(RM) $@", "$(LEX.l) $< > $@"}},
+  {"%",   "%.o",   {"$(LINK.o) $^ $(LOADLIBES) $(LDLIBS) -o $@", nullptr}},
+  {"%",   "%.c",   {"$(LINK.c) $^ $(LOADLIBES) $(LDLIBS) -o $@", nullptr}},
+  {"%",   "%.cc",  {"$(LINK.cc) $^ $(LOADLIBES) $(LDLIBS) -o $@", nullptr}},
+};
+
+// The built-in rules, turned into Rule objects on first use and shared by
+// every RuleDB.
+const std::vector<std::unique_ptr<Rule>>& BuiltinRules() {
+  static const std::vector<std::unique_ptr<Rule>>* rules = [] {
+    auto* v = new std::vector<std::unique_ptr<Rule>>();
+    for (const auto& def : kBuiltinRules) {
+      auto rule = std::make_unique<Rule>();
+      rule->targets.push_back(def.target);
+      rule->prereqs.push_back(def.prereq);
+      rule->is_pattern = true;
+      for (const char* text : def.recipes) {
+        if (!text) break;
+        RecipeLine line;
+        while (*text == '@' || *text == '-' || *text == '+') {
+          if (*text == '@') line.silent = true;
+          if (*text == '-') line.ignore_error = true;
+          if (*text == '+') line.always_run = true;
+          text++;
+        }
+        line.text = text;
+        rule->recipes.push_back(line);
+      }
+      v->push_back(std::move(rule));
+    }
+    return v;
+  }();
+  return *rules;
+}
+
+// Key identifying a pattern rule for cancellation: target and prereqs.
+std::string PatternKey(const std::string& target, const Rule& rule) {
+  std::string key = target + ":";
+  for (const auto& p : rule.prereqs) key += " " + p;
+  return key;
+}
+
+bool MatchPattern(const PatternEntry& e, const std::string& target,
+                  std::string* stem) {
+  if (target.size() < e.prefix.size() + e.suffix.size()) return false;
+  if (target.compare(0, e.prefix.size(), e.prefix) != 0) return false;
+  if (target.compare(target.size() - e.suffix.size(), e.suffix.size(),
+                     e.suffix) != 0) {
+    return false;
+  }
+  *stem = target.substr(e.prefix.size(),
+                        target.size() - e.prefix.size() - e.suffix.size());
+  return true;
+}
+
+}  // namespace
+
 RuleDB::RuleDB() {
 }
 
@@ -56,12 +130,13 @@ void RuleDB::AddRecipe(const std::string& target, RecipeLine recipe) {
   }
 }
 
-const std::vector<Rule*> RuleDB::FindRules(const std::string& target) const {
+const std::vector<Rule*>& RuleDB::FindRules(const std::string& target) const {
+  static const std::vector<Rule*> kNoRules;
   auto it = target_to_rules_.find(target);
   if (it != target_to_rules_.end()) {
     return it->second;
   }
-  return {};
+  return kNoRules;
 }
 
 Rule* RuleDB::FindFirstRule(const std::string& target) const {
@@ -72,6 +147,65 @@ Rule* RuleDB::FindFirstRule(const std::string& target) const {
   return nullptr;
 }
 
+void RuleDB::CompilePatterns(bool builtins) {
+  patterns_.clear();
+  std::unordered_set<std::string> cancelled;
+
+  auto add = [this](Rule* rule, const std::string& t, bool builtin) {
+    size_t pct = t.find('%');
+    if (pct == std::string::npos) return;
+    PatternEntry e;
+    e.rule = rule;
+    e.prefix = t.substr(0, pct);
+    e.suffix = t.substr(pct + 1);
+    e.match_anything = e.prefix.empty() && e.suffix.empty();
+    e.builtin = builtin;
+    patterns_.push_back(std::move(e));
+  };
+
+  for (const auto& rule : pattern_rules_) {
+    for (const auto& t : rule->targets) {
+      if (rule->recipes.empty()) {
+        cancelled.insert(PatternKey(t, *rule));
+      } else {
+        add(rule.get(), t, false);
+      }
+    }
+  }
+  if (!builtins) return;
+  for (const auto& rule : BuiltinRules()) {
+    const std::string& t = rule->targets[0];
+    if (cancelled.count(PatternKey(t, *rule)) == 0) {
+      add(rule.get(), t, true);
+    }
+  }
+}
+
+void RuleDB::MatchPatternRules(const std::string& target, bool allow_anything,
+                               std::vector<PatternMatch>* out) const {
+  size_t first = out->size();
+  size_t nr_user = 0;
+  bool specific = false;
+  std::string stem;
+  for (const auto& e : patterns_) {
+    if (e.match_anything) continue;
+    if (MatchPattern(e, target, &stem)) {
+      out->push_back({e.rule, stem});
+      if (!e.builtin) nr_user++;
+      specific = true;
+    }
+  }
+  // Makefile rules with the shortest stem are the most specific.
+  std::stable_sort(out->begin() + first, out->begin() + first + nr_user,
+                   [](const PatternMatch& a, const PatternMatch& b) {
+                     return a.stem.size() < b.stem.size();
+                   });
+  if (!allow_anything || specific) return;
+  for (const auto& e : patterns_) {
+    if (e.match_anything) out->push_back({e.rule, target});
+  }
+}
+
 Rule* RuleDB::FindPatternRule(const std::string& target,
                                std::string& stem) const {
   for (const auto& rule : pattern_rules_) {
@@ -102,6 +236,37 @@ bool RuleDB::IsPhony(const std::string& target) const {
   return phony_targets_.count(target) > 0;
 }
 
+void RuleDB::MarkIntermediate(const std::string& target) {
+  intermediate_targets_.insert(target);
+}
+
+bool RuleDB::IsIntermediate(const std::string& target) const {
+  return intermediate_targets_.count(target) > 0;
+}
+
+void RuleDB::MarkSecondary(const std::string& target) {
+  // Listed secondary files are also intermediate; a bare .SECONDARY only
+  // protects intermediates from deletion.
+  if (target.empty()) {
+    all_secondary_ = true;
+  } else {
+    secondary_targets_.insert(target);
+    intermediate_targets_.insert(target);
+  }
+}
+
+bool RuleDB::IsSecondary(const std::string& target) const {
+  return all_secondary_ || secondary_targets_.count(target) > 0;
+}
+
+void RuleDB::MarkPrecious(const std::string& target) {
+  precious_targets_.insert(target);
+}
+
+bool RuleDB::IsPrecious(const std::string& target) const {
+  return precious_targets_.count(target) > 0;
+}
+
 std::string RuleDB::GetDefaultGoal() const {
   for (const auto& rule : rules_) {
     for (const auto& t : rule->targets) {
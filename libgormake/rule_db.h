@@ -42,12 +42,29 @@ struct Rule {
   std::vector<RecipeLine> recipes;
   bool is_phony = false;
   bool is_double_colon = false;  // ::= vs : syntax
+  bool is_grouped = false;     // &: one recipe run makes all targets
   bool is_pattern = false;     // contains % in target
+  bool second_expansion = false;  // prereqs hold text for .SECONDEXPANSION
   std::string pattern_stem;    // for pattern rules
 
   Rule() = default;
 };
 
+// A pattern rule whose target pattern has been split around its '%'.
+struct PatternEntry {
+  Rule* rule = nullptr;
+  std::string prefix;           // text before '%'
+  std::string suffix;           // text after '%'
+  bool match_anything = false;  // target pattern is just "%"
+  bool builtin = false;         // from the built-in rule table
+};
+
+// One candidate from RuleDB::MatchPatternRules().
+struct PatternMatch {
+  Rule* rule;
+  std::string stem;
+};
+
 // RuleDB stores all rules and provides lookup by target name.
 class RuleDB {
  public:
@@ -60,8 +77,9 @@ class RuleDB {
   // Add a recipe to the most recently added rule with matching target.
   void AddRecipe(const std::string& target, RecipeLine recipe);
 
-  // Find all rules for a given target.
-  const std::vector<Rule*> FindRules(const std::string& target) const;
+  // Find all rules for a given target.  The returned reference stays valid
+  // until the next AddRule().
+  const std::vector<Rule*>& FindRules(const std::string& target) const;
 
   // Find the first rule for a target (for simple cases).
   Rule* FindFirstRule(const std::string& target) const;
@@ -70,17 +88,44 @@ class RuleDB {
   // Returns the matched rule and sets stem.
   Rule* FindPatternRule(const std::string& target, std::string& stem) const;
 
+  // Build the pattern index from the makefile's pattern rules and, if
+  // |builtins| is set, the built-in implicit rules.  Pattern rules without
+  // recipes cancel the built-in rule with the same target and prerequisites.
+  // Must be called after parsing and before MatchPatternRules().
+  void CompilePatterns(bool builtins);
+
+  // Append every pattern rule whose target matches |target| to |out|, in
+  // search order: makefile rules by ascending stem length, then built-in
+  // rules.  Match-anything rules ("%") are skipped unless |allow_anything|
+  // is set, and also when a more specific pattern matched.
+  void MatchPatternRules(const std::string& target, bool allow_anything,
+                         std::vector<PatternMatch>* out) const;
+
   // Mark a target as phony.
   void MarkPhony(const std::string& target);
 
   // Check if a target is phony.
   bool IsPhony(const std::string& target) const;
 
+  // .INTERMEDIATE, .SECONDARY and .PRECIOUS.  Marking .SECONDARY with an
+  // empty target makes every target secondary.
+  void MarkIntermediate(const std::string& target);
+  bool IsIntermediate(const std::string& target) const;
+  void MarkSecondary(const std::string& target);
+  bool IsSecondary(const std::string& target) const;
+  void MarkPrecious(const std::string& target);
+  bool IsPrecious(const std::string& target) const;
+
   // Get all targets.
   const std::unordered_map<std::string, std::vector<Rule*>>& GetAllRules() const {
     return target_to_rules_;
   }
 
+  // Get explicit (non-pattern) rules in definition order.
+  const std::vector<std::unique_ptr<Rule>>& GetExplicitRules() const {
+    return rules_;
+  }
+
   // Get pattern rules.
   const std::vector<std::unique_ptr<Rule>>& GetPatternRules() const {
     return pattern_rules_;
@@ -101,6 +146,15 @@ class RuleDB {
 
   // Set of phony targets.
   std::unordered_set<std::string> phony_targets_;
+
+  // Special target sets.
+  std::unordered_set<std::string> intermediate_targets_;
+  std::unordered_set<std::string> secondary_targets_;
+  std::unordered_set<std::string> precious_targets_;
+  bool all_secondary_ = false;
+
+  // Index built by CompilePatterns().
+  std::vector<PatternEntry> patterns_;
 };
 
 }  // namespace gormake
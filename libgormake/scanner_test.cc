@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -21,18 +22,25 @@
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <string>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
+#include "bp_cache.h"
 #include "bp_engine.h"
 #include "bp_parser.h"
+#include "build_log.h"
 #include "cmake_scanner.h"
+#include "dep_graph.h"
+#include "dir_walker.h"
 #include "engine.h"
 #include "gn_scanner.h"
 #include "mk_scanner.h"
+#include "rule_db.h"
 #include "scons_scanner.h"
+#include "var_db.h"
 
 // ---------------------------------------------------------------------------
 // Helper utilities
@@ -109,10 +117,11 @@ static bool ValidateJson(const std::string& json) {
   return braces == 0 && brackets == 0 && !in_string;
 }
 
-// Capture stdout produced by |fn| (e.g., OutputJson).
-static std::string CaptureStdout(void (*fn)(void*), void* ctx) {
-  fflush(stdout);
-  int saved = dup(STDOUT_FILENO);
+// Capture what |fn| writes to |stream|, whose descriptor is |fd_no|.
+static std::string CaptureOutput(FILE* stream, int fd_no,
+                                 void (*fn)(void*), void* ctx) {
+  fflush(stream);
+  int saved = dup(fd_no);
   if (saved < 0) return "";
 
   char tmpl[] = "/tmp/gormake_capture_XXXXXX";
@@ -122,13 +131,13 @@ static std::string CaptureStdout(void (*fn)(void*), void* ctx) {
     return "";
   }
 
-  dup2(fd, STDOUT_FILENO);
+  dup2(fd, fd_no);
   close(fd);
 
   fn(ctx);
 
-  fflush(stdout);
-  dup2(saved, STDOUT_FILENO);
+  fflush(stream);
+  dup2(saved, fd_no);
   close(saved);
 
   std::ifstream ifs(tmpl);
@@ -138,19 +147,54 @@ static std::string CaptureStdout(void (*fn)(void*), void* ctx) {
   return content;
 }
 
+// Capture stdout produced by |fn| (e.g., OutputJson).
+static std::string CaptureStdout(void (*fn)(void*), void* ctx) {
+  return CaptureOutput(stdout, STDOUT_FILENO, fn, ctx);
+}
+
+// Capture stderr produced by |fn| (e.g., warnings).
+static std::string CaptureStderr(void (*fn)(void*), void* ctx) {
+  return CaptureOutput(stderr, STDERR_FILENO, fn, ctx);
+}
+
 // Wrappers for CaptureStdout to call OutputJson on each scanner type.
 static void CallBpOutputJson(void* ctx) {
   static_cast<gormake::BpEngine*>(ctx)->OutputJson();
 }
+// A BpEngine run whose stdout is captured.
+struct BpRun {
+  gormake::BpBuildOptions opts;
+  int result = -1;
+};
+static void CallBpRun(void* ctx) {
+  BpRun* run = static_cast<BpRun*>(ctx);
+  gormake::BpEngine engine;
+  run->result = engine.Run(run->opts);
+}
+// A BpRun whose stdout is kept, for callers that capture its stderr.
+struct BpRunOutput {
+  BpRun run;
+  std::string out;
+};
+static void CallBpRunOutput(void* ctx) {
+  BpRunOutput* r = static_cast<BpRunOutput*>(ctx);
+  r->out = CaptureStdout(CallBpRun, &r->run);
+}
 static void CallMkOutputJson(void* ctx) {
   static_cast<gormake::MkScanner*>(ctx)->OutputJson();
 }
 static void CallGnOutputJson(void* ctx) {
   static_cast<gormake::GnScanner*>(ctx)->OutputJson();
 }
+static void CallGnBuildAll(void* ctx) {
+  static_cast<gormake::GnScanner*>(ctx)->BuildAll();
+}
 static void CallCmakeOutputJson(void* ctx) {
   static_cast<gormake::CmakeScanner*>(ctx)->OutputJson();
 }
+static void CallCmakeBuildAll(void* ctx) {
+  static_cast<gormake::CmakeScanner*>(ctx)->BuildAll();
+}
 static void CallSconOutputJson(void* ctx) {
   static_cast<gormake::SconScanner*>(ctx)->OutputJson();
 }
@@ -223,6 +267,7 @@ static void TestBp() {
   if (pass) {
     gormake::BpBuildOptions opts;
     opts.bp_file_path = bp_path;
+    opts.build_dir = tmpdir + "out";
     opts.json_output = true;
     gormake::BpEngine engine;
     engine.Run(opts);
@@ -238,6 +283,458 @@ static void TestBp() {
   RemoveDir(tmpdir);
 }
 
+// test_bp_lexer: String literals with and without escapes, and with
+// backslash-newline continuations, which still count as lines for the
+// line numbers of later errors.  An unterminated string or comment is
+// reported with the line it starts on.
+static void TestBpLexer() {
+  std::string source =
+      "cc_binary {\n"
+      "    name: \"app\",\n"
+      "    plain: \"a b\",\n"
+      "    escaped: \"q\\\"x\\\\y\\tz\\n\",\n"
+      "    joined: \"ab\\\n"
+      "cd\",\n"
+      "    list: [\"1\\t1\", \"two\", \"3\\t3\"],\n"
+      "}\n";
+  gormake::BpParser parser;
+  gormake::BpFile result;
+  bool pass = parser.ParseSource(source, "Android.bp", &result) &&
+              result.modules.size() == 1;
+  if (pass) {
+    const gormake::BpMap& props = result.modules[0].properties;
+    auto str = [&](const char* key) {
+      const gormake::BpValue* v = props.Find(key);
+      return v != nullptr ? v->AsString() : std::string("<missing>");
+    };
+    const gormake::BpValue* list = props.Find("list");
+    pass = str("plain") == "a b" && str("escaped") == "q\"x\\y\tz\n" &&
+           str("joined") == "abcd" && list != nullptr &&
+           list->AsStringList() ==
+               std::vector<std::string>({"1\t1", "two", "3\t3"});
+  }
+
+  // The stray '}' is on line 3, after a string continued over two lines.
+  gormake::BpParser line_parser;
+  gormake::BpFile line_result;
+  pass = pass &&
+         !line_parser.ParseSource("x = \"a\\\nb\"\n}\n", "Android.bp",
+                                  &line_result) &&
+         line_parser.GetError().find("line 3") != std::string::npos;
+  ReportResult("test_bp_lexer", pass);
+
+  gormake::BpParser string_parser;
+  gormake::BpFile string_result;
+  bool errors = !string_parser.ParseSource(
+                    "x = \"a\"\ny = \"b\\\"\n", "Android.bp", &string_result) &&
+                string_parser.GetError() ==
+                    "unterminated string starting at line 2";
+
+  gormake::BpParser comment_parser;
+  gormake::BpFile comment_result;
+  errors = errors &&
+           !comment_parser.ParseSource("x = [\"a\"]\n/* open\n*\n",
+                                       "Android.bp", &comment_result) &&
+           comment_parser.GetError() ==
+               "unterminated /* comment starting at line 2";
+  ReportResult("test_bp_lex_errors", errors);
+}
+
+// test_bp_properties: Of two properties or map keys with the same name the
+// last wins, maps joined with '+' are merged with the right side winning,
+// and "+=" on a property appends to its list.
+static void TestBpProperties() {
+  std::string source =
+      "cc_binary {\n"
+      "    name: \"first\",\n"
+      "    name: \"app\",\n"
+      "    cflags: [\"-DA\"],\n"
+      "    cflags += [\"-DB\"],\n"
+      "    dups: { k: \"old\", k: \"new\" },\n"
+      "    merged: { a: \"1\", b: \"2\" } + { b: \"3\", c: \"4\" },\n"
+      "}\n";
+  gormake::BpParser parser;
+  gormake::BpFile result;
+  bool pass = parser.ParseSource(source, "Android.bp", &result) &&
+              result.modules.size() == 1 && result.modules[0].name == "app";
+  if (pass) {
+    const gormake::BpMap& props = result.modules[0].properties;
+    // The string at |key| of the map property |map_key|.
+    auto map_str = [&](const char* map_key, const char* key) {
+      const gormake::BpValue* m = props.Find(map_key);
+      const gormake::BpValue* v =
+          m != nullptr && m->IsMap() ? m->map().Find(key) : nullptr;
+      return v != nullptr ? v->AsString() : std::string("<missing>");
+    };
+    const gormake::BpValue* cflags = props.Find("cflags");
+    const gormake::BpValue* merged = props.Find("merged");
+    pass = cflags != nullptr &&
+           cflags->AsStringList() ==
+               std::vector<std::string>({"-DA", "-DB"}) &&
+           map_str("dups", "k") == "new" && merged != nullptr &&
+           merged->map().size() == 3 && map_str("merged", "a") == "1" &&
+           map_str("merged", "b") == "3" && map_str("merged", "c") == "4";
+  }
+  ReportResult("test_bp_properties", pass);
+}
+
+// test_bp_arena: Allocations larger than an arena block get a block of
+// their own without abandoning the current one, and a file with a very
+// long list parses intact.
+static void TestBpArena() {
+  gormake::BpArena arena;
+  std::string_view small = arena.Intern("small");
+  size_t one_block = arena.bytes_allocated();
+
+  std::vector<int64_t> big(100000);
+  for (size_t i = 0; i < big.size(); ++i) big[i] = static_cast<int64_t>(i);
+  const int64_t* copy = arena.Copy(big.data(), big.size());
+  size_t with_big = arena.bytes_allocated();
+  std::string_view after = arena.Intern("after");
+
+  bool pass = small == "small" && after == "after" &&
+              with_big >= one_block + big.size() * sizeof(int64_t) &&
+              arena.bytes_allocated() == with_big &&
+              std::equal(big.begin(), big.end(), copy);
+
+  std::string source = "cc_binary {\n    name: \"app\",\n    srcs: [";
+  for (int i = 0; i < 20000; ++i) {
+    source += "\"src" + std::to_string(i) + ".c\", ";
+  }
+  source += "],\n}\n";
+  gormake::BpParser parser;
+  gormake::BpFile result;
+  pass = pass && parser.ParseSource(source, "Android.bp", &result) &&
+         result.modules.size() == 1;
+  if (pass) {
+    const gormake::BpValue* srcs = result.modules[0].properties.Find("srcs");
+    std::vector<std::string> list =
+        srcs != nullptr ? srcs->AsStringList() : std::vector<std::string>();
+    pass = list.size() == 20000 && list.front() == "src0.c" &&
+           list.back() == "src19999.c";
+  }
+  ReportResult("test_bp_arena", pass);
+}
+
+// test_bp_build: A dry run with one job archives each static library
+// before the binary that links it.
+static void TestBpBuild() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_bp_build", false);
+    return;
+  }
+
+  std::string content =
+      "cc_binary {\n"
+      "    name: \"app\",\n"
+      "    srcs: [\"main.c\"],\n"
+      "    static_libs: [\"libutil\"],\n"
+      "}\n"
+      "\n"
+      "cc_library_static {\n"
+      "    name: \"libutil\",\n"
+      "    srcs: [\"util.c\"],\n"
+      "}\n";
+
+  if (!WriteFile(tmpdir + "Android.bp", content) ||
+      !WriteFile(tmpdir + "main.c", "") || !WriteFile(tmpdir + "util.c", "")) {
+    ReportResult("test_bp_build", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  BpRun run;
+  run.opts.bp_file_path = tmpdir + "Android.bp";
+  run.opts.build_dir = tmpdir + "out";
+  run.opts.dry_run = true;
+  run.opts.goals.push_back("app");
+  std::string out = CaptureStdout(CallBpRun, &run);
+
+  size_t archive = out.find("ar rcs " + tmpdir + "out/lib/libutil.a");
+  size_t link = out.find("-o " + tmpdir + "out/bin/app");
+  bool pass = run.result == 0 && archive != std::string::npos &&
+              link != std::string::npos && archive < link;
+
+  ReportResult("test_bp_build", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_bp_closures: A binary links the static libraries of its static
+// libraries too, after the ones that need them.
+static void TestBpClosures() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_bp_closures", false);
+    return;
+  }
+
+  std::string content =
+      "cc_binary {\n"
+      "    name: \"app\",\n"
+      "    srcs: [\"main.c\"],\n"
+      "    static_libs: [\"libmid\"],\n"
+      "}\n"
+      "\n"
+      "cc_library_static {\n"
+      "    name: \"libmid\",\n"
+      "    srcs: [\"mid.c\"],\n"
+      "    static_libs: [\"libbase\"],\n"
+      "}\n"
+      "\n"
+      "cc_library_static {\n"
+      "    name: \"libbase\",\n"
+      "    srcs: [\"base.c\"],\n"
+      "}\n";
+
+  if (!WriteFile(tmpdir + "Android.bp", content) ||
+      !WriteFile(tmpdir + "main.c", "") || !WriteFile(tmpdir + "mid.c", "") ||
+      !WriteFile(tmpdir + "base.c", "")) {
+    ReportResult("test_bp_closures", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  BpRun run;
+  run.opts.bp_file_path = tmpdir + "Android.bp";
+  run.opts.build_dir = tmpdir + "out";
+  run.opts.dry_run = true;
+  run.opts.goals.push_back("app");
+  std::string out = CaptureStdout(CallBpRun, &run);
+
+  // The link line, up to its output.
+  size_t link = out.find("-o " + tmpdir + "out/bin/app");
+  bool pass = run.result == 0 && link != std::string::npos;
+  if (pass) {
+    size_t begin = out.rfind('\n', link) + 1;  // 0 if on the first line
+    std::string line = out.substr(begin, link - begin);
+    size_t mid = line.find("out/lib/libmid.a");
+    size_t base = line.find("out/lib/libbase.a");
+    pass = mid != std::string::npos && base != std::string::npos &&
+           mid < base;
+  }
+
+  ReportResult("test_bp_closures", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_bp_defaults: A cc_defaults takes the properties of its own
+// defaults, and a cycle of defaults is reported instead of followed.
+static void TestBpDefaults() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_bp_defaults", false);
+    ReportResult("test_bp_defaults_cycle", false);
+    return;
+  }
+
+  std::string content =
+      "cc_defaults {\n"
+      "    name: \"base_defaults\",\n"
+      "    cflags: [\"-DBASE\"],\n"
+      "}\n"
+      "\n"
+      "cc_defaults {\n"
+      "    name: \"app_defaults\",\n"
+      "    defaults: [\"base_defaults\"],\n"
+      "    static_libs: [\"libutil\"],\n"
+      "}\n"
+      "\n"
+      "cc_defaults {\n"
+      "    name: \"ping_defaults\",\n"
+      "    defaults: [\"pong_defaults\"],\n"
+      "    cflags: [\"-DPING\"],\n"
+      "}\n"
+      "\n"
+      "cc_defaults {\n"
+      "    name: \"pong_defaults\",\n"
+      "    defaults: [\"ping_defaults\"],\n"
+      "}\n"
+      "\n"
+      "cc_binary {\n"
+      "    name: \"app\",\n"
+      "    defaults: [\"app_defaults\"],\n"
+      "    srcs: [\"app.c\"],\n"
+      "}\n"
+      "\n"
+      "cc_binary {\n"
+      "    name: \"cyclic\",\n"
+      "    defaults: [\"ping_defaults\"],\n"
+      "    srcs: [\"cyclic.c\"],\n"
+      "}\n"
+      "\n"
+      "cc_library_static {\n"
+      "    name: \"libutil\",\n"
+      "    srcs: [\"util.c\"],\n"
+      "}\n";
+
+  if (!WriteFile(tmpdir + "Android.bp", content) ||
+      !WriteFile(tmpdir + "app.c", "") || !WriteFile(tmpdir + "cyclic.c", "") ||
+      !WriteFile(tmpdir + "util.c", "")) {
+    ReportResult("test_bp_defaults", false);
+    ReportResult("test_bp_defaults_cycle", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  BpRun run;
+  run.opts.bp_file_path = tmpdir + "Android.bp";
+  run.opts.build_dir = tmpdir + "out";
+  run.opts.dry_run = true;
+  run.opts.goals = {"app", "cyclic"};
+  std::string out = CaptureStdout(CallBpRun, &run);
+
+  // The line of |out| that contains |s|, or "".
+  auto line_of = [&](const std::string& s) {
+    size_t pos = out.find(s);
+    if (pos == std::string::npos) return std::string();
+    size_t begin = out.rfind('\n', pos) + 1;  // 0 if on the first line
+    return out.substr(begin, out.find('\n', pos) - begin);
+  };
+  std::string app_compile = line_of(tmpdir + "app.c");
+  std::string app_link = line_of("-o " + tmpdir + "out/bin/app");
+  bool pass = run.result == 0 &&
+              app_compile.find("-DBASE") != std::string::npos &&
+              app_link.find("out/lib/libutil.a") != std::string::npos;
+  ReportResult("test_bp_defaults", pass);
+
+  std::string cyclic_compile = line_of(tmpdir + "cyclic.c");
+  pass = run.result == 0 &&
+         cyclic_compile.find("-DPING") != std::string::npos;
+  ReportResult("test_bp_defaults_cycle", pass);
+
+  RemoveDir(tmpdir);
+}
+
+// test_bp_tree: The Android.bp files under the root are parsed in
+// parallel but merged in path order, so of two modules with the same name
+// the one in b/ always wins over the one in c/ and the other is reported.
+// The root file is parsed only once.
+static void TestBpTree() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_bp_tree", false);
+    return;
+  }
+
+  auto dup_module = [](const std::string& flag) {
+    return "cc_binary {\n"
+           "    name: \"dup\",\n"
+           "    srcs: [\"dup.c\"],\n"
+           "    cflags: [\"" + flag + "\"],\n"
+           "}\n";
+  };
+  bool ok = WriteFile(tmpdir + "Android.bp", "") &&
+            mkdir((tmpdir + "a").c_str(), 0755) == 0 &&
+            mkdir((tmpdir + "b").c_str(), 0755) == 0 &&
+            mkdir((tmpdir + "c").c_str(), 0755) == 0 &&
+            WriteFile(tmpdir + "a/Android.bp", "") &&
+            WriteFile(tmpdir + "b/Android.bp", dup_module("-DFROM_B")) &&
+            WriteFile(tmpdir + "c/Android.bp", dup_module("-DFROM_C")) &&
+            WriteFile(tmpdir + "b/dup.c", "") &&
+            WriteFile(tmpdir + "c/dup.c", "");
+  if (!ok) {
+    ReportResult("test_bp_tree", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  // Repeat the run so that a merge that depends on thread timing shows up.
+  bool pass = true;
+  for (int i = 0; i < 5 && pass; ++i) {
+    BpRunOutput r;
+    r.run.opts.bp_file_path = tmpdir + "Android.bp";
+    r.run.opts.build_dir = tmpdir + "out";
+    r.run.opts.dry_run = true;
+    r.run.opts.verbose = true;
+    r.run.opts.goals.push_back("dup");
+    std::string err = CaptureStderr(CallBpRunOutput, &r);
+
+    const std::string warning = "duplicate module name 'dup'";
+    size_t first = err.find(warning);
+    pass = r.run.result == 0 &&
+           r.out.find(tmpdir + "b/dup.c") != std::string::npos &&
+           r.out.find("-DFROM_B") != std::string::npos &&
+           r.out.find("-DFROM_C") == std::string::npos &&
+           first != std::string::npos &&
+           err.find(warning, first + 1) == std::string::npos &&
+           err.find("Android.bp files: 4 parsed") != std::string::npos;
+  }
+
+  ReportResult("test_bp_tree", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_bp_cache: A second run takes both Android.bp files from the parse
+// cache; editing one, or adding a file that a glob in the other matches,
+// reparses only that file.
+static void TestBpCache() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_bp_cache", false);
+    return;
+  }
+
+  std::string root_bp = tmpdir + "Android.bp";
+  std::string sub_bp = tmpdir + "sub/Android.bp";
+  bool ok = mkdir((tmpdir + "sub").c_str(), 0755) == 0 &&
+            WriteFile(root_bp,
+                      "cc_binary {\n"
+                      "    name: \"app\",\n"
+                      "    srcs: [\"*.c\"],\n"
+                      "}\n") &&
+            WriteFile(sub_bp, "cc_library_static { name: \"libold\" }\n") &&
+            WriteFile(tmpdir + "a.c", "");
+  if (!ok) {
+    ReportResult("test_bp_cache", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  // One run over both files: the counts of the run and the parsed files.
+  struct CacheRun {
+    size_t hits = 0;
+    size_t misses = 0;
+    gormake::BpFile root;
+    gormake::BpFile sub;
+  };
+  auto run_cache = [&](CacheRun* run) {
+    gormake::BpParseCache cache(tmpdir + ".bp_cache");
+    cache.Load();
+    std::string error;
+    bool parsed = cache.Parse(root_bp, &run->root, &error) &&
+                  cache.Parse(sub_bp, &run->sub, &error);
+    run->hits = cache.hits();
+    run->misses = cache.misses();
+    return parsed && cache.Save();
+  };
+  // The number of sources of "app" in |run|.
+  auto app_srcs = [](const CacheRun& run) -> size_t {
+    if (run.root.modules.size() != 1) return 0;
+    const gormake::BpValue* srcs = run.root.modules[0].properties.Find("srcs");
+    return srcs != nullptr && srcs->IsList() ? srcs->list().size() : 0;
+  };
+
+  CacheRun first, second, edited, globbed;
+  bool pass = run_cache(&first) && first.misses == 2 && first.hits == 0;
+  pass = pass && run_cache(&second) && second.misses == 0 &&
+         second.hits == 2 && app_srcs(second) == 1 &&
+         second.sub.modules.size() == 1 &&
+         second.sub.modules[0].name == "libold";
+
+  pass = pass &&
+         WriteFile(sub_bp, "cc_library_static { name: \"libnew_name\" }\n") &&
+         run_cache(&edited) && edited.misses == 1 && edited.hits == 1 &&
+         edited.sub.modules.size() == 1 &&
+         edited.sub.modules[0].name == "libnew_name";
+
+  pass = pass && WriteFile(tmpdir + "b.c", "") && run_cache(&globbed) &&
+         globbed.misses == 1 && globbed.hits == 1 && app_srcs(globbed) == 2;
+
+  ReportResult("test_bp_cache", pass);
+  RemoveDir(tmpdir);
+}
+
 // test_mk: Create Android.mk with BUILD_STATIC_LIBRARY + BUILD_EXECUTABLE,
 // scan, verify 2 modules.
 static void TestMk() {
@@ -349,6 +846,184 @@ static void TestGn() {
   RemoveDir(tmpdir);
 }
 
+// test_gn_build_order: A source_set declared after its consumer is still
+// compiled before the consumer links, and its objects are linked in.
+static void TestGnBuildOrder() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_gn_build_order", false);
+    return;
+  }
+
+  std::string content =
+      "executable(\"app\") {\n"
+      "  sources = [\"main.c\"]\n"
+      "  deps = [\":parts\"]\n"
+      "}\n"
+      "\n"
+      "source_set(\"parts\") {\n"
+      "  sources = [\"parts.c\"]\n"
+      "}\n";
+
+  if (!WriteFile(tmpdir + "BUILD.gn", content)) {
+    ReportResult("test_gn_build_order", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::GnScanner scanner;
+  scanner.ScanDirectory(tmpdir);
+  scanner.SetDryRun(true);
+  scanner.SetJobs(1);
+  std::string out = CaptureStdout(CallGnBuildAll, &scanner);
+
+  size_t compile = out.find("/parts.c");
+  size_t link = out.find("-o " + tmpdir + "build/app ");
+  bool pass = scanner.GetTargets().size() == 2 &&
+              compile != std::string::npos && link != std::string::npos &&
+              compile < link &&
+              out.find("build/obj/parts/parts.o", link) != std::string::npos;
+
+  ReportResult("test_gn_build_order", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_gn_labels: Targets of the same name in different directories
+// resolve to distinct labels.
+static void TestGnLabels() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty() || mkdir((tmpdir + "a").c_str(), 0755) != 0 ||
+      mkdir((tmpdir + "b").c_str(), 0755) != 0 ||
+      mkdir((tmpdir + "c").c_str(), 0755) != 0) {
+    ReportResult("test_gn_labels", false);
+    return;
+  }
+
+  std::string util =
+      "static_library(\"util\") {\n"
+      "  sources = [\"util.c\"]\n"
+      "}\n";
+  std::string app =
+      "executable(\"app\") {\n"
+      "  sources = [\"main.c\"]\n"
+      "  deps = [\"//a:util\", \"//b:util\"]\n"
+      "}\n";
+
+  if (!WriteFile(tmpdir + "a/BUILD.gn", util) ||
+      !WriteFile(tmpdir + "b/BUILD.gn", util) ||
+      !WriteFile(tmpdir + "c/BUILD.gn", app)) {
+    ReportResult("test_gn_labels", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::GnScanner scanner;
+  scanner.ScanDirectory(tmpdir);
+  scanner.SetDryRun(true);
+  scanner.SetJobs(1);
+  std::string out = CaptureStdout(CallGnBuildAll, &scanner);
+
+  size_t link = out.find("build/app ");
+  bool pass = scanner.GetTargets().size() == 3 &&
+              link != std::string::npos &&
+              out.find("/a/build/util.a", link) != std::string::npos &&
+              out.find("/b/build/util.a", link) != std::string::npos;
+
+  ReportResult("test_gn_labels", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_gn_imports: A .gni imported by two BUILD.gn files defines its
+// variables for both.
+static void TestGnImports() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty() || mkdir((tmpdir + "a").c_str(), 0755) != 0 ||
+      mkdir((tmpdir + "b").c_str(), 0755) != 0 ||
+      mkdir((tmpdir + "build").c_str(), 0755) != 0) {
+    ReportResult("test_gn_imports", false);
+    return;
+  }
+
+  std::string gni = "common_defines = [\"COMMON=1\"]\n";
+  std::string a =
+      "import(\"//build/common.gni\")\n"
+      "static_library(\"liba\") {\n"
+      "  sources = [\"a.c\"]\n"
+      "  defines = common_defines\n"
+      "}\n";
+  std::string b =
+      "import(\"//build/common.gni\")\n"
+      "executable(\"appb\") {\n"
+      "  sources = [\"b.c\"]\n"
+      "  defines = common_defines\n"
+      "}\n";
+
+  if (!WriteFile(tmpdir + "build/common.gni", gni) ||
+      !WriteFile(tmpdir + "a/BUILD.gn", a) ||
+      !WriteFile(tmpdir + "b/BUILD.gn", b)) {
+    ReportResult("test_gn_imports", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::GnScanner scanner;
+  scanner.ScanDirectory(tmpdir);
+  const auto& targets = scanner.GetTargets();
+
+  std::vector<std::string> expected = {"COMMON=1"};
+  bool pass = targets.size() == 2 && targets[0].defines == expected &&
+              targets[1].defines == expected;
+
+  ReportResult("test_gn_imports", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_gn_scopes: A variable set in one BUILD.gn is not visible in
+// another.
+static void TestGnScopes() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty() || mkdir((tmpdir + "a").c_str(), 0755) != 0 ||
+      mkdir((tmpdir + "b").c_str(), 0755) != 0) {
+    ReportResult("test_gn_scopes", false);
+    return;
+  }
+
+  std::string a =
+      "local_flags = [\"-DLOCAL_A\"]\n"
+      "static_library(\"liba\") {\n"
+      "  sources = [\"a.c\"]\n"
+      "  cflags = local_flags\n"
+      "}\n";
+  std::string b =
+      "static_library(\"libb\") {\n"
+      "  sources = [\"b.c\"]\n"
+      "  cflags = local_flags\n"
+      "}\n";
+
+  if (!WriteFile(tmpdir + "a/BUILD.gn", a) ||
+      !WriteFile(tmpdir + "b/BUILD.gn", b)) {
+    ReportResult("test_gn_scopes", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::GnScanner scanner;
+  scanner.ScanDirectory(tmpdir);
+  const auto& targets = scanner.GetTargets();
+
+  bool pass = targets.size() == 2 && targets[0].name == "liba" &&
+              targets[0].cflags == std::vector<std::string>{"-DLOCAL_A"} &&
+              targets[1].name == "libb";
+  if (pass) {
+    for (const auto& f : targets[1].cflags) {
+      if (f == "-DLOCAL_A") pass = false;
+    }
+  }
+
+  ReportResult("test_gn_scopes", pass);
+  RemoveDir(tmpdir);
+}
+
 // test_cmake: Create CMakeLists.txt with add_library + add_executable, scan,
 // verify targets.
 static void TestCmake() {
@@ -401,6 +1076,94 @@ static void TestCmake() {
   RemoveDir(tmpdir);
 }
 
+// test_cmake_build_order: An executable declared before the chain of
+// static libraries it links is still linked after they are archived, and
+// each library after the ones it links.
+static void TestCmakeBuildOrder() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_cmake_build_order", false);
+    return;
+  }
+
+  std::string cmake_path = tmpdir + "CMakeLists.txt";
+  std::string content =
+      "cmake_minimum_required(VERSION 3.10)\n"
+      "project(Order C)\n"
+      "\n"
+      "add_executable(app main.c)\n"
+      "target_link_libraries(app PRIVATE mid)\n"
+      "\n"
+      "add_library(mid STATIC mid.c)\n"
+      "target_link_libraries(mid PUBLIC base)\n"
+      "\n"
+      "add_library(base STATIC base.c)\n";
+
+  if (!WriteFile(cmake_path, content) || !WriteFile(tmpdir + "main.c", "") ||
+      !WriteFile(tmpdir + "mid.c", "") || !WriteFile(tmpdir + "base.c", "")) {
+    ReportResult("test_cmake_build_order", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::CmakeScanner scanner;
+  bool ok = scanner.ScanFile(cmake_path);
+  scanner.SetDryRun(true);
+  scanner.SetJobs(1);
+  std::string out = CaptureStdout(CallCmakeBuildAll, &scanner);
+
+  size_t base = out.find("ar rcs build/base.a");
+  size_t mid = out.find("ar rcs build/mid.a");
+  size_t link = out.find("-o build/app ");
+  bool pass = ok && scanner.GetTargets().size() == 3 &&
+              base != std::string::npos && mid != std::string::npos &&
+              link != std::string::npos && base < mid && mid < link;
+
+  ReportResult("test_cmake_build_order", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_cmake_reader: Comments, parentheses and bracket arguments that the
+// command reader must not take as commands or expand.
+static void TestCmakeReader() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_cmake_reader", false);
+    return;
+  }
+
+  std::string cmake_path = tmpdir + "CMakeLists.txt";
+  std::string content =
+      "project(Reader C)\n"
+      "#[[ add_library(ghost STATIC ghost.c)\n"
+      "    add_executable(ghost2 ghost.c) ]]\n"
+      "set(V bad.c)  # stray ( in a comment\n"
+      "set(MAIN_SRC # pick one )\n"
+      "    main.c)\n"
+      "add_executable(app ${MAIN_SRC} util.c)\n"
+      "add_executable(br [=[a ]] ${V}]=] real.c)\n";
+
+  if (!WriteFile(cmake_path, content)) {
+    ReportResult("test_cmake_reader", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::CmakeScanner scanner;
+  bool ok = scanner.ScanFile(cmake_path);
+  const auto& targets = scanner.GetTargets();
+
+  bool pass = ok && targets.size() == 2 &&
+              targets[0].name == "app" &&
+              targets[0].srcs == std::vector<std::string>{"main.c", "util.c"} &&
+              targets[1].name == "br" &&
+              targets[1].srcs ==
+                  std::vector<std::string>{"a ]] ${V}", "real.c"};
+
+  ReportResult("test_cmake_reader", pass);
+  RemoveDir(tmpdir);
+}
+
 // test_scons: Create SConstruct with Library + Program, scan,
 // verify targets.
 static void TestScons() {
@@ -506,6 +1269,605 @@ static void TestMakefile() {
   RemoveDir(tmpdir);
 }
 
+// test_makefile_implicit_chain: Make a target through a chain of pattern
+// rules and delete the intermediate file.
+static void TestMakefileImplicitChain() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_implicit_chain", false);
+    return;
+  }
+
+  // a.out is made from a.src through the intermediate a.mid, which must be
+  // deleted afterwards.
+  std::string content =
+      "all: a.out\n"
+      "%.mid: %.src\n"
+      "\tcp $< $@\n"
+      "%.out: %.mid\n"
+      "\tcp $< $@\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content) ||
+      !WriteFile(tmpdir + "a.src", "src\n")) {
+    ReportResult("test_makefile_implicit_chain", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  struct stat st;
+  pass = pass && stat((tmpdir + "a.out").c_str(), &st) == 0;
+  pass = pass && stat((tmpdir + "a.mid").c_str(), &st) != 0;
+
+  ReportResult("test_makefile_implicit_chain", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_builtin_rules: The built-in %.o: %.c and %: %.o rules
+// make a program whose explicit rule repeats the implicit prerequisite,
+// which must be linked only once.
+static void TestMakefileBuiltinRules() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_builtin_rules", false);
+    return;
+  }
+
+  if (!WriteFile(tmpdir + "Makefile", "prog: prog.o\n") ||
+      !WriteFile(tmpdir + "prog.c", "int main(void) { return 0; }\n")) {
+    ReportResult("test_makefile_builtin_rules", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  struct stat st;
+  pass = pass && stat((tmpdir + "prog").c_str(), &st) == 0;
+
+  ReportResult("test_makefile_builtin_rules", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_multiple_rules: Merge the prerequisites of a target's
+// rules and run each double-colon rule on its own.
+static void TestMakefileMultipleRules() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_multiple_rules", false);
+    return;
+  }
+
+  // "out" merges the prerequisites of both of its rules; each double-colon
+  // rule of "log" runs its own recipe.
+  std::string content =
+      ".PHONY: all\n"
+      "all: out log\n"
+      "out: a\n"
+      "out: b\n"
+      "\techo $^ > $@\n"
+      "a b:\n"
+      "\ttouch $@\n"
+      "log:: a\n"
+      "\techo one >> $@\n"
+      "log:: b\n"
+      "\techo two >> $@\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content)) {
+    ReportResult("test_makefile_multiple_rules", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+  opts.jobs = 4;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  std::ifstream out(tmpdir + "out");
+  std::string out_content((std::istreambuf_iterator<char>(out)),
+                          std::istreambuf_iterator<char>());
+  std::ifstream log(tmpdir + "log");
+  std::string log_content((std::istreambuf_iterator<char>(log)),
+                          std::istreambuf_iterator<char>());
+  pass = pass && out_content == "b a\n" && log_content == "one\ntwo\n";
+
+  ReportResult("test_makefile_multiple_rules", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_grouped_targets: Run a grouped (&:) recipe once for all
+// of its targets.
+static void TestMakefileGroupedTargets() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_grouped_targets", false);
+    return;
+  }
+
+  // Both outputs come from a single run of the grouped recipe.
+  std::string content =
+      ".PHONY: all\n"
+      "all: gen.c gen.h\n"
+      "gen.c gen.h &:\n"
+      "\techo run >> runs.txt\n"
+      "\ttouch gen.c gen.h\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content)) {
+    ReportResult("test_makefile_grouped_targets", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+  opts.jobs = 4;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  std::ifstream runs(tmpdir + "runs.txt");
+  std::string runs_content((std::istreambuf_iterator<char>(runs)),
+                           std::istreambuf_iterator<char>());
+  pass = pass && runs_content == "run\n";
+
+  ReportResult("test_makefile_grouped_targets", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_oneshell: Run a .ONESHELL recipe in a single shell.
+static void TestMakefileOneShell() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_oneshell", false);
+    return;
+  }
+
+  // With .ONESHELL the shell variable survives into the second line.
+  std::string content =
+      ".ONESHELL:\n"
+      "out.txt:\n"
+      "\t@v=shared\n"
+      "\techo $$v > $@\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content)) {
+    ReportResult("test_makefile_oneshell", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  std::ifstream out(tmpdir + "out.txt");
+  std::string out_content((std::istreambuf_iterator<char>(out)),
+                          std::istreambuf_iterator<char>());
+  pass = pass && out_content == "shared\n";
+
+  ReportResult("test_makefile_oneshell", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_eval: define/endef, $(eval), computed lines and export.
+static void TestMakefileEval() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_eval", false);
+    return;
+  }
+
+  // Rules generated by $(eval $(call ...)) from a define, an assignment
+  // made by a computed line, and an exported variable visible to the
+  // recipe.
+  std::string content =
+      "define copy_rule\n"
+      "$(1).out: $(1).in\n"
+      "\tcp $$< $$@\n"
+      "OUTS += $(1).out\n"
+      "endef\n"
+      "export GREETING = hi\n"
+      "$(foreach n,a b,$(eval $(call copy_rule,$(n))))\n"
+      "ASSIGN_LINE = SUFFIX = !\n"
+      "$(ASSIGN_LINE)\n"
+      "all: $(OUTS)\n"
+      "\techo $$GREETING$(SUFFIX) > $@\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content) ||
+      !WriteFile(tmpdir + "a.in", "a\n") ||
+      !WriteFile(tmpdir + "b.in", "b\n")) {
+    ReportResult("test_makefile_eval", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.goals.push_back("all");
+  opts.silent = true;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  std::ifstream out(tmpdir + "all");
+  std::string out_content((std::istreambuf_iterator<char>(out)),
+                          std::istreambuf_iterator<char>());
+  std::ifstream b(tmpdir + "b.out");
+  std::string b_content((std::istreambuf_iterator<char>(b)),
+                        std::istreambuf_iterator<char>());
+  pass = pass && out_content == "hi!\n" && b_content == "b\n";
+
+  ReportResult("test_makefile_eval", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_env_export: A variable from the environment that the
+// makefile redefines is still exported to recipes, with its new value.
+static void TestMakefileEnvExport() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_env_export", false);
+    return;
+  }
+
+  std::string content =
+      "GORMAKE_TEST_VAR := $(GORMAKE_TEST_VAR)-extra\n"
+      "out.txt:\n"
+      "\techo \"[$$GORMAKE_TEST_VAR]\" > $@\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content)) {
+    ReportResult("test_makefile_env_export", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+
+  setenv("GORMAKE_TEST_VAR", "base", 1);
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+  unsetenv("GORMAKE_TEST_VAR");
+
+  std::ifstream out(tmpdir + "out.txt");
+  std::string out_content((std::istreambuf_iterator<char>(out)),
+                          std::istreambuf_iterator<char>());
+  pass = pass && out_content == "[base-extra]\n";
+
+  ReportResult("test_makefile_env_export", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_includes: Evaluate read-ahead includes in makefile order.
+static void TestMakefileIncludes() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_includes", false);
+    return;
+  }
+
+  // Nested includes are evaluated in order even though they are read ahead.
+  // A bare include, even with a CRLF ending, is a no-op.
+  std::string content =
+      "ORDER := top\n"
+      "include a.mk b.mk\n"
+      "-include missing.mk\n"
+      "include\n"
+      "sinclude\r\n"
+      "out.txt:\n"
+      "\techo $(ORDER) > $@\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content) ||
+      !WriteFile(tmpdir + "a.mk", "ORDER := $(ORDER) a\ninclude c.mk\n") ||
+      !WriteFile(tmpdir + "b.mk", "ORDER := $(ORDER) b\n") ||
+      !WriteFile(tmpdir + "c.mk", "ORDER := $(ORDER) c\n")) {
+    ReportResult("test_makefile_includes", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  std::ifstream out(tmpdir + "out.txt");
+  std::string out_content((std::istreambuf_iterator<char>(out)),
+                          std::istreambuf_iterator<char>());
+  pass = pass && out_content == "top a c b\n";
+
+  ReportResult("test_makefile_includes", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_second_expansion: Expand prerequisites again per target
+// after .SECONDEXPANSION.
+static void TestMakefileSecondExpansion() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_makefile_second_expansion", false);
+    return;
+  }
+
+  // $$@ is only meaningful in rules read after .SECONDEXPANSION; $$<
+  // names the first prerequisite of the target's earlier rules.
+  std::string content =
+      ".SECONDEXPANSION:\n"
+      "all: out.txt both.txt\n"
+      "out.txt: $$(basename $$@).in\n"
+      "\tcp $< $@\n"
+      "both.txt: out.in\n"
+      "\tcat $^ > $@\n"
+      "both.txt: $$(basename $$<).extra\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content) ||
+      !WriteFile(tmpdir + "out.in", "second\n") ||
+      !WriteFile(tmpdir + "out.extra", "extra\n")) {
+    ReportResult("test_makefile_second_expansion", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  std::ifstream out(tmpdir + "out.txt");
+  std::string out_content((std::istreambuf_iterator<char>(out)),
+                          std::istreambuf_iterator<char>());
+  std::ifstream both(tmpdir + "both.txt");
+  std::string both_content((std::istreambuf_iterator<char>(both)),
+                           std::istreambuf_iterator<char>());
+  pass = pass && out_content == "second\n" &&
+         both_content == "second\nextra\n";
+
+  ReportResult("test_makefile_second_expansion", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_makefile_vpath: Find prerequisites through vpath and VPATH.
+static void TestMakefileVpath() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty() || mkdir((tmpdir + "src").c_str(), 0755) != 0 ||
+      mkdir((tmpdir + "data").c_str(), 0755) != 0) {
+    ReportResult("test_makefile_vpath", false);
+    return;
+  }
+
+  // Sources are found through vpath and VPATH, and $^ names the real paths.
+  std::string content =
+      "vpath %.in src\n"
+      "VPATH = data\n"
+      "out.txt: a.in b.dat\n"
+      "\tcat $^ > $@\n";
+
+  if (!WriteFile(tmpdir + "Makefile", content) ||
+      !WriteFile(tmpdir + "src/a.in", "a\n") ||
+      !WriteFile(tmpdir + "data/b.dat", "b\n")) {
+    ReportResult("test_makefile_vpath", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  gormake::MakeOptions opts;
+  opts.makefile_path = tmpdir + "Makefile";
+  opts.directory = tmpdir;
+  opts.silent = true;
+
+  gormake::Engine engine;
+  bool pass = (engine.Run(opts) == 0);
+
+  std::ifstream out(tmpdir + "out.txt");
+  std::string out_content((std::istreambuf_iterator<char>(out)),
+                          std::istreambuf_iterator<char>());
+  pass = pass && out_content == "a\nb\n";
+
+  ReportResult("test_makefile_vpath", pass);
+  RemoveDir(tmpdir);
+}
+
+// Add a rule for |target| with |prereqs| (and a recipe if |recipe|).
+static void AddTestRule(gormake::RuleDB* rules, const std::string& target,
+                        const std::vector<std::string>& prereqs,
+                        bool recipe, bool double_colon) {
+  auto rule = std::make_unique<gormake::Rule>();
+  rule->targets.push_back(target);
+  rule->prereqs = prereqs;
+  rule->is_double_colon = double_colon;
+  if (recipe) {
+    gormake::RecipeLine line;
+    line.text = "touch $@";
+    rule->recipes.push_back(line);
+  }
+  rules->AddRule(std::move(rule));
+}
+
+// test_dep_graph: Freeze merges the prerequisites of a target's rules
+// (recipe rule first, no repeats), keeps double-colon rules apart, accepts
+// nodes interned later, and rejects a target with both : and :: rules.
+static void TestDepGraph() {
+  gormake::VariableDB vars;
+  gormake::RuleDB rules;
+  AddTestRule(&rules, "out", {"x"}, false, false);
+  AddTestRule(&rules, "out", {"y", "x"}, true, false);
+  AddTestRule(&rules, "dc", {"a"}, true, true);
+  AddTestRule(&rules, "dc", {"b"}, true, true);
+
+  gormake::DepGraph graph;
+  bool pass = graph.Freeze(rules, &vars);
+
+  auto names = [&](gormake::DepGraph::Row<gormake::NodeId> row) {
+    std::vector<std::string> out;
+    for (gormake::NodeId id : row) out.push_back(graph.Name(id));
+    return out;
+  };
+  gormake::NodeId out = graph.Find("out");
+  gormake::NodeId dc = graph.Find("dc");
+  pass = pass && out != gormake::kInvalidNode && dc != gormake::kInvalidNode &&
+         names(graph.Prereqs(out)) == std::vector<std::string>{"y", "x"} &&
+         graph.Rules(out).size() == 2 &&
+         graph.RecipeRule(out) == graph.Rules(out)[1] &&
+         !graph.IsDoubleColon(out) && graph.IsDoubleColon(dc) &&
+         names(graph.RulePrereqs(dc, 1)) == std::vector<std::string>{"b"};
+
+  size_t frozen = graph.FrozenCount();
+  gormake::NodeId late = graph.Intern("late.o");
+  pass = pass && late >= frozen && graph.Find("late.o") == late &&
+         graph.Name(late) == "late.o" && graph.Prereqs(late).empty() &&
+         graph.Rules(late).empty() && graph.RecipeRule(late) == nullptr;
+
+  gormake::RuleDB mixed;
+  AddTestRule(&mixed, "m", {"a"}, true, false);
+  AddTestRule(&mixed, "m", {"b"}, true, true);
+  gormake::DepGraph mixed_graph;
+  pass = pass && !mixed_graph.Freeze(mixed, &vars);
+
+  ReportResult("test_dep_graph", pass);
+}
+
+// test_dir_walker: Ignored directories are pruned by name at any depth or
+// by a path relative to the root, from the defaults, AddIgnorePattern() and
+// a .gormakeignore with comments.  Symlinked build files are reported,
+// symlinked directories are not entered, and the result does not depend
+// on the number of jobs.
+static void TestDirWalker() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_dir_walker", false);
+    return;
+  }
+
+  const char* dirs[] = {
+      "out", "extra", "prebuilts", "x", "x/prebuilts", "vendor",
+      "vendor/a", "vendor/a/gen", "vendor/a/b", "vendor/a/b/gen", "gen",
+      "kept", "lib",
+  };
+  bool ok = true;
+  for (const char* d : dirs) {
+    ok = ok && mkdir((tmpdir + d).c_str(), 0755) == 0;
+  }
+  const char* bp_files[] = {
+      "Android.bp", "out/Android.bp", "extra/Android.bp",
+      "prebuilts/Android.bp", "x/Android.bp", "x/prebuilts/Android.bp",
+      "vendor/a/gen/Android.bp", "vendor/a/b/gen/Android.bp",
+      "gen/Android.bp", "kept/Android.bp",
+  };
+  for (const char* f : bp_files) {
+    ok = ok && WriteFile(tmpdir + f, "");
+  }
+  ok = ok &&
+       WriteFile(tmpdir + ".gormakeignore",
+                 "# kept\n"
+                 "prebuilts   # a name, pruned at any depth\n"
+                 "\n"
+                 "/vendor/*/gen/\n") &&
+       WriteFile(tmpdir + "lib.bp", "") &&
+       symlink("../lib.bp", (tmpdir + "lib/Android.bp").c_str()) == 0 &&
+       symlink("kept", (tmpdir + "linked").c_str()) == 0;
+  if (!ok) {
+    ReportResult("test_dir_walker", false);
+    RemoveDir(tmpdir);
+    return;
+  }
+
+  std::vector<std::string> expected = {
+      tmpdir + "Android.bp",
+      tmpdir + "gen/Android.bp",
+      tmpdir + "kept/Android.bp",
+      tmpdir + "lib/Android.bp",
+      tmpdir + "vendor/a/b/gen/Android.bp",
+      tmpdir + "x/Android.bp",
+  };
+  bool pass = true;
+  for (int jobs : {1, 4}) {
+    gormake::DirWalker walker({"Android.bp"});
+    walker.AddIgnorePattern("extra");
+    pass = pass && walker.FindFiles(tmpdir, jobs) == expected;
+  }
+
+  ReportResult("test_dir_walker", pass);
+  RemoveDir(tmpdir);
+}
+
+// test_build_log: Parse a depfile and keep its headers across a reopen of
+// the build log.
+static void TestBuildLog() {
+  std::string tmpdir = MakeTempDir();
+  if (tmpdir.empty()) {
+    ReportResult("test_build_log", false);
+    return;
+  }
+
+  // As written by gcc -MMD -MP: continuations, an escaped space, and the
+  // phony targets of -MP that must not be taken as dependencies.
+  std::string depfile =
+      "out/a.o: src/a.c include/a.h \\\n"
+      " include/my\\ dir/b.h include/a.h\n"
+      "include/a.h:\n"
+      "include/my\\ dir/b.h:\n";
+  std::vector<std::string> deps;
+  gormake::ParseDepFile(depfile, &deps);
+  bool pass = deps.size() == 3 && deps[0] == "src/a.c" &&
+              deps[1] == "include/a.h" && deps[2] == "include/my dir/b.h";
+
+  std::string log_path = tmpdir + "build.log";
+  {
+    gormake::BuildLog log;
+    pass = pass && log.Open(log_path);
+    gormake::BuildLog::Entry entry;
+    entry.mtime_ns = 1;
+    entry.deps = {"old.h"};
+    log.Record("out/a.o", entry);
+    entry.mtime_ns = 42;
+    entry.command_hash = gormake::HashCommand("cc -c -o out/a.o src/a.c");
+    entry.deps = deps;
+    log.Record("out/a.o", entry);
+  }
+  gormake::BuildLog log;
+  gormake::BuildLog::Entry entry;
+  pass = pass && log.Open(log_path) && log.Lookup("out/a.o", &entry) &&
+         entry.mtime_ns == 42 && entry.deps == deps &&
+         entry.command_hash ==
+             gormake::HashCommand("cc -c -o out/a.o src/a.c") &&
+         entry.command_hash != gormake::HashCommand("cc -c -o out/a.o") &&
+         !log.Lookup("out/b.o", &entry);
+
+  ReportResult("test_build_log", pass);
+  RemoveDir(tmpdir);
+}
+
 // ---------------------------------------------------------------------------
 // Main
 // ---------------------------------------------------------------------------
@@ -516,11 +1878,38 @@ int main() {
   std::cout << "========================================\n\n";
 
   TestBp();
+  TestBpLexer();
+  TestBpProperties();
+  TestBpArena();
+  TestBpBuild();
+  TestBpClosures();
+  TestBpDefaults();
+  TestBpTree();
+  TestBpCache();
   TestMk();
   TestGn();
+  TestGnBuildOrder();
+  TestGnLabels();
+  TestGnImports();
+  TestGnScopes();
   TestCmake();
+  TestCmakeBuildOrder();
+  TestCmakeReader();
   TestScons();
   TestMakefile();
+  TestMakefileImplicitChain();
+  TestMakefileBuiltinRules();
+  TestMakefileMultipleRules();
+  TestMakefileGroupedTargets();
+  TestMakefileOneShell();
+  TestMakefileEval();
+  TestMakefileEnvExport();
+  TestMakefileIncludes();
+  TestMakefileSecondExpansion();
+  TestMakefileVpath();
+  TestDepGraph();
+  TestDirWalker();
+  TestBuildLog();
 
   std::cout << "\n========================================\n";
   std::cout << "  Results: " << g_pass << " passed, " << g_fail
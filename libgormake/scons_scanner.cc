@@ -16,13 +16,13 @@
 
 #include "scons_scanner.h"
 #include "build_engine_base.h"
+#include "dir_walker.h"
 
 #include <cctype>
 #include <cstdio>
 #include <stdexcept>
 #include <cstdlib>
 #include <cstring>
-#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <sys/stat.h>
@@ -31,8 +31,6 @@
 
 namespace gormake {
 
-namespace fs = std::filesystem;
-
 // --- Static helpers ---
 
 static std::string Trim(const std::string& s) {
@@ -93,23 +91,17 @@ bool SconScanner::ScanFile(const std::string& path) {
 }
 
 void SconScanner::ScanDirectory(const std::string& dir_path) {
-  for (auto& entry : fs::recursive_directory_iterator(dir_path)) {
-    std::string filename = entry.path().filename().string();
-    if (filename == "SConstruct" || filename == "SConscript" ||
-        filename == "SConscript.*") {
-      std::string entry_str = entry.path().string();
-      if (entry_str.find("/out/") != std::string::npos) continue;
-      if (entry_str.find("/build/") != std::string::npos) continue;
-      if (entry_str.find("/.git/") != std::string::npos) continue;
-      try {
-        ScanFile(entry_str);
-      } catch (const std::exception& e) {
-        std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
-                     entry_str.c_str(), e.what());
-      } catch (...) {
-        std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
-                     entry_str.c_str());
-      }
+  DirWalker walker({"SConstruct", "SConscript", "SConscript.*"});
+  walker.AddIgnorePattern("build");
+  for (const auto& entry_str : walker.FindFiles(dir_path, jobs_)) {
+    try {
+      ScanFile(entry_str);
+    } catch (const std::exception& e) {
+      std::fprintf(stderr, "gor_make: [warning] error parsing %s: %s\n",
+                   entry_str.c_str(), e.what());
+    } catch (...) {
+      std::fprintf(stderr, "gor_make: [warning] unknown error parsing %s\n",
+                   entry_str.c_str());
     }
   }
 }
@@ -249,7 +241,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
       t.src_dir = current_src_dir_;
       t.path = current_path_;
       t.srcs.push_back(string_args[0]);
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -266,7 +258,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
       for (size_t i = 1; i < string_args.size(); ++i) {
         t.srcs.push_back(string_args[i]);
       }
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -280,7 +272,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
       t.type = "simobject";
       t.src_dir = current_src_dir_;
       t.path = current_path_;
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -313,7 +305,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
           }
         }
       }
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -345,7 +337,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
           }
         }
       }
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -377,7 +369,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
           }
         }
       }
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -409,7 +401,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
           }
         }
       }
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -425,7 +417,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
         t.src_dir = current_src_dir_;
         t.path = current_path_;
         t.srcs.push_back(s);
-        targets_.push_back(t);
+        AddTarget(std::move(t));
       }
     }
     return;
@@ -442,7 +434,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
         t.src_dir = current_src_dir_;
         t.path = current_path_;
         t.srcs.push_back(s);
-        targets_.push_back(t);
+        AddTarget(std::move(t));
       }
     }
     return;
@@ -512,7 +504,7 @@ void SconScanner::ProcessLine(const std::string& raw_line) {
       t.type = "source_lib";
       t.src_dir = current_src_dir_;
       t.path = current_path_;
-      targets_.push_back(t);
+      AddTarget(std::move(t));
     }
     return;
   }
@@ -609,6 +601,11 @@ void SconScanner::OutputJson() const {
 // SconScanner — build engine (compile + link without ninja)
 // =====================================================================
 
+void SconScanner::AddTarget(SconTarget t) {
+  if (t.type == "library") library_index_.emplace(t.name, targets_.size());
+  targets_.push_back(std::move(t));
+}
+
 std::string SconScanner::GetOutputPath(const SconTarget& target) const {
   std::string dir = target.src_dir.empty() ? "." : target.src_dir;
   return dir + "/build/" + target.name;
@@ -703,15 +700,9 @@ bool SconScanner::LinkTarget(const SconTarget& target) {
     }
     // Link target libs — find local .a files first
     for (const auto& lib : target.link_libs) {
-      std::string lib_path;
-      for (const auto& t : targets_) {
-        if (t.name == lib && t.type == "library") {
-          lib_path = GetOutputPath(t) + ".a";
-          break;
-        }
-      }
-      if (!lib_path.empty()) {
-        cmd += " " + lib_path;
+      auto it = library_index_.find(lib);
+      if (it != library_index_.end()) {
+        cmd += " " + GetOutputPath(targets_[it->second]) + ".a";
       } else {
         cmd += " -l" + lib;
       }
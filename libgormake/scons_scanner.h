@@ -19,6 +19,7 @@
 
 #include <cstdint>
 #include <map>
+#include <unordered_map>
 #include <unordered_set>
 #include <string>
 #include <vector>
@@ -76,6 +77,9 @@ class SconScanner {
   static std::string JsonEscape(const std::string& s);
   static void OutputArray(const std::vector<std::string>& arr);
 
+  // Append a target to targets_, indexing it by name if it is a library.
+  void AddTarget(SconTarget t);
+
   // --- Build engine methods ---
   bool BuildTarget(const SconTarget& target);
   bool CompileSource(const SconTarget& target, const std::string& src,
@@ -89,6 +93,9 @@ class SconScanner {
                       const std::string& src_file) const;
 
   std::vector<SconTarget> targets_;
+  // Library name -> index in targets_ of the first library of that name,
+  // for linking against local libraries.
+  std::unordered_map<std::string, size_t> library_index_;
 
   // Track visited files to avoid infinite recursion
   std::unordered_set<std::string> visited_files_;
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GORMAKE_LIBGORMAKE_THREAD_POOL_H_
+#define GORMAKE_LIBGORMAKE_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "macros.h"
+
+namespace gormake {
+
+// A fixed set of worker threads running queued tasks in FIFO order.
+// Tasks may submit further tasks.
+class ThreadPool {
+ public:
+  // |nr_threads| <= 0 means one per hardware thread.
+  explicit ThreadPool(int nr_threads);
+
+  // Runs the tasks still queued, then joins the workers.
+  ~ThreadPool();
+
+  void Submit(std::function<void()> task);
+
+  // Block until every submitted task (including ones submitted by tasks)
+  // has finished.
+  void Wait();
+
+  size_t size() const { return threads_.size(); }
+
+ private:
+  void WorkerLoop();
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mu_;
+  std::condition_variable work_cv_;
+  std::condition_variable idle_cv_;
+  int running_ = 0;
+  bool stop_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+// Call fn(i) for every i in [0, n) on up to |jobs| threads (|jobs| <= 0
+// means one per hardware thread).  Returns when all calls have finished.
+void ParallelFor(size_t n, int jobs, const std::function<void(size_t)>& fn);
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_THREAD_POOL_H_
@@ -76,6 +76,11 @@ void VariableDB::InitDefaults() {
     {"LINK.cc",        "$(CXX) $(CXXFLAGS) $(CPPFLAGS) $(LDFLAGS)", VarFlavor::FLAVOR_RECURSIVE},
     {"COMPILE.c",      "$(CC) $(CFLAGS) $(CPPFLAGS) -c",  VarFlavor::FLAVOR_RECURSIVE},
     {"COMPILE.cc",     "$(CXX) $(CXXFLAGS) $(CPPFLAGS) -c", VarFlavor::FLAVOR_RECURSIVE},
+    {"COMPILE.cpp",    "$(COMPILE.cc)", VarFlavor::FLAVOR_RECURSIVE},
+    {"COMPILE.s",      "$(AS) $(ASFLAGS)", VarFlavor::FLAVOR_RECURSIVE},
+    {"YACC.y",         "$(YACC) $(YFLAGS)", VarFlavor::FLAVOR_RECURSIVE},
+    {"LEX.l",          "$(LEX) $(LFLAGS) -t", VarFlavor::FLAVOR_RECURSIVE},
+    {"LOADLIBES",      "",             VarFlavor::FLAVOR_RECURSIVE},
     {"OUTPUT_OPTION",  "-o $@",        VarFlavor::FLAVOR_RECURSIVE},
     {"OBJCFLAGS",      "",             VarFlavor::FLAVOR_RECURSIVE},
     {"FC",             "f77",          VarFlavor::FLAVOR_RECURSIVE},
@@ -565,6 +570,8 @@ void VariableDB::ImportEnvironment() {
     if (eq != nullptr) {
       std::string name(*env, eq - *env);
       std::string value(eq + 1);
+      // Like GNU make, never take the recipe shell from the environment.
+      if (name == "SHELL") continue;
       vars_[name] = Variable(name, value, VarFlavor::FLAVOR_RECURSIVE,
                             VarOrigin::ORIGIN_ENVIRONMENT);
       vars_[name].from_env = true;
@@ -585,10 +592,60 @@ void VariableDB::Set(const std::string& name, const std::string& value,
     }
     it->second.flavor = flavor;  // Update flavor to match assignment type
   } else {
-    vars_[name] = Variable(name, value, flavor, origin);
+    // := expands once, at assignment time.
+    std::string v = (flavor == VarFlavor::FLAVOR_SIMPLE) ? Expand(value) : value;
+    // Like GNU make, a variable from the environment stays exported when
+    // the makefile redefines it (e.g. PATH := $(PATH):/x).
+    bool from_env = it != vars_.end() && it->second.from_env;
+    vars_[name] = Variable(name, v, flavor, origin);
+    vars_[name].from_env = from_env;
   }
 }
 
+void VariableDB::SetExport(const std::string& name, VarExport state) {
+  export_states_[name] = state;
+}
+
+// True if |name| can be passed through the environment.
+static bool IsExportableName(const std::string& name) {
+  if (name.empty() || (name[0] >= '0' && name[0] <= '9')) return false;
+  for (char c : name) {
+    if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9'))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<std::string> VariableDB::ExportedEnvironment() const {
+  std::vector<std::string> env;
+  for (const auto& [name, var] : vars_) {
+    if (name == "SHELL" || !IsExportableName(name)) continue;
+    auto state = export_states_.find(name);
+    bool exported = false;
+    switch (state != export_states_.end() ? state->second
+                                          : VarExport::EXPORT_DEFAULT) {
+      case VarExport::EXPORT_EXPORT: exported = true; break;
+      case VarExport::EXPORT_UNEXPORT: exported = false; break;
+      case VarExport::EXPORT_DEFAULT:
+        exported = var.from_env ||
+                   var.origin == VarOrigin::ORIGIN_COMMAND ||
+                   (export_all_ && var.origin != VarOrigin::ORIGIN_DEFAULT &&
+                    var.origin != VarOrigin::ORIGIN_AUTOMATIC);
+        break;
+    }
+    if (!exported) continue;
+    // Environment values are passed through untouched.
+    std::string value = (var.flavor == VarFlavor::FLAVOR_SIMPLE ||
+                         var.origin == VarOrigin::ORIGIN_ENVIRONMENT)
+        ? var.value : Expand(var.value);
+    env.push_back(name + "=" + value);
+  }
+  std::sort(env.begin(), env.end());
+  return env;
+}
+
 void VariableDB::SetAutomatic(const std::string& name, const std::string& value) {
   if (!auto_scope_.empty()) {
     auto_scope_.back()[name] = value;
@@ -599,10 +656,11 @@ void VariableDB::SetAutomatic(const std::string& name, const std::string& value)
 }
 
 const Variable* VariableDB::Get(const std::string& name) const {
-  // Check automatic scope first
-  if (!auto_scope_.empty()) {
-    auto it = auto_scope_.back().find(name);
-    if (it != auto_scope_.back().end()) {
+  // Check automatic scopes first, innermost out
+  for (auto scope = auto_scope_.rbegin(); scope != auto_scope_.rend();
+       ++scope) {
+    auto it = scope->find(name);
+    if (it != scope->end()) {
       static thread_local Variable auto_var;
       auto_var = Variable(name, it->second, VarFlavor::FLAVOR_SIMPLE,
                          VarOrigin::ORIGIN_AUTOMATIC);
@@ -617,8 +675,8 @@ const Variable* VariableDB::Get(const std::string& name) const {
 }
 
 bool VariableDB::IsDefined(const std::string& name) const {
-  if (!auto_scope_.empty()) {
-    if (auto_scope_.back().count(name) > 0) return true;
+  for (const auto& scope : auto_scope_) {
+    if (scope.count(name) > 0) return true;
   }
   return vars_.count(name) > 0;
 }
@@ -688,21 +746,37 @@ std::string VariableDB::Expand(const std::string& str,
   return result;
 }
 
+bool VariableDB::IsFunctionName(const std::string& name) const {
+  return functions_.count(name) > 0 || name == "if" || name == "foreach" ||
+         name == "call" || name == "origin" || name == "value" ||
+         name == "eval";
+}
+
 std::string VariableDB::ExpandRef(const std::string& ref,
                                   const std::string& target,
                                   const std::string& prereqs,
                                   const std::string& stem) const {
-  // First, expand any nested references inside ref
+  // A literal function name gets its arguments unexpanded: CallFunction()
+  // expands them itself, and if/foreach/call/eval must control when.
+  size_t space_pos = ref.find_first_of(" \t");
+  if (space_pos != std::string::npos) {
+    std::string name = ref.substr(0, space_pos);
+    if (IsFunctionName(name)) {
+      return CallFunction(name, ref.substr(space_pos + 1), target, prereqs,
+                          stem);
+    }
+  }
+
+  // Otherwise expand any nested references inside ref first
   std::string expanded_ref = Expand(ref, target, prereqs, stem);
 
-  // Check for function call:  function-name args
-  size_t space_pos = expanded_ref.find_first_of(" \t");
+  // Check for a computed function call:  function-name args
+  space_pos = expanded_ref.find_first_of(" \t");
   if (space_pos != std::string::npos) {
     std::string name = expanded_ref.substr(0, space_pos);
     std::string raw_args = expanded_ref.substr(space_pos + 1);
     // Check if it's a known function
-    if (functions_.count(name) > 0 || name == "if" || name == "foreach" ||
-        name == "call" || name == "origin" || name == "value") {
+    if (IsFunctionName(name)) {
       return CallFunction(name, raw_args, target, prereqs, stem);
     }
     // Otherwise it's a variable reference like $(VAR:substitution)
@@ -787,6 +861,9 @@ std::string VariableDB::CallFunction(const std::string& name,
     std::string text = args[2];
     std::string result;
     size_t start = 0;
+    // The loop variable lives in its own scope, so it also works outside
+    // of recipes (e.g. around $(eval) at the top level).
+    const_cast<VariableDB*>(this)->PushAutomaticScope();
     while (start <= list.size()) {
       size_t sp = list.find(' ', start);
       std::string word = (sp == std::string::npos)
@@ -795,11 +872,11 @@ std::string VariableDB::CallFunction(const std::string& name,
         const_cast<VariableDB*>(this)->SetAutomatic(var_name, word);
         if (!result.empty()) result += " ";
         result += Expand(text, target, prereqs, stem);
-        const_cast<VariableDB*>(this)->auto_scope_.back().erase(var_name);
       }
       if (sp == std::string::npos) break;
       start = sp + 1;
     }
+    const_cast<VariableDB*>(this)->PopAutomaticScope();
     return result;
   }
 
@@ -811,12 +888,15 @@ std::string VariableDB::CallFunction(const std::string& name,
     const Variable* func_var = Get(func_name);
     if (!func_var) return "";
     std::string body = func_var->value;
-    // Set $1, $2, ... for arguments
-    const_cast<VariableDB*>(this)->PushAutomaticScope();
+    // Expand the arguments in the caller's scope, then bind $1, $2, ...
+    std::vector<std::string> values;
     for (size_t i = 1; i < args.size(); ++i) {
-      std::string arg_name = std::to_string(i);
-      const_cast<VariableDB*>(this)->SetAutomatic(arg_name,
-          Expand(args[i], target, prereqs, stem));
+      values.push_back(Expand(args[i], target, prereqs, stem));
+    }
+    const_cast<VariableDB*>(this)->PushAutomaticScope();
+    for (size_t i = 0; i < values.size(); ++i) {
+      const_cast<VariableDB*>(this)->SetAutomatic(std::to_string(i + 1),
+                                                  values[i]);
     }
     std::string result = Expand(body, target, prereqs, stem);
     const_cast<VariableDB*>(this)->PopAutomaticScope();
@@ -840,6 +920,14 @@ std::string VariableDB::CallFunction(const std::string& name,
     }
   }
 
+  if (name == "eval") {
+    // Expand once and parse the result as makefile text.  Commas are not
+    // separators here.
+    std::string text = Expand(raw_args, target, prereqs, stem);
+    if (eval_handler_) eval_handler_(text);
+    return "";
+  }
+
   if (name == "value") {
     auto args = SplitArgs(raw_args);
     if (args.empty()) return "";
@@ -43,6 +43,13 @@ enum class VarFlavor {
   FLAVOR_SIMPLE,     // VAR := value (expanded at assignment time)
 };
 
+// Export state set by the export/unexport directives.
+enum class VarExport {
+  EXPORT_DEFAULT,    // exported only if it came from the environment
+  EXPORT_EXPORT,     // export VAR
+  EXPORT_UNEXPORT,   // unexport VAR
+};
+
 struct Variable {
   std::string name;
   std::string value;
@@ -100,7 +107,25 @@ class VariableDB {
   void PushAutomaticScope();
   void PopAutomaticScope();
 
+  // export/unexport VAR.  The state sticks to the name, so it also applies
+  // to later assignments.
+  void SetExport(const std::string& name, VarExport state);
+
+  // Bare export/unexport: export every variable or only the default set.
+  void SetExportAll(bool export_all) { export_all_ = export_all; }
+
+  // "NAME=value" strings for every exported variable, with recursive
+  // values expanded.  SHELL is never included; see the engine.
+  std::vector<std::string> ExportedEnvironment() const;
+
+  // Handler for $(eval text).  |text| has already been expanded once.
+  using EvalHandler = std::function<void(const std::string&)>;
+  void SetEvalHandler(EvalHandler handler) { eval_handler_ = std::move(handler); }
+
  private:
+  // True for builtin and control-flow function names.
+  bool IsFunctionName(const std::string& name) const;
+
   // Expand a single $(...) or ${...} reference.
   std::string ExpandRef(const std::string& ref,
                         const std::string& target,
@@ -128,6 +153,15 @@ class VariableDB {
 
   // True while inside Expand() to prevent infinite recursion.
   mutable int expanding_depth_ = 0;
+
+  // Bare "export" was seen.
+  bool export_all_ = false;
+
+  // Explicit export/unexport state by variable name.
+  std::unordered_map<std::string, VarExport> export_states_;
+
+  // Parses the text of $(eval).
+  EvalHandler eval_handler_;
 };
 
 }  // namespace gormake
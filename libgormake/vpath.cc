@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vpath.h"
+
+#include <dirent.h>
+
+namespace gormake {
+
+static std::vector<std::string> SplitDirs(const std::string& s) {
+  std::vector<std::string> dirs;
+  size_t i = 0;
+  while (i < s.size()) {
+    while (i < s.size() && (s[i] == ':' || s[i] == ' ' || s[i] == '\t')) i++;
+    size_t start = i;
+    while (i < s.size() && s[i] != ':' && s[i] != ' ' && s[i] != '\t') i++;
+    if (i > start) {
+      std::string dir = s.substr(start, i - start);
+      while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+      dirs.push_back(dir);
+    }
+  }
+  return dirs;
+}
+
+// True if |name| matches a vpath pattern (one '%' matches any stem).
+static bool MatchPattern(const std::string& pattern, const std::string& name) {
+  size_t pct = pattern.find('%');
+  if (pct == std::string::npos) return pattern == name;
+  size_t suffix_len = pattern.size() - pct - 1;
+  return name.size() >= pct + suffix_len &&
+         name.compare(0, pct, pattern, 0, pct) == 0 &&
+         name.compare(name.size() - suffix_len, suffix_len, pattern,
+                      pct + 1, suffix_len) == 0;
+}
+
+VpathSearch::VpathSearch() {
+}
+
+VpathSearch::~VpathSearch() {
+}
+
+void VpathSearch::AddVpath(const std::string& pattern,
+                           const std::string& dirs) {
+  Entry e;
+  e.pattern = pattern;
+  e.dirs = SplitDirs(dirs);
+  if (!e.dirs.empty()) entries_.push_back(std::move(e));
+  resolved_.clear();
+}
+
+void VpathSearch::ClearVpath(const std::string& pattern) {
+  std::vector<Entry> kept;
+  for (auto& e : entries_) {
+    if (e.pattern != pattern) kept.push_back(std::move(e));
+  }
+  entries_.swap(kept);
+  resolved_.clear();
+}
+
+void VpathSearch::ClearAll() {
+  entries_.clear();
+  resolved_.clear();
+}
+
+void VpathSearch::SetVpathVariable(const std::string& dirs) {
+  vpath_dirs_ = SplitDirs(dirs);
+  resolved_.clear();
+}
+
+bool VpathSearch::DirHas(const std::string& dir, const std::string& file) {
+  auto it = listings_.find(dir);
+  if (it == listings_.end()) {
+    std::unordered_set<std::string> names;
+    DIR* d = opendir(dir.c_str());
+    if (d != nullptr) {
+      struct dirent* ent;
+      while ((ent = readdir(d)) != nullptr) names.insert(ent->d_name);
+      closedir(d);
+    }
+    it = listings_.emplace(dir, std::move(names)).first;
+  }
+  return it->second.count(file) > 0;
+}
+
+bool VpathSearch::SearchDirs(const std::vector<std::string>& dirs,
+                             const std::string& name, std::string* out) {
+  // "sub/file.c" is looked up as "file.c" in each "dir/sub".
+  size_t slash = name.rfind('/');
+  std::string sub = (slash == std::string::npos) ? "" : name.substr(0, slash);
+  std::string file = name.substr(slash + 1);
+  for (const auto& dir : dirs) {
+    std::string full_dir = sub.empty() ? dir : dir + "/" + sub;
+    if (DirHas(full_dir, file)) {
+      *out = dir + "/" + name;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string VpathSearch::Resolve(const std::string& name) {
+  // Absolute names are never searched.
+  if (empty() || name.empty() || name[0] == '/') return name;
+
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = resolved_.find(name);
+  if (it != resolved_.end()) return it->second;
+
+  std::string found = name;
+  bool done = false;
+  for (const auto& e : entries_) {
+    if (MatchPattern(e.pattern, name) && SearchDirs(e.dirs, name, &found)) {
+      done = true;
+      break;
+    }
+  }
+  if (!done) SearchDirs(vpath_dirs_, name, &found);
+  resolved_.emplace(name, found);
+  return found;
+}
+
+}  // namespace gormake
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2015 GORMAKE project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GORMAKE_LIBGORMAKE_VPATH_H_
+#define GORMAKE_LIBGORMAKE_VPATH_H_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "macros.h"
+
+namespace gormake {
+
+// Directory search for files that are not found where the makefile names
+// them: the vpath directive and the VPATH variable.
+//
+// Each search directory is listed once (one readdir pass) into a set of
+// entry names, and every lookup result is memoized, so resolving many
+// names over many directories costs no stat() calls.  Listings are not
+// refreshed, like GNU make's own directory cache.
+class VpathSearch {
+ public:
+  VpathSearch();
+  ~VpathSearch();
+
+  // vpath PATTERN DIRS.  |dirs| is separated by ':' or whitespace.
+  void AddVpath(const std::string& pattern, const std::string& dirs);
+
+  // vpath PATTERN: forget the directories of |pattern|.
+  void ClearVpath(const std::string& pattern);
+
+  // vpath: forget every pattern.
+  void ClearAll();
+
+  // Set the directories from the VPATH variable, searched last.
+  void SetVpathVariable(const std::string& dirs);
+
+  // True if any directory is set up.
+  bool empty() const { return entries_.empty() && vpath_dirs_.empty(); }
+
+  // Search the directories for |name|, which does not exist as given.
+  // Returns the path found, or |name| unchanged.  Safe to call from
+  // several threads.
+  std::string Resolve(const std::string& name);
+
+ private:
+  struct Entry {
+    std::string pattern;
+    std::vector<std::string> dirs;
+  };
+
+  // True if |dir|/|file| exists, per the cached listing of |dir|.
+  bool DirHas(const std::string& dir, const std::string& file);
+
+  // Look |name| up in |dirs|.  Sets |*out| and returns true if found.
+  bool SearchDirs(const std::vector<std::string>& dirs,
+                  const std::string& name, std::string* out);
+
+  std::vector<Entry> entries_;
+  std::vector<std::string> vpath_dirs_;
+
+  std::mutex mu_;
+  std::unordered_map<std::string, std::unordered_set<std::string>> listings_;
+  std::unordered_map<std::string, std::string> resolved_;
+
+  DISALLOW_COPY_AND_ASSIGN(VpathSearch);
+};
+
+}  // namespace gormake
+
+#endif  // GORMAKE_LIBGORMAKE_VPATH_H_